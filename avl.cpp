@@ -5,13 +5,16 @@ static uint32_t max(uint32_t lhs, uint32_t rhs) {
     return lhs < rhs ? rhs : lhs;
 }
 
-// maintain the height and cnt field
-static void avl_update(AVLNode* node) {
+// maintain the height and cnt field, and the user's augmentation
+static void avl_update(AVLNode* node, AVLAugment aug) {
     node->height = 1 + max(avl_height(node->left), avl_height(node->right));
     node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    if (aug) {
+        aug(node);
+    }
 }
 
-static AVLNode* rot_left (AVLNode* node) {
+static AVLNode* rot_left (AVLNode* node, AVLAugment aug) {
     AVLNode* parent = node->parent;
     AVLNode* new_node = node->right;
     AVLNode* inner = new_node->left;
@@ -26,12 +29,12 @@ static AVLNode* rot_left (AVLNode* node) {
     new_node->left = node;
     node->parent = new_node;
     // auxiliary data
-    avl_update(node);
-    avl_update(new_node);
+    avl_update(node, aug);
+    avl_update(new_node, aug);
     return new_node;
 }
 
-static AVLNode* rot_right(AVLNode* node) {
+static AVLNode* rot_right(AVLNode* node, AVLAugment aug) {
     AVLNode* parent = node->parent;
     AVLNode* new_node = node->left;
     AVLNode* inner = new_node->right;
@@ -46,29 +49,29 @@ static AVLNode* rot_right(AVLNode* node) {
     new_node->right = node;
     node->parent = new_node;
     // auxiliary data
-    avl_update(node);
-    avl_update(new_node);
+    avl_update(node, aug);
+    avl_update(new_node, aug);
     return new_node;
 }
 
 // the left subtree is taller by 2
-static AVLNode* avl_fix_left(AVLNode* node) {
+static AVLNode* avl_fix_left(AVLNode* node, AVLAugment aug) {
     if (avl_height(node->left->left) < avl_height(node->left->right)) {
-        node->left = rot_left(node->left);  // Transformation 2
+        node->left = rot_left(node->left, aug);  // Transformation 2
     }
-    return rot_right(node);  // Transformation 1
+    return rot_right(node, aug);  // Transformation 1
 }
 
 // the right subtree is taller by 2
-static AVLNode* avl_fix_right(AVLNode* node) {
+static AVLNode* avl_fix_right(AVLNode* node, AVLAugment aug) {
     if (avl_height(node->right->right) < avl_height(node->right->left)) {
-        node->right = rot_right(node->right);
+        node->right = rot_right(node->right, aug);
     }
-    return rot_left(node);
+    return rot_left(node, aug);
 }
 
 // fix imbalanced nodes and maintain invariants until the root is reached
-AVLNode* avl_fix(AVLNode* node) {
+AVLNode* avl_fix(AVLNode* node, AVLAugment aug) {
     while (true) {
         AVLNode** from = &node; // save the fixed subtree here
         AVLNode* parent = node->parent;
@@ -77,14 +80,14 @@ AVLNode* avl_fix(AVLNode* node) {
             from = parent->left == node ? &parent->left : &parent->right;
         }   // else save to the local variable `node`
         // auxiliary data
-        avl_update(node);
+        avl_update(node, aug);
         // fix the height difference of 2
         uint32_t l = avl_height(node->left);
         uint32_t r = avl_height(node->right);
         if (l == r + 2) {
-            *from = avl_fix_left(node);
+            *from = avl_fix_left(node, aug);
         } else if (r == l + 2) {
-            *from = avl_fix_right(node);
+            *from = avl_fix_right(node, aug);
         }
         // root node, stop
         if (!parent) {
@@ -96,7 +99,7 @@ AVLNode* avl_fix(AVLNode* node) {
 }
 
 // detach a node where 1 of its children is empty
-static AVLNode* avl_del_easy (AVLNode* node) {
+static AVLNode* avl_del_easy (AVLNode* node, AVLAugment aug) {
     assert(!node->left || !node->right);    // at most 1 child
     AVLNode* child = node->left ? node->left : node->right; // can be NULL
     AVLNode* parent = node->parent;
@@ -111,14 +114,14 @@ static AVLNode* avl_del_easy (AVLNode* node) {
     AVLNode** from = parent->left == node ? &parent->left : &parent->right;
     *from = child;
     // rebalance the updated tree
-    return avl_fix(parent);
+    return avl_fix(parent, aug);
 }
 
 // detach a node and returns the new root of the tree
-AVLNode* avl_del(AVLNode* node) {
+AVLNode* avl_del(AVLNode* node, AVLAugment aug) {
     // the easy case of 0 or 1 child
     if (!node->left || !node->right) {
-        return avl_del_easy(node);
+        return avl_del_easy(node, aug);
     }
     // find the in-order successor
     AVLNode* victim = node->right;
@@ -126,7 +129,7 @@ AVLNode* avl_del(AVLNode* node) {
         victim = victim->left;
     }
     // detach the successor
-    AVLNode* root = avl_del_easy(victim);
+    AVLNode* root = avl_del_easy(victim, aug);
     // swap with the successor
     *victim = *node; // left, right, parent
     if (victim->left) {
@@ -142,6 +145,10 @@ AVLNode* avl_del(AVLNode* node) {
         from = parent->left == node ? &parent->left : &parent->right;
     }
     *from = victim;
+    // the augmentation of the path still has the removed node
+    for (AVLNode* cur = victim; aug && cur; cur = cur->parent) {
+        avl_update(cur, aug);
+    }
     return root;
 }
 
@@ -173,4 +180,115 @@ AVLNode* avl_offset(AVLNode* node, int64_t offset) {
         }
     }
     return node;
-}
\ No newline at end of file
+}
+
+// the 0-based position of the node in the tree
+int64_t avl_rank(AVLNode* node) {
+    int64_t rank = avl_cnt(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+static void avl_set_parent(AVLNode* node, AVLNode* parent) {
+    if (node) {
+        node->parent = parent;
+    }
+}
+
+// the left tree is taller, `mid` replaces a node on its right spine
+// whose height is close to the right tree, then rebalance upwards
+static AVLNode* avl_join_right(AVLNode* left, AVLNode* mid, AVLNode* right, AVLAugment aug) {
+    AVLNode* parent = NULL;
+    AVLNode* node = left;
+    while (avl_height(node) > avl_height(right) + 1) {
+        parent = node;
+        node = node->right;
+    }
+    mid->left = node;
+    mid->right = right;
+    mid->parent = parent;
+    avl_set_parent(node, mid);
+    avl_set_parent(right, mid);
+    if (parent) {
+        parent->right = mid;
+    }
+    return avl_fix(mid, aug);
+}
+
+static AVLNode* avl_join_left(AVLNode* left, AVLNode* mid, AVLNode* right, AVLAugment aug) {
+    AVLNode* parent = NULL;
+    AVLNode* node = right;
+    while (avl_height(node) > avl_height(left) + 1) {
+        parent = node;
+        node = node->left;
+    }
+    mid->left = left;
+    mid->right = node;
+    mid->parent = parent;
+    avl_set_parent(left, mid);
+    avl_set_parent(node, mid);
+    if (parent) {
+        parent->left = mid;
+    }
+    return avl_fix(mid, aug);
+}
+
+// O(|height(left) - height(right)|)
+AVLNode* avl_join(AVLNode* left, AVLNode* mid, AVLNode* right, AVLAugment aug) {
+    avl_set_parent(left, NULL);
+    avl_set_parent(right, NULL);
+    if (avl_height(left) > avl_height(right) + 1) {
+        return avl_join_right(left, mid, right, aug);
+    }
+    if (avl_height(right) > avl_height(left) + 1) {
+        return avl_join_left(left, mid, right, aug);
+    }
+    mid->left = left;
+    mid->right = right;
+    mid->parent = NULL;
+    avl_set_parent(left, mid);
+    avl_set_parent(right, mid);
+    return avl_fix(mid, aug);
+}
+
+// the first node of the right tree is used as the middle node
+AVLNode* avl_join2(AVLNode* left, AVLNode* right, AVLAugment aug) {
+    if (!left || !right) {
+        return left ? left : right;
+    }
+    AVLNode* first = right;
+    while (first->left) {
+        first = first->left;
+    }
+    right = avl_del(first, aug);
+    avl_init(first);
+    return avl_join(left, first, right, aug);
+}
+
+// O(log N), the joins along the path add up to the tree height
+void avl_split(AVLNode* root, uint32_t rank, AVLNode** left, AVLNode** right,
+    AVLAugment aug)
+{
+    if (!root) {
+        *left = *right = NULL;
+        return;
+    }
+    AVLNode* l = root->left;
+    AVLNode* r = root->right;
+    avl_set_parent(l, NULL);
+    avl_set_parent(r, NULL);
+    avl_init(root);
+    if (rank <= avl_cnt(l)) {
+        AVLNode* rest = NULL;
+        avl_split(l, rank, left, &rest, aug);
+        *right = avl_join(rest, root, r, aug);
+    } else {
+        AVLNode* rest = NULL;
+        avl_split(r, rank - avl_cnt(l) - 1, &rest, right, aug);
+        *left = avl_join(l, root, rest, aug);
+    }
+}
@@ -28,7 +28,18 @@ inline uint32_t avl_cnt(AVLNode* node) {
     return node ? node->cnt : 0;
 }
 
+// maintains extra subtree data like `cnt`, e.g., a sum of the subtree,
+// called on a node after its children are updated
+typedef void (*AVLAugment)(AVLNode* node);
+
 // API
-AVLNode* avl_fix(AVLNode* node);
-AVLNode* avl_del(AVLNode* node);
-AVLNode* avl_offset(AVLNode* node, int64_t offset);
\ No newline at end of file
+AVLNode* avl_fix(AVLNode* node, AVLAugment aug = NULL);
+AVLNode* avl_del(AVLNode* node, AVLAugment aug = NULL);
+AVLNode* avl_offset(AVLNode* node, int64_t offset);
+int64_t avl_rank(AVLNode* node);
+// all nodes in `left` < `mid` < all nodes in `right`, returns the new root
+AVLNode* avl_join(AVLNode* left, AVLNode* mid, AVLNode* right, AVLAugment aug = NULL);
+AVLNode* avl_join2(AVLNode* left, AVLNode* right, AVLAugment aug = NULL);
+// the first `rank` nodes go to `left`, the rest go to `right`
+void avl_split(AVLNode* root, uint32_t rank, AVLNode** left, AVLNode** right,
+    AVLAugment aug = NULL);
\ No newline at end of file
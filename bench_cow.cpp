@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "hashtable.h"
+#include "common.h"
+
+// the copy-on-write caused by GETs while a forked child holds a snapshot:
+// a page the parent writes is copied, and the child's original becomes
+// private to it, as counted by `Private_Dirty` in /proc/<child>/smaps_rollup;
+// the access clock in the Entry as before, and in the side arrays as now:
+//   ./bench_cow [nkeys] [ngets]
+
+// the Entry with the per-key metadata inline
+struct InlineEntry {
+    HNode node;
+    std::string key;
+    size_t heap_idx = -1;
+    uint64_t atime_ms = 0;
+    uint32_t type = 0;
+    std::string str;
+};
+
+// the Entry with the per-key metadata in `MetaChunk`
+struct SideEntry {
+    HNode node;
+    std::string key;
+    uint32_t meta_id = -1;
+    uint32_t type = 0;
+    std::string str;
+};
+
+const size_t k_meta_chunk = 4096;
+
+struct TTLSlot {
+    size_t heap_idx = -1;
+    void* owner = NULL;
+};
+
+struct MetaChunk {
+    uint64_t atime_ms[k_meta_chunk] = {};
+    TTLSlot ttl[k_meta_chunk];
+};
+
+static std::vector<MetaChunk*> g_meta;
+
+static void meta_new(InlineEntry*, uint32_t) {}
+
+static void meta_new(SideEntry* ent, uint32_t id) {
+    if (id / k_meta_chunk == g_meta.size()) {
+        g_meta.push_back(new MetaChunk());
+    }
+    ent->meta_id = id;
+}
+
+static uint64_t &entry_atime(InlineEntry* ent) {
+    return ent->atime_ms;
+}
+
+static uint64_t &entry_atime(SideEntry* ent) {
+    return g_meta[ent->meta_id / k_meta_chunk]->atime_ms[ent->meta_id % k_meta_chunk];
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// in kB, -1 if not available
+static long private_dirty(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    long kb = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        if (1 == sscanf(line, "Private_Dirty: %ld kB", &kb)) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+static uint64_t key_hash(const std::string &key) {
+    return str_hash((const uint8_t*)key.data(), key.size());
+}
+
+template <class E>
+static bool entry_eq(HNode* lhs, HNode* rhs) {
+    return container_of(lhs, E, node)->key == container_of(rhs, E, node)->key;
+}
+
+template <class E>
+static void run(const char* name, size_t nkeys, size_t ngets) {
+    HMap hmap;
+    std::vector<E*> ents(nkeys);
+    char buf[32];
+    for (size_t i = 0; i < nkeys; i++) {
+        E* ent = new E();
+        snprintf(buf, sizeof(buf), "key:%zu", i);
+        ent->key = buf;
+        ent->node.hcode = key_hash(ent->key);
+        ent->str.assign(32, 'x');
+        meta_new(ent, (uint32_t)i);
+        hm_insert(&hmap, &ent->node);
+        ents[i] = ent;
+    }
+    // finish the rehashing
+    for (E* ent : ents) {
+        hm_lookup(&hmap, &ent->node, &entry_eq<E>);
+    }
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        for (;;) {
+            pause();    // the snapshot
+        }
+    }
+    usleep(100 * 1000);
+    long base = private_dirty(pid);
+
+    E probe;
+    uint64_t rng = 88172645463325252ull;
+    size_t bytes = 0;
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < ngets; i++) {
+        // xorshift
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        snprintf(buf, sizeof(buf), "key:%zu", (size_t)(rng % nkeys));
+        probe.key = buf;
+        probe.node.hcode = key_hash(probe.key);
+        HNode* node = hm_lookup(&hmap, &probe.node, &entry_eq<E>);
+        assert(node);
+        E* ent = container_of(node, E, node);
+        entry_atime(ent) = t0 + i;
+        bytes += ent->str.size();
+    }
+    uint64_t t1 = get_monotonic_nsec();
+    long dirty = private_dirty(pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    printf("%-7s keys: %zu gets: %zu copied: %ld kB (%.1f B/get) gets/s: %.0f\n",
+        name, nkeys, ngets, dirty - base, (dirty - base) * 1024.0 / ngets,
+        ngets * 1e9 / (t1 - t0));
+    assert(bytes == ngets * 32);
+    hm_clear(&hmap);
+    for (E* ent : ents) {
+        delete ent;
+    }
+    for (MetaChunk* chunk : g_meta) {
+        delete chunk;
+    }
+    g_meta.clear();
+}
+
+int main(int argc, char** argv) {
+    size_t nkeys = argc > 1 ? (size_t)atoll(argv[1]) : 1000 * 1000;
+    size_t ngets = argc > 2 ? (size_t)atoll(argv[2]) : 100 * 1000;
+    if (private_dirty(getpid()) < 0) {
+        fprintf(stderr, "no /proc/<pid>/smaps_rollup\n");
+        return 1;
+    }
+    run<InlineEntry>("inline", nkeys, ngets);
+    run<SideEntry>("side", nkeys, ngets);
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_cow.cpp hashtable.cpp mem.cpp ebr.cpp -o bench_cow
@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+
+#include "hashtable.h"
+#include "common.h"
+#include "mem.h"
+
+// random lookups in a big hashtable, with or without huge pages:
+//   ./bench_hashtable [nkeys] [--hugepages]
+
+struct Data {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool data_eq(HNode* lhs, HNode* rhs) {
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+static uint64_t hash_u64(uint64_t x) {
+    return str_hash((const uint8_t*)&x, sizeof(x));
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// the dTLB load miss counter, -1 if not permitted
+static int dtlb_open() {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char** argv) {
+    size_t nkeys = 1 << 22;
+    bool hugepages = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--hugepages")) {
+            hugepages = true;
+            mem_use_hugepages(true);
+        } else {
+            nkeys = (size_t)atoll(argv[i]);
+        }
+    }
+
+    HMap hmap;
+    std::vector<Data> data(nkeys);
+    for (size_t i = 0; i < nkeys; i++) {
+        data[i].key = i;
+        data[i].node.hcode = hash_u64(i);
+        hm_insert(&hmap, &data[i].node);
+    }
+    // finish the rehashing
+    for (size_t i = 0; i < nkeys; i++) {
+        hm_lookup(&hmap, &data[i].node, &data_eq);
+    }
+
+    int fd = dtlb_open();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    const size_t nlookups = 10 * 1000 * 1000;
+    Data probe;
+    uint64_t rng = 88172645463325252ull;
+    size_t found = 0;
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < nlookups; i++) {
+        // xorshift
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        probe.key = rng % nkeys;
+        probe.node.hcode = hash_u64(probe.key);
+        found += hm_lookup(&hmap, &probe.node, &data_eq) != NULL;
+    }
+    uint64_t t1 = get_monotonic_nsec();
+    assert(found == nlookups);
+
+    long long misses = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+    printf("keys: %zu hugepages: %s lookups/s: %.0f ",
+        nkeys, hugepages ? "on" : "off", nlookups * 1e9 / (t1 - t0));
+    if (misses >= 0) {
+        printf("dTLB-load-misses: %lld\n", misses);
+    } else {
+        printf("dTLB-load-misses: n/a\n");  // perf_event_paranoid
+    }
+    hm_clear(&hmap);
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_hashtable.cpp hashtable.cpp mem.cpp ebr.cpp -o bench_hashtable
@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+
+#include "hashtable.h"
+#include "common.h"
+#include "ebr.h"
+
+// concurrent lookups with `hm_lookup_rcu()` while a writer keeps inserting
+// and deleting keys, the table is grown under the readers first:
+//   ./bench_readers [nkeys] [seconds]
+
+struct Data {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool data_eq(HNode* lhs, HNode* rhs) {
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+static uint64_t hash_u64(uint64_t x) {
+    return str_hash((const uint8_t*)&x, sizeof(x));
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void data_free(void* ptr, size_t) {
+    delete (Data*)ptr;
+}
+
+static struct {
+    HMap hmap;
+    EBR ebr;
+    size_t nkeys = 1 << 20;
+    size_t published = 0;   // keys below this are always in the table
+    bool stop = false;
+} g;
+
+struct ReaderArg {
+    pthread_t thread;
+    EBRReader ebr;
+    uint64_t rng = 0;
+    size_t nlookups = 0;
+};
+
+static void* reader_main(void* arg) {
+    ReaderArg* r = (ReaderArg*)arg;
+    Data probe;
+    while (!__atomic_load_n(&g.stop, __ATOMIC_RELAXED)) {
+        size_t n = __atomic_load_n(&g.published, __ATOMIC_ACQUIRE);
+        if (n == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < 1000; i++) {
+            // xorshift
+            r->rng ^= r->rng << 13;
+            r->rng ^= r->rng >> 7;
+            r->rng ^= r->rng << 17;
+            probe.key = r->rng % n;
+            probe.node.hcode = hash_u64(probe.key);
+            ebr_enter(&g.ebr, &r->ebr);
+            HNode* node = hm_lookup_rcu(&g.hmap, &probe.node, &data_eq);
+            assert(node && container_of(node, Data, node)->key == probe.key);
+            ebr_leave(&r->ebr);
+            (void)node;
+        }
+        __atomic_fetch_add(&r->nlookups, 1000, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+    ((std::vector<Data*>*)arg)->push_back(container_of(node, Data, node));
+    return true;
+}
+
+static void insert_key(uint64_t key) {
+    Data* data = new Data();
+    data->key = key;
+    data->node.hcode = hash_u64(key);
+    hm_insert(&g.hmap, &data->node);
+}
+
+static void run(size_t nreaders, double seconds) {
+    g.hmap = HMap{};
+    g.hmap.ebr = &g.ebr;
+    g.ebr = EBR{};
+    g.published = 0;
+    g.stop = false;
+
+    std::vector<ReaderArg> readers(nreaders);
+    for (size_t i = 0; i < nreaders; i++) {
+        readers[i].rng = 88172645463325252ull + i;
+        ebr_register(&g.ebr, &readers[i].ebr);
+    }
+    for (ReaderArg &r : readers) {
+        pthread_create(&r.thread, NULL, &reader_main, &r);
+    }
+
+    // grow the table while being read
+    for (size_t i = 0; i < g.nkeys; i++) {
+        insert_key(i);
+        __atomic_store_n(&g.published, i + 1, __ATOMIC_RELEASE);
+        if (i % 1024 == 0) {
+            ebr_reclaim(&g.ebr);
+        }
+    }
+    size_t nlookups = 0;
+    for (ReaderArg &r : readers) {
+        nlookups -= __atomic_load_n(&r.nlookups, __ATOMIC_RELAXED);
+    }
+
+    // churn the keys above `nkeys` for the measurement
+    uint64_t t0 = get_monotonic_nsec();
+    uint64_t deadline = t0 + (uint64_t)(seconds * 1e9);
+    size_t nwrites = 0;
+    Data probe;
+    for (uint64_t i = 0; get_monotonic_nsec() < deadline; i++) {
+        uint64_t key = g.nkeys + (i % 4096);
+        probe.key = key;
+        probe.node.hcode = hash_u64(key);
+        HNode* node = hm_delete(&g.hmap, &probe.node, &data_eq);
+        if (node) {
+            ebr_retire(&g.ebr, container_of(node, Data, node), 0, &data_free);
+        } else {
+            insert_key(key);
+        }
+        nwrites++;
+        if (i % 1024 == 0) {
+            ebr_reclaim(&g.ebr);
+        }
+    }
+    __atomic_store_n(&g.stop, true, __ATOMIC_RELAXED);
+    uint64_t t1 = get_monotonic_nsec();
+
+    for (ReaderArg &r : readers) {
+        pthread_join(r.thread, NULL);
+        nlookups += r.nlookups;
+    }
+    std::vector<Data*> all;
+    hm_foreach(&g.hmap, &cb_collect, &all);
+    hm_clear(&g.hmap);
+    for (Data* data : all) {
+        delete data;
+    }
+    ebr_reclaim(&g.ebr);    // no readers now
+    printf("readers: %zu lookups/s: %.0f writes/s: %.0f\n",
+        nreaders, nlookups * 1e9 / (t1 - t0), nwrites * 1e9 / (t1 - t0));
+}
+
+int main(int argc, char** argv) {
+    double seconds = 2;
+    if (argc > 1) {
+        g.nkeys = (size_t)atoll(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atof(argv[2]);
+    }
+    for (size_t n = 1; n <= 8; n *= 2) {
+        run(n, seconds);
+    }
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_readers.cpp hashtable.cpp mem.cpp ebr.cpp -o bench_readers -lpthread
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "shard.h"
+
+// MSET/MGET batches over 1, 2, 4 and 8 local server processes, the batch
+// is split per server and the pipelines run in parallel:
+//   ./bench_shard [server binary] [nkeys] [batch] [seconds]
+
+const uint16_t k_base_port = 13000;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static pid_t server_start(const char* path, uint16_t port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        std::string p = std::to_string(port);
+        execl(path, path, "--port", p.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static bool connect_retry(ShardClient* client, const std::vector<std::string> &servers) {
+    for (int i = 0; i < 100; i++) {
+        if (shard_connect(client, servers)) {
+            return true;
+        }
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+// the number in an int reply
+static int64_t reply_int(const std::string &r) {
+    int64_t val = 0;
+    if (r.size() == 1 + 8) {
+        memcpy(&val, &r[1], 8);
+    }
+    return val;
+}
+
+static void run(const char* path, size_t nservers, size_t nkeys, size_t batch, double seconds) {
+    std::vector<pid_t> pids;
+    std::vector<std::string> servers;
+    for (size_t i = 0; i < nservers; i++) {
+        pids.push_back(server_start(path, (uint16_t)(k_base_port + i)));
+        servers.push_back("127.0.0.1:" + std::to_string(k_base_port + i));
+    }
+    ShardClient client;
+    if (!connect_retry(&client, servers)) {
+        fprintf(stderr, "can't connect to %s\n", path);
+        exit(1);
+    }
+
+    std::string val(32, 'v');
+    std::vector<std::string> args;
+    std::string reply;
+    for (size_t i = 0; i < nkeys; i++) {
+        args.push_back("key:" + std::to_string(i));
+        args.push_back(val);
+        if (args.size() == 2 * batch || i + 1 == nkeys) {
+            bool ok = shard_mset(&client, args, reply);
+            assert(ok && reply.size() == 1);
+            (void)ok;
+            args.clear();
+        }
+    }
+
+    // the keys on each server
+    std::vector<std::string> replies;
+    for (uint32_t i = 0; i < nservers; i++) {
+        shard_send(&client, i, {"dbsize"});
+    }
+    shard_wait(&client, replies);
+    int64_t max_keys = 0;
+    for (const std::string &r : replies) {
+        max_keys = std::max(max_keys, reply_int(r));
+    }
+
+    uint64_t rng = 88172645463325252ull;
+    uint64_t t0 = get_monotonic_nsec();
+    uint64_t deadline = t0 + (uint64_t)(seconds * 1e9);
+    size_t nread = 0;
+    while (get_monotonic_nsec() < deadline) {
+        args.clear();
+        for (size_t i = 0; i < batch; i++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            args.push_back("key:" + std::to_string(rng % nkeys));
+        }
+        bool ok = shard_mget(&client, args, reply);
+        assert(ok);
+        (void)ok;
+        nread += batch;
+    }
+    uint64_t t1 = get_monotonic_nsec();
+
+    shard_close(&client);
+    for (pid_t pid : pids) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    printf("servers: %zu keys/s: %.0f max/avg keys per server: %.3f\n",
+        nservers, nread * 1e9 / (t1 - t0), max_keys * (double)nservers / nkeys);
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "./server";
+    size_t nkeys = argc > 2 ? (size_t)atoll(argv[2]) : 100 * 1000;
+    size_t batch = argc > 3 ? (size_t)atoll(argv[3]) : 1000;
+    double seconds = argc > 4 ? atof(argv[4]) : 2;
+    for (size_t n = 1; n <= 8; n *= 2) {
+        run(path, n, nkeys, batch, seconds);
+    }
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_shard.cpp shard.cpp -o bench_shard
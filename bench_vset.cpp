@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "vset.h"
+
+// build the HNSW graph over clustered random vectors, then the recall@10
+// against a flat scan and the queries per second, per kernel ISA,
+// then the recall after removing 3/4 of the vectors, before and after
+// the compaction:
+//   ./bench_vset [n] [dim] [q8]
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t xorshift() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// roughly normal, the sum of uniforms
+static float gauss() {
+    float sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum += (float)(xorshift() % (1 << 20)) / (1 << 20);
+    }
+    return (sum - 2) * 1.7f;
+}
+
+static void gen(std::vector<float> &centers, size_t dim, float* out) {
+    size_t c = xorshift() % (centers.size() / dim);
+    for (size_t i = 0; i < dim; i++) {
+        out[i] = centers[c * dim + i] + 0.3f * gauss();
+    }
+}
+
+static double recall(VSet* vset, const std::vector<float> &queries, size_t dim,
+    size_t k, size_t ef)
+{
+    size_t nqueries = queries.size() / dim;
+    std::vector<VResult> exact, found;
+    size_t hits = 0;
+    for (size_t i = 0; i < nqueries; i++) {
+        vset_search_flat(vset, &queries[i * dim], k, exact);
+        vset_search(vset, &queries[i * dim], k, ef, found);
+        for (const VResult &r : found) {
+            for (const VResult &e : exact) {
+                hits += r.slot == e.slot;
+            }
+        }
+    }
+    return (double)hits / (nqueries * k);
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 1000 * 1000;
+    size_t dim = argc > 2 ? (size_t)atoll(argv[2]) : 128;
+    bool q8 = argc > 3 && 0 == strcmp(argv[3], "q8");
+    const size_t k = 10;
+    const size_t nqueries = 1000;
+
+    std::vector<float> centers(1000 * dim);
+    for (float &x : centers) {
+        x = gauss();
+    }
+    VSet* vset = vset_new((uint32_t)dim, VM_L2, q8);
+    std::vector<float> vec(dim);
+    char buf[32];
+    for (size_t i = 0; i < n; i++) {
+        gen(centers, dim, vec.data());
+        snprintf(buf, sizeof(buf), "v%zu", i);
+        vset_add(vset, buf, strlen(buf), vec.data());
+    }
+
+    uint64_t t0 = get_monotonic_nsec();
+    VBuild* build = vset_build_begin(vset);
+    assert(build);
+    vset_build_run(build);
+    vset_build_finish(build);
+    uint64_t t1 = get_monotonic_nsec();
+    printf("n: %zu dim: %zu q8: %d isa: %d build: %.1fs\n",
+        n, dim, (int)q8, vset_isa(), (t1 - t0) / 1e9);
+
+    std::vector<float> queries(nqueries * dim);
+    for (size_t i = 0; i < nqueries; i++) {
+        gen(centers, dim, &queries[i * dim]);
+    }
+    std::vector<std::vector<VResult>> exact(nqueries);
+    for (size_t i = 0; i < nqueries; i++) {
+        vset_search_flat(vset, &queries[i * dim], k, exact[i]);
+    }
+
+    std::vector<VResult> found;
+    for (int isa = vset_isa(); isa >= 0; isa--) {
+        vset_use_isa(isa);
+        t0 = get_monotonic_nsec();
+        for (size_t i = 0; i < nqueries; i++) {
+            vset_search_flat(vset, &queries[i * dim], k, found);
+        }
+        t1 = get_monotonic_nsec();
+        printf("isa: %d flat      qps: %.0f\n", isa, nqueries * 1e9 / (t1 - t0));
+        for (size_t ef : {16, 64, 256}) {
+            size_t hits = 0;
+            t0 = get_monotonic_nsec();
+            for (size_t i = 0; i < nqueries; i++) {
+                vset_search(vset, &queries[i * dim], k, ef, found);
+                for (const VResult &r : found) {
+                    for (const VResult &e : exact[i]) {
+                        hits += r.slot == e.slot;
+                    }
+                }
+            }
+            t1 = get_monotonic_nsec();
+            printf("isa: %d ef: %-4zu  qps: %.0f recall@%zu: %.3f\n", isa, ef,
+                nqueries * 1e9 / (t1 - t0), k, (double)hits / (nqueries * k));
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "v%zu", i);
+        if (i % 4) {
+            vset_remove(vset, buf, strlen(buf));
+        }
+    }
+    printf("removed: slots: %u deleted: %u recall@%zu: %.3f\n",
+        vset->nslots, vset->ntombs, k, recall(vset, queries, dim, k, 64));
+    t0 = get_monotonic_nsec();
+    while (VBuild* build = vset_build_begin(vset)) {
+        vset_build_run(build);
+        vset_build_finish(build);
+    }
+    t1 = get_monotonic_nsec();
+    printf("compacted: %.1fs slots: %u deleted: %u recall@%zu: %.3f\n", (t1 - t0) / 1e9,
+        vset->nslots, vset->ntombs, k, recall(vset, queries, dim, k, 64));
+    vset_del(vset);
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_vset.cpp vset.cpp hashtable.cpp mem.cpp ebr.cpp defrag.cpp -o bench_vset
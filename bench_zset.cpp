@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "zset.h"
+
+// random `zset_seekge()` in a big zset with distinct scores, with tied
+// scores, and with tied scores plus a shared 8-byte name prefix, then
+// `zset_lookup()` one by one versus `zset_lookup_many()` in batches:
+//   ./bench_zset [nkeys]
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t xorshift() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+struct Member {
+    double score = 0;
+    std::string name;
+};
+
+static void bench(const char* label, std::vector<Member> &members) {
+    ZSet zset;
+    for (Member &m : members) {
+        zset_insert(&zset, m.name.data(), m.name.size(), m.score);
+    }
+
+    const size_t nseeks = 5 * 1000 * 1000;
+    size_t found = 0;
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < nseeks; i++) {
+        Member &m = members[xorshift() % members.size()];
+        ZNode* node = zset_seekge(&zset, m.score, m.name.data(), m.name.size());
+        found += node && node->len == m.name.size();
+    }
+    uint64_t t1 = get_monotonic_nsec();
+    assert(found == nseeks);
+
+    printf("%-16s keys: %zu seeks/s: %.0f\n",
+        label, members.size(), nseeks * 1e9 / (t1 - t0));
+    zset_clear(&zset);
+}
+
+static void bench_lookup(std::vector<Member> &members) {
+    ZSet zset;
+    for (Member &m : members) {
+        zset_insert(&zset, m.name.data(), m.name.size(), m.score);
+    }
+
+    const size_t nlookups = 5 * 1000 * 1000;
+    const size_t k_batch = 500;
+    std::vector<const char*> names(k_batch);
+    std::vector<size_t> lens(k_batch);
+    std::vector<ZNode*> found(k_batch);
+    for (int batched = 0; batched <= 1; batched++) {
+        size_t nfound = 0;
+        uint64_t t0 = get_monotonic_nsec();
+        for (size_t i = 0; i < nlookups; i += k_batch) {
+            for (size_t j = 0; j < k_batch; j++) {
+                Member &m = members[xorshift() % members.size()];
+                names[j] = m.name.data();
+                lens[j] = m.name.size();
+            }
+            if (batched) {
+                zset_lookup_many(&zset, k_batch, names.data(), lens.data(), found.data());
+            } else {
+                for (size_t j = 0; j < k_batch; j++) {
+                    found[j] = zset_lookup(&zset, names[j], lens[j]);
+                }
+            }
+            for (size_t j = 0; j < k_batch; j++) {
+                nfound += found[j] != NULL;
+            }
+        }
+        uint64_t t1 = get_monotonic_nsec();
+        assert(nfound == nlookups);
+        printf("%-16s keys: %zu lookups/s: %.0f\n", batched ? "lookup_many" : "lookup",
+            members.size(), nlookups * 1e9 / (t1 - t0));
+    }
+    zset_clear(&zset);
+}
+
+int main(int argc, char** argv) {
+    size_t nkeys = argc > 1 ? (size_t)atoll(argv[1]) : 1000 * 1000;
+    std::vector<Member> members(nkeys);
+    char buf[64];
+
+    for (size_t i = 0; i < nkeys; i++) {
+        members[i].score = (double)(xorshift() % (1ull << 40)) / 1024;
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)xorshift());
+        members[i].name = buf;
+    }
+    bench("distinct", members);
+
+    for (size_t i = 0; i < nkeys; i++) {
+        members[i].score = 1;
+    }
+    bench("tied", members);
+
+    for (size_t i = 0; i < nkeys; i++) {
+        snprintf(buf, sizeof(buf), "user:id:%016llx", (unsigned long long)xorshift());
+        members[i].name = buf;
+    }
+    bench("tied+prefix", members);
+    bench_lookup(members);
+    return 0;
+}
+
+// g++ -Wall -Wextra -O2 -g bench_zset.cpp zset.cpp avl.cpp hashtable.cpp heap.cpp mem.cpp ebr.cpp defrag.cpp -o bench_zset
@@ -10,6 +10,9 @@
 #include <netinet/ip.h>
 #include <vector>
 #include <string>
+#include <algorithm>
+
+#include "shard.h"
 
 static void msg(const char* msg) {
     fprintf(stderr, "%s\n", msg);
@@ -97,7 +100,7 @@ static int32_t print_response(const uint8_t* data, size_t size) {
     switch (data[0])
     {
         case TAG_NIL:
-            printf("nil\n");
+            printf("(nil)\n");
             return 1;
         case TAG_ERR:
             if (size < 1 + 8) {
@@ -216,7 +219,63 @@ static int32_t read_res(int fd) {
     return rv;
 }
 
+static int32_t print_reply(const std::string &reply) {
+    int32_t rv = print_response((const uint8_t*)reply.data(), reply.size());
+    if (rv > 0 && (uint32_t)rv != reply.size()) {
+        msg("bad response");
+        rv = -1;
+    }
+    return rv;
+}
+
+// ./client --shards ip:port,ip:port... cmd
+// mget, mset and del of keys are split per server, a command without a key
+// is sent to every server, the others to the server of the key
+static int shard_main(const std::string &list, const std::vector<std::string> &cmd) {
+    std::vector<std::string> servers;
+    for (size_t pos = 0; pos <= list.size(); ) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        servers.push_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    ShardClient client;
+    if (!shard_connect(&client, servers)) {
+        die("connect()");
+    }
+
+    std::vector<std::string> args(cmd.begin() + 1, cmd.end());
+    std::vector<std::string> replies(1);
+    bool ok = false;
+    if (cmd[0] == "mget" && !args.empty()) {
+        ok = shard_mget(&client, args, replies[0]);
+    } else if (cmd[0] == "mset" && !args.empty() && args.size() % 2 == 0) {
+        ok = shard_mset(&client, args, replies[0]);
+    } else if (cmd[0] == "del" && !args.empty()) {
+        ok = shard_del(&client, args, replies[0]);
+    } else if (args.empty()) {
+        for (uint32_t i = 0; i < client.conns.size(); i++) {
+            shard_send(&client, i, cmd);
+        }
+        ok = shard_wait(&client, replies);
+    } else {
+        shard_send(&client, shard_of(&client, cmd[1]), cmd);
+        ok = shard_wait(&client, replies);
+    }
+    if (!ok) {
+        msg("I/O error");
+    }
+    for (size_t i = 0; ok && i < replies.size(); i++) {
+        ok = print_reply(replies[i]) > 0;
+    }
+    shard_close(&client);
+    return ok ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
+    if (argc > 3 && 0 == strcmp(argv[1], "--shards")) {
+        return shard_main(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    }
+
     // create a socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -254,5 +313,5 @@ L_DONE:
 
 
 
-// g++ -Wall -Wextra -O2 -g zset.cpp avl.cpp hashtable.cpp heap.cpp server.cpp -o server
-// g++ -Wall -Wextra -O2 -g client.cpp -o client
\ No newline at end of file
+// g++ -Wall -Wextra -O2 -g zset.cpp avl.cpp hashtable.cpp heap.cpp thread_pool.cpp spill.cpp defrag.cpp mem.cpp ebr.cpp vset.cpp search.cpp json.cpp sketch.cpp server.cpp -o server -lpthread
+// g++ -Wall -Wextra -O2 -g client.cpp shard.cpp -o client
@@ -16,4 +16,15 @@ inline uint64_t str_hash(const uint8_t *data, size_t len) {
         h = (h + data[i]) * 0x01000193;
     }
     return h;
-}
\ No newline at end of file
+}
+
+// 64-bit FNV-1a with a final mix, for when all the bits are used
+inline uint64_t str_hash64(const uint8_t *data, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001B3ull;
+    }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <vector>
+
+#include "defrag.h"
+
+const size_t k_page_shift = 12;
+const size_t k_page_size = (size_t)1 << k_page_shift;
+const size_t k_sparse_bytes = k_page_size / 2;
+
+static struct {
+    uintptr_t base = 0;             // the main heap from sbrk()
+    std::vector<uint16_t> used;     // bytes in use, per page
+} g_census;
+
+// the page index, or -1 for memory outside the main heap, i.e. mmap()
+static size_t page_of(const void* ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (p < g_census.base) {
+        return -1;
+    }
+    size_t idx = (p - g_census.base) >> k_page_shift;
+    return idx < g_census.used.size() ? idx : (size_t)-1;
+}
+
+void defrag_census_reset() {
+    struct mallinfo2 mi = mallinfo2();
+    uintptr_t end = (uintptr_t)sbrk(0);
+    g_census.base = (end - mi.arena) & ~(uintptr_t)(k_page_size - 1);
+    g_census.used.assign((end - g_census.base) >> k_page_shift, 0);
+}
+
+static void census_add(size_t idx, int64_t bytes) {
+    int64_t val = (int64_t)g_census.used[idx] + bytes;
+    g_census.used[idx] = (uint16_t)(val < 0 ? 0 : val > (int64_t)k_page_size ? k_page_size : val);
+}
+
+void defrag_census_add(const void* ptr) {
+    size_t idx = page_of(ptr);
+    if (idx != (size_t)-1) {
+        census_add(idx, (int64_t)malloc_usable_size((void*)ptr));
+    }
+}
+
+bool defrag_sparse(const void* ptr) {
+    size_t idx = page_of(ptr);
+    return idx != (size_t)-1 && g_census.used[idx] < k_sparse_bytes;
+}
+
+bool defrag_better(const void* ptr, const void* fresh) {
+    size_t from = page_of(ptr);
+    size_t to = page_of(fresh);
+    if (from == (size_t)-1 || to == (size_t)-1) {
+        return false;
+    }
+    if (g_census.used[to] <= g_census.used[from]) {
+        return false;
+    }
+    int64_t bytes = (int64_t)malloc_usable_size((void*)ptr);
+    census_add(from, -bytes);
+    census_add(to, bytes);
+    return true;
+}
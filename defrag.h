@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+// glibc has no API to tell how full a heap page is, so the live data is
+// scanned to build a map of used bytes per page before moving anything
+void defrag_census_reset();
+void defrag_census_add(const void* ptr);
+// the object is on a sparsely used page
+bool defrag_sparse(const void* ptr);
+// whether moving `ptr` to `fresh` makes the heap denser, the map is updated if so
+bool defrag_better(const void* ptr, const void* fresh);
@@ -0,0 +1,56 @@
+#include "ebr.h"
+
+void ebr_register(EBR* ebr, EBRReader* reader) {
+    ebr->readers.push_back(reader);
+}
+
+void ebr_enter(EBR* ebr, EBRReader* reader) {
+    uint64_t epoch = __atomic_load_n(&ebr->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_RELAXED);
+    // either the writer sees this reader, or this reader sees the unlinking
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_leave(EBRReader* reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_retire(EBR* ebr, void* ptr, size_t size, void (*f)(void*, size_t)) {
+    EBRRetired item;
+    item.epoch = ebr->epoch;
+    item.ptr = ptr;
+    item.size = size;
+    item.f = f;
+    ebr->retired.push_back(item);
+}
+
+void ebr_reclaim(EBR* ebr) {
+    if (ebr->retired.empty()) {
+        return;
+    }
+    // readers entering from now on can't see anything retired so far
+    uint64_t next = ebr->epoch + 1;
+    __atomic_store_n(&ebr->epoch, next, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // the oldest epoch still being read
+    uint64_t min = next;
+    for (EBRReader* reader : ebr->readers) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < min) {
+            min = epoch;
+        }
+    }
+
+    // things retired in an epoch before that are unreachable
+    size_t keep = 0;
+    for (size_t i = 0; i < ebr->retired.size(); i++) {
+        EBRRetired &item = ebr->retired[i];
+        if (item.epoch < min) {
+            item.f(item.ptr, item.size);
+        } else {
+            ebr->retired[keep++] = item;
+        }
+    }
+    ebr->retired.resize(keep);
+}
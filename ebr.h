@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// epoch-based reclamation: memory unlinked by the writer thread is freed
+// only after the readers that may still see it have left
+struct alignas(64) EBRReader {
+    uint64_t epoch = 0;     // the epoch when entered, 0 if not reading
+};
+
+struct EBRRetired {
+    uint64_t epoch = 0;
+    void* ptr = NULL;
+    size_t size = 0;
+    void (*f)(void*, size_t) = NULL;
+};
+
+struct EBR {
+    uint64_t epoch = 1;
+    std::vector<EBRReader*> readers;    // registered before the readers start
+    std::vector<EBRRetired> retired;    // only used by the writer
+};
+
+void ebr_register(EBR* ebr, EBRReader* reader);
+// the read side critical section
+void ebr_enter(EBR* ebr, EBRReader* reader);
+void ebr_leave(EBRReader* reader);
+// the writer: free `ptr` later with `f(ptr, size)`
+void ebr_retire(EBR* ebr, void* ptr, size_t size, void (*f)(void*, size_t));
+// the writer: free what no reader can see, called periodically
+void ebr_reclaim(EBR* ebr);
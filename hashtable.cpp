@@ -1,21 +1,38 @@
 #include <assert.h>
-#include <stdlib.h>     // for calloc and free
 #include "hashtable.h"
+#include "mem.h"
+#include "ebr.h"
+
+// the table fields are read by `hm_lookup_rcu()`
+static void h_set(HTab* htab, HNode** tab, size_t mask, size_t size) {
+    __atomic_store_n(&htab->tab, tab, __ATOMIC_RELAXED);
+    __atomic_store_n(&htab->mask, mask, __ATOMIC_RELAXED);
+    htab->size = size;
+}
 
 // n must be a power of 2
 static void h_init(HTab* htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
-    htab->tab = (HNode**)calloc(n, sizeof(HNode*));
-    htab->mask = n - 1;
-    htab->size = 0;
+    h_set(htab, (HNode**)mem_alloc_zeroed(n * sizeof(HNode*)), n - 1, 0);
+}
+
+static void h_free(HTab* htab, EBR* ebr) {
+    size_t size = (htab->mask + 1) * sizeof(HNode*);
+    if (htab->tab && ebr) {
+        ebr_retire(ebr, htab->tab, size, &mem_free);  // may be in use by readers
+    } else if (htab->tab) {
+        mem_free(htab->tab, size);
+    }
+    h_set(htab, NULL, 0, 0);
 }
 
 // hashtable insertion
+// the pointers are stored atomically for `hm_lookup_rcu()`
 static void h_insert(HTab* htab, HNode* node) {
     size_t pos = node->hcode & htab->mask;      // node->hcode & (n - 1)
     HNode* next = htab->tab[pos];
-    node->next = next;
-    htab->tab[pos] = node;
+    __atomic_store_n(&node->next, next, __ATOMIC_RELAXED);
+    __atomic_store_n(&htab->tab[pos], node, __ATOMIC_RELEASE);
     htab->size++;
 }
 
@@ -39,14 +56,30 @@ static HNode** h_lookup(HTab* htab, HNode* key, bool (*eq)(HNode*, HNode*)) {
 // remove a node from the chain
 static HNode* h_detach(HTab* htab, HNode** from) {
     HNode* node = *from;    // the target node
-    *from = node->next;     // update the incoming pointer to the target
+    // update the incoming pointer to the target
+    __atomic_store_n(from, node->next, __ATOMIC_RELEASE);
     htab->size--;
     return node;
 }
 
 const size_t k_rehashing_work = 128;    // constant work
 
+// readers retry if the seqcount has changed, since a node moved between
+// the tables is missed, and the tables must be read consistently
+static void hm_seq_begin(HMap* hmap) {
+    __atomic_store_n(&hmap->seq, hmap->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void hm_seq_end(HMap* hmap) {
+    __atomic_store_n(&hmap->seq, hmap->seq + 1, __ATOMIC_RELEASE);
+}
+
 static void hm_help_rehashing(HMap* hmap) {
+    if (hmap->older.size == 0 && !hmap->older.tab) {
+        return;
+    }
+    hm_seq_begin(hmap);
     size_t nwork = 0;
     while (nwork < k_rehashing_work && hmap->older.size > 0) {
         // find a non-empty slot
@@ -61,16 +94,19 @@ static void hm_help_rehashing(HMap* hmap) {
     }
     // discard the old table if done
     if(hmap->older.size == 0 && hmap->older.tab) {
-        free(hmap->older.tab);
-        hmap->older = HTab{};
+        h_free(&hmap->older, hmap->ebr);
     }
+    hm_seq_end(hmap);
 }
 
 static void hm_trigger_reshashing(HMap* hmap) {
     assert(hmap->older.tab == NULL);
-    hmap->older = hmap->newer;  // (newer, older) <- (new_table, newer)
+    hm_seq_begin(hmap);
+    // (newer, older) <- (new_table, newer)
+    h_set(&hmap->older, hmap->newer.tab, hmap->newer.mask, hmap->newer.size);
     h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
     hmap->migrate_pos = 0;
+    hm_seq_end(hmap);
 }
 
 HNode* hm_lookup(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*)) {
@@ -86,7 +122,9 @@ const size_t k_max_load_factor = 8;
 
 void hm_insert(HMap* hmap, HNode* node) {
     if(!hmap->newer.tab) {
+        hm_seq_begin(hmap);
         h_init(&hmap->newer, 4);    // initialize if empty
+        hm_seq_end(hmap);
     }
     h_insert(&hmap->newer, node);   // always insert to the newer table
 
@@ -111,9 +149,102 @@ HNode* hm_delete(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*)) {
 }
 
 void hm_clear(HMap* hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    EBR* ebr = hmap->ebr;
+    h_free(&hmap->newer, ebr);
+    h_free(&hmap->older, ebr);
     *hmap = HMap{};
+    hmap->ebr = ebr;
+}
+
+void hm_move(HMap* hmap, HMap* to) {
+    assert(!to->newer.tab && !to->older.tab);
+    hm_seq_begin(hmap);
+    to->newer = hmap->newer;
+    to->older = hmap->older;
+    to->migrate_pos = hmap->migrate_pos;
+    h_set(&hmap->newer, NULL, 0, 0);
+    h_set(&hmap->older, NULL, 0, 0);
+    hmap->migrate_pos = 0;
+    hm_seq_end(hmap);
+}
+
+static bool h_same(HNode* node, HNode* key) {
+    return node == key;
+}
+
+void hm_replace(HMap* hmap, HNode* node, HNode* fresh) {
+    HNode** from = h_lookup(&hmap->newer, node, &h_same);
+    if (!from) {
+        from = h_lookup(&hmap->older, node, &h_same);
+    }
+    assert(from);
+    fresh->hcode = node->hcode;
+    __atomic_store_n(&fresh->next, node->next, __ATOMIC_RELAXED);
+    __atomic_store_n(from, fresh, __ATOMIC_RELEASE);
+}
+
+static HNode* h_lookup_rcu(HNode** tab, size_t mask, HNode* key, bool (*eq)(HNode*, HNode*)) {
+    if (!tab) {
+        return NULL;
+    }
+    HNode* node = __atomic_load_n(&tab[key->hcode & mask], __ATOMIC_ACQUIRE);
+    for (; node != NULL; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+        if (node->hcode == key->hcode && eq(node, key)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+HNode* hm_lookup_rcu(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*)) {
+    while (true) {
+        uint64_t seq = __atomic_load_n(&hmap->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;   // the writer is in the middle of rehashing
+        }
+        HNode** newer = __atomic_load_n(&hmap->newer.tab, __ATOMIC_RELAXED);
+        size_t newer_mask = __atomic_load_n(&hmap->newer.mask, __ATOMIC_RELAXED);
+        HNode** older = __atomic_load_n(&hmap->older.tab, __ATOMIC_RELAXED);
+        size_t older_mask = __atomic_load_n(&hmap->older.mask, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hmap->seq, __ATOMIC_RELAXED) != seq) {
+            continue;   // the tables were swapped
+        }
+
+        HNode* node = h_lookup_rcu(newer, newer_mask, key, eq);
+        if (!node) {
+            node = h_lookup_rcu(older, older_mask, key, eq);
+        }
+        if (node) {
+            return node;
+        }
+        // not found, which is only certain if no node has been moved
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hmap->seq, __ATOMIC_RELAXED) == seq) {
+            return NULL;
+        }
+    }
+}
+
+void hm_prefetch(HMap* hmap, uint64_t hcode) {
+    if (hmap->newer.tab) {
+        __builtin_prefetch(&hmap->newer.tab[hcode & hmap->newer.mask]);
+    }
+    if (hmap->older.tab) {
+        __builtin_prefetch(&hmap->older.tab[hcode & hmap->older.mask]);
+    }
+}
+
+// the node is only a hint, it's not necessarily the one for the hash code
+HNode* hm_chain_head(HMap* hmap, uint64_t hcode) {
+    HNode* node = NULL;
+    if (hmap->newer.tab) {
+        node = hmap->newer.tab[hcode & hmap->newer.mask];
+    }
+    if (!node && hmap->older.tab) {
+        node = hmap->older.tab[hcode & hmap->older.mask];
+    }
+    return node;
 }
 
 size_t hm_size(HMap* hmap) {
@@ -133,4 +264,32 @@ static bool h_foreach(HTab* htab, bool (*f)(HNode*, void*), void* arg) {
 
 void hm_foreach(HMap* hmap, bool (*f)(HNode*, void*), void* arg) {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
+}
+
+// the cursor indexes the slots of the newer table followed by the older table,
+// keys moved by rehashing in between calls may be missed or visited twice
+size_t hm_scan(HMap* hmap, size_t cursor, size_t nslots, void (*f)(HNode*, void*), void* arg) {
+    size_t nnewer = hmap->newer.tab ? hmap->newer.mask + 1 : 0;
+    size_t nolder = hmap->older.tab ? hmap->older.mask + 1 : 0;
+    for (; nslots > 0 && cursor < nnewer + nolder; nslots--, cursor++) {
+        HNode* node = cursor < nnewer
+            ? hmap->newer.tab[cursor] : hmap->older.tab[cursor - nnewer];
+        for (; node != NULL; node = node->next) {
+            f(node, arg);
+        }
+    }
+    return cursor < nnewer + nolder ? cursor : 0;
+}
+
+size_t hm_relocate(HMap* hmap, size_t cursor, size_t nslots, HNode* (*f)(HNode*, void*), void* arg) {
+    size_t nnewer = hmap->newer.tab ? hmap->newer.mask + 1 : 0;
+    size_t nolder = hmap->older.tab ? hmap->older.mask + 1 : 0;
+    for (; nslots > 0 && cursor < nnewer + nolder; nslots--, cursor++) {
+        HNode** from = cursor < nnewer
+            ? &hmap->newer.tab[cursor] : &hmap->older.tab[cursor - nnewer];
+        for (; *from != NULL; from = &(*from)->next) {
+            *from = f(*from, arg);  // update the incoming pointer
+        }
+    }
+    return cursor < nnewer + nolder ? cursor : 0;
 }
\ No newline at end of file
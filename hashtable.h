@@ -16,19 +16,43 @@ struct HTab {
     size_t size = 0;    // number of keys
 };
 
+struct EBR;
+
 // the real hashtable interface
 // it uses 2 hashtables for progressive rehashing
 struct HMap {
     HTab newer;
     HTab older;
     size_t migrate_pos = 0;
+    // for `hm_lookup_rcu()`: odd while the tables are changing
+    uint64_t seq = 0;
+    // tables are freed through this if there are concurrent readers
+    EBR* ebr = NULL;
 };
 
 HNode* hm_lookup(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
 void hm_insert(HMap* hmap, HNode* node);
 HNode* hm_delete(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
 void hm_clear(HMap* hmap);
+// move all nodes to the empty map `to` in O(1), safe with `hm_lookup_rcu()`
+void hm_move(HMap* hmap, HMap* to);
+// replace a node in place, the new node takes over the hash code
+void hm_replace(HMap* hmap, HNode* node, HNode* fresh);
+// lookup from a reader thread concurrently with a single writer,
+// must be inside `ebr_enter()` and `ebr_leave()`
+HNode* hm_lookup_rcu(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
 size_t hm_size(HMap* hmap);
+// for batched lookups: prefetch the slots of a hash code first, then the
+// payload of the chain head, so that the cache misses of a batch overlap
+void hm_prefetch(HMap* hmap, uint64_t hcode);
+HNode* hm_chain_head(HMap* hmap, uint64_t hcode);
 
 // invoke the callback on each node until it returns false
-void hm_foreach(HMap* hmap, bool (*f)(HNode*, void*), void* arg);
\ No newline at end of file
+void hm_foreach(HMap* hmap, bool (*f)(HNode*, void*), void* arg);
+
+// visit `nslots` slots starting from `cursor`, returns the next cursor or 0 when done
+// the callback must not modify the hashtable
+size_t hm_scan(HMap* hmap, size_t cursor, size_t nslots, void (*f)(HNode*, void*), void* arg);
+
+// like `hm_scan()`, but the node is replaced by the one returned from the callback
+size_t hm_relocate(HMap* hmap, size_t cursor, size_t nslots, HNode* (*f)(HNode*, void*), void* arg);
\ No newline at end of file
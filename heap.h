@@ -8,4 +8,27 @@ struct HeapItem {
     size_t* ref = NULL;
 };
 
-void heap_update(HeapItem* a, size_t pos, size_t len);
\ No newline at end of file
+void heap_update(HeapItem* a, size_t pos, size_t len);
+
+// for std::vector<HeapItem>
+template <class V>
+void heap_delete(V &a, size_t pos) {
+    // swap the erased item with the last item
+    a[pos] = a.back();
+    a.pop_back();
+    // update the swapped item
+    if (pos < a.size()) {
+        heap_update(a.data(), pos, a.size());
+    }
+}
+
+template <class V>
+void heap_upsert(V &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t; // update an existing item
+    } else {
+        pos = a.size();
+        a.push_back(t);     // add a new item
+    }
+    heap_update(a.data(), pos, a.size());
+}
@@ -0,0 +1,468 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "json.h"
+
+struct JParser {
+    const char* cur = NULL;
+    const char* end = NULL;
+    int depth = 0;
+};
+
+static void skip_ws(JParser &p) {
+    while (p.cur < p.end && (*p.cur == ' ' || *p.cur == '\t' || *p.cur == '\n' || *p.cur == '\r')) {
+        p.cur++;
+    }
+}
+
+static bool parse_hex4(JParser &p, uint32_t &out) {
+    if (p.end - p.cur < 4) {
+        return false;
+    }
+    out = 0;
+    for (int i = 0; i < 4; i++) {
+        char ch = *p.cur++;
+        out <<= 4;
+        if (ch >= '0' && ch <= '9') {
+            out |= ch - '0';
+        } else if (ch >= 'a' && ch <= 'f') {
+            out |= ch - 'a' + 10;
+        } else if (ch >= 'A' && ch <= 'F') {
+            out |= ch - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void put_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+// after the opening quote
+static bool parse_str(JParser &p, std::string &out) {
+    out.clear();
+    while (p.cur < p.end) {
+        // copy the run of plain bytes
+        const char* begin = p.cur;
+        while (p.cur < p.end && *p.cur != '"' && *p.cur != '\\' && (uint8_t)*p.cur >= 0x20) {
+            p.cur++;
+        }
+        out.append(begin, p.cur - begin);
+        if (p.cur == p.end || (uint8_t)*p.cur < 0x20) {
+            return false;
+        }
+        if (*p.cur++ == '"') {
+            return true;
+        }
+        if (p.cur == p.end) {
+            return false;
+        }
+        char esc = *p.cur++;
+        switch (esc) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '/': out.push_back('/'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u': {
+            uint32_t cp = 0;
+            if (!parse_hex4(p, cp)) {
+                return false;
+            }
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                // a surrogate pair
+                uint32_t lo = 0;
+                if (p.end - p.cur < 2 || p.cur[0] != '\\' || p.cur[1] != 'u') {
+                    return false;
+                }
+                p.cur += 2;
+                if (!parse_hex4(p, lo) || lo < 0xDC00 || lo >= 0xE000) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                return false;
+            }
+            put_utf8(out, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool is_digit(JParser &p) {
+    return p.cur < p.end && *p.cur >= '0' && *p.cur <= '9';
+}
+
+static bool parse_num(JParser &p, JNode* node) {
+    const char* begin = p.cur;
+    if (p.cur < p.end && *p.cur == '-') {
+        p.cur++;
+    }
+    if (!is_digit(p)) {
+        return false;
+    }
+    if (*p.cur == '0') {
+        p.cur++;
+    } else {
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+    if (p.cur < p.end && *p.cur == '.') {
+        p.cur++;
+        if (!is_digit(p)) {
+            return false;
+        }
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+    if (p.cur < p.end && (*p.cur == 'e' || *p.cur == 'E')) {
+        p.cur++;
+        if (p.cur < p.end && (*p.cur == '+' || *p.cur == '-')) {
+            p.cur++;
+        }
+        if (!is_digit(p)) {
+            return false;
+        }
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+    node->type = J_NUM;
+    node->str.assign(begin, p.cur - begin);
+    node->num = strtod(node->str.c_str(), NULL);
+    return isfinite(node->num);
+}
+
+static bool parse_lit(JParser &p, const char* lit, JNode* node, uint8_t type) {
+    size_t len = strlen(lit);
+    if ((size_t)(p.end - p.cur) < len || memcmp(p.cur, lit, len) != 0) {
+        return false;
+    }
+    p.cur += len;
+    node->type = type;
+    return true;
+}
+
+static JNode* parse_value(JParser &p);
+
+static bool parse_arr(JParser &p, JNode* node) {
+    node->type = J_ARR;
+    skip_ws(p);
+    if (p.cur < p.end && *p.cur == ']') {
+        p.cur++;
+        return true;
+    }
+    while (true) {
+        JNode* kid = parse_value(p);
+        if (!kid) {
+            return false;
+        }
+        node->kids.push_back(kid);
+        skip_ws(p);
+        if (p.cur == p.end) {
+            return false;
+        }
+        char ch = *p.cur++;
+        if (ch == ']') {
+            return true;
+        } else if (ch != ',') {
+            return false;
+        }
+    }
+}
+
+static bool parse_obj(JParser &p, JNode* node) {
+    node->type = J_OBJ;
+    skip_ws(p);
+    if (p.cur < p.end && *p.cur == '}') {
+        p.cur++;
+        return true;
+    }
+    while (true) {
+        skip_ws(p);
+        std::string key;
+        if (p.cur == p.end || *p.cur++ != '"' || !parse_str(p, key)) {
+            return false;
+        }
+        skip_ws(p);
+        if (p.cur == p.end || *p.cur++ != ':') {
+            return false;
+        }
+        JNode* kid = parse_value(p);
+        if (!kid) {
+            return false;
+        }
+        node->keys.push_back(std::move(key));
+        node->kids.push_back(kid);
+        skip_ws(p);
+        if (p.cur == p.end) {
+            return false;
+        }
+        char ch = *p.cur++;
+        if (ch == '}') {
+            return true;
+        } else if (ch != ',') {
+            return false;
+        }
+    }
+}
+
+static JNode* parse_value(JParser &p) {
+    skip_ws(p);
+    if (p.cur == p.end || (size_t)++p.depth > k_json_max_depth) {
+        return NULL;
+    }
+    JNode* node = new JNode();
+    bool ok = false;
+    switch (*p.cur) {
+    case '{': p.cur++; ok = parse_obj(p, node); break;
+    case '[': p.cur++; ok = parse_arr(p, node); break;
+    case '"': p.cur++; node->type = J_STR; ok = parse_str(p, node->str); break;
+    case 't': ok = parse_lit(p, "true", node, J_TRUE); break;
+    case 'f': ok = parse_lit(p, "false", node, J_FALSE); break;
+    case 'n': ok = parse_lit(p, "null", node, J_NULL); break;
+    default: ok = parse_num(p, node); break;
+    }
+    p.depth--;
+    if (!ok) {
+        json_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+JNode* json_parse(const char* data, size_t len) {
+    JParser p;
+    p.cur = data;
+    p.end = data + len;
+    JNode* root = parse_value(p);
+    skip_ws(p);
+    if (root && p.cur != p.end) {
+        json_free(root);    // trailing garbage
+        return NULL;
+    }
+    return root;
+}
+
+void json_free(JNode* node) {
+    for (JNode* kid : node->kids) {
+        json_free(kid);
+    }
+    delete node;
+}
+
+size_t json_depth(const JNode* node) {
+    size_t depth = 0;
+    for (const JNode* kid : node->kids) {
+        depth = std::max(depth, json_depth(kid));
+    }
+    return 1 + depth;
+}
+
+static void dump_str(const std::string &str, std::string &out) {
+    out.push_back('"');
+    for (char ch : str) {
+        switch (ch) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((uint8_t)ch < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (uint8_t)ch);
+                out += buf;
+            } else {
+                out.push_back(ch);
+            }
+        }
+    }
+    out.push_back('"');
+}
+
+void json_dump(const JNode* node, std::string &out) {
+    switch (node->type) {
+    case J_NULL: out += "null"; break;
+    case J_FALSE: out += "false"; break;
+    case J_TRUE: out += "true"; break;
+    case J_NUM: out += node->str; break;
+    case J_STR: dump_str(node->str, out); break;
+    case J_ARR:
+        out.push_back('[');
+        for (size_t i = 0; i < node->kids.size(); i++) {
+            if (i) {
+                out.push_back(',');
+            }
+            json_dump(node->kids[i], out);
+        }
+        out.push_back(']');
+        break;
+    case J_OBJ:
+        out.push_back('{');
+        for (size_t i = 0; i < node->kids.size(); i++) {
+            if (i) {
+                out.push_back(',');
+            }
+            dump_str(node->keys[i], out);
+            out.push_back(':');
+            json_dump(node->kids[i], out);
+        }
+        out.push_back('}');
+        break;
+    default:
+        assert(!"unreachable");
+    }
+}
+
+void json_set_num(JNode* node, double num) {
+    char buf[32];
+    if (num == floor(num) && fabs(num) < 9007199254740992.0) {
+        snprintf(buf, sizeof(buf), "%lld", (long long)num);
+    } else {
+        snprintf(buf, sizeof(buf), "%.17g", num);
+    }
+    node->type = J_NUM;
+    node->num = num;
+    node->str = buf;
+}
+
+// paths
+
+bool json_path(const std::string &path, std::vector<JStep> &out) {
+    out.clear();
+    size_t i = 0;
+    if (i < path.size() && path[i] == '$') {
+        i++;
+    }
+    while (i < path.size()) {
+        JStep step;
+        if (path[i] == '.') {
+            // .key up to the next . or [
+            size_t end = path.find_first_of(".[", i + 1);
+            end = end == std::string::npos ? path.size() : end;
+            if (end == i + 1) {
+                return false;
+            }
+            step.key = path.substr(i + 1, end - i - 1);
+            i = end;
+        } else if (path[i] == '[' && i + 1 < path.size() && path[i + 1] == '"') {
+            // ["key"], with \" and \\ escapes
+            i += 2;
+            while (i < path.size() && path[i] != '"') {
+                if (path[i] == '\\' && i + 1 < path.size()) {
+                    i++;
+                }
+                step.key.push_back(path[i++]);
+            }
+            if (i + 1 >= path.size() || path[i + 1] != ']') {
+                return false;
+            }
+            i += 2;
+        } else if (path[i] == '[') {
+            // [index]
+            size_t end = path.find(']', i);
+            if (end == std::string::npos || end == i + 1) {
+                return false;
+            }
+            std::string num = path.substr(i + 1, end - i - 1);
+            char* endp = NULL;
+            step.index = strtoll(num.c_str(), &endp, 10);
+            if (endp != num.c_str() + num.size()) {
+                return false;
+            }
+            step.is_index = true;
+            i = end + 1;
+        } else {
+            return false;
+        }
+        out.push_back(std::move(step));
+    }
+    return true;
+}
+
+// the slot of a step in the parent, NULL if not found
+static JNode** json_child(JNode* node, const JStep &step) {
+    if (step.is_index) {
+        if (node->type != J_ARR) {
+            return NULL;
+        }
+        int64_t n = (int64_t)node->kids.size();
+        int64_t idx = step.index < 0 ? step.index + n : step.index;
+        return idx >= 0 && idx < n ? &node->kids[idx] : NULL;
+    }
+    if (node->type != J_OBJ) {
+        return NULL;
+    }
+    for (size_t i = 0; i < node->keys.size(); i++) {
+        if (node->keys[i] == step.key) {
+            return &node->kids[i];
+        }
+    }
+    return NULL;
+}
+
+JNode* json_get(JNode* root, const JStep* steps, size_t n) {
+    JNode* node = root;
+    for (size_t i = 0; i < n && node; i++) {
+        JNode** slot = json_child(node, steps[i]);
+        node = slot ? *slot : NULL;
+    }
+    return node;
+}
+
+bool json_set(JNode* &root, const std::vector<JStep> &steps, JNode* val) {
+    if (steps.empty()) {
+        if (root) {
+            json_free(root);
+        }
+        root = val;
+        return true;
+    }
+    JNode* parent = json_get(root, steps.data(), steps.size() - 1);
+    if (!parent) {
+        return false;
+    }
+    const JStep &last = steps.back();
+    JNode** slot = json_child(parent, last);
+    if (slot) {
+        json_free(*slot);
+        *slot = val;
+        return true;
+    }
+    if (last.is_index || parent->type != J_OBJ) {
+        return false;
+    }
+    parent->keys.push_back(last.key);
+    parent->kids.push_back(val);
+    return true;
+}
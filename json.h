@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// a JSON document parsed once into a tree, so that a path is read or
+// updated without parsing or serializing the rest of the document
+enum {
+    J_NULL = 0,
+    J_FALSE = 1,
+    J_TRUE = 2,
+    J_NUM = 3,
+    J_STR = 4,
+    J_ARR = 5,
+    J_OBJ = 6,
+};
+
+struct JNode {
+    uint8_t type = J_NULL;
+    double num = 0;
+    // J_STR: the decoded string, J_NUM: the literal, kept for exact output
+    std::string str;
+    // J_ARR: the elements, J_OBJ: the values in the order of `keys`
+    std::vector<JNode*> kids;
+    std::vector<std::string> keys;
+};
+
+// the nesting of a document, a scalar is 1
+const size_t k_json_max_depth = 128;
+
+// NULL on syntax errors or too deep
+JNode* json_parse(const char* data, size_t len);
+void json_free(JNode* node);
+size_t json_depth(const JNode* node);
+void json_dump(const JNode* node, std::string &out);
+void json_set_num(JNode* node, double num);
+
+// a path like `$.a.b[0]["c d"]`, the leading `$` is optional
+struct JStep {
+    bool is_index = false;
+    int64_t index = 0;      // negative from the end
+    std::string key;
+};
+
+bool json_path(const std::string &path, std::vector<JStep> &out);
+// NULL if not found
+JNode* json_get(JNode* root, const JStep* steps, size_t n);
+// replace or add the value, the parent must exist and an array index
+// must be in range, returns false otherwise and `val` is not taken
+bool json_set(JNode* &root, const std::vector<JStep> &steps, JNode* val);
@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "mem.h"
+
+const size_t k_huge_page = (size_t)2 << 20;
+
+static bool g_hugepages = false;
+
+void mem_use_hugepages(bool on) {
+    g_hugepages = on;
+}
+
+static bool use_mmap(size_t size) {
+    return g_hugepages && size >= k_huge_page;
+}
+
+static size_t huge_round(size_t size) {
+    return (size + k_huge_page - 1) & ~(k_huge_page - 1);
+}
+
+void* mem_alloc_zeroed(size_t size) {
+    if (!use_mmap(size)) {
+        return calloc(1, size);
+    }
+    // over-allocate, then trim it to a 2MB aligned range
+    size_t len = huge_round(size);
+    uint8_t* ptr = (uint8_t*)mmap(NULL, len + k_huge_page,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t* aligned = (uint8_t*)huge_round((uintptr_t)ptr);
+    if (aligned > ptr) {
+        munmap(ptr, aligned - ptr);
+    }
+    munmap(aligned + len, ptr + k_huge_page - aligned);
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;     // zeroed by the kernel
+}
+
+void mem_free(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (use_mmap(size)) {
+        munmap(ptr, huge_round(size));
+    } else {
+        free(ptr);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+
+// large arrays backed by 2MB transparent huge pages to reduce TLB misses,
+// must be set before anything is allocated
+void mem_use_hugepages(bool on);
+void* mem_alloc_zeroed(size_t size);
+void mem_free(void* ptr, size_t size);
+
+// for std::vector
+template <class T>
+struct HugeAlloc {
+    typedef T value_type;
+    HugeAlloc() = default;
+    template <class U> HugeAlloc(const HugeAlloc<U> &) {}
+    T* allocate(size_t n) {
+        void* ptr = mem_alloc_zeroed(n * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return (T*)ptr;
+    }
+    void deallocate(T* ptr, size_t n) {
+        mem_free(ptr, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const HugeAlloc<T> &, const HugeAlloc<U> &) { return true; }
+template <class T, class U>
+bool operator!=(const HugeAlloc<T> &, const HugeAlloc<U> &) { return false; }
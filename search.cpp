@@ -0,0 +1,477 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+
+#include "search.h"
+#include "common.h"
+
+// a posting list: the sorted docids of a tag
+struct FTTag {
+    HNode node;
+    std::string tag;
+    std::vector<uint32_t> docids;
+};
+
+struct FTLookup {
+    HNode node;
+    const char* str = NULL;
+    size_t len = 0;
+};
+
+static bool tag_eq(HNode* node, HNode* key) {
+    FTTag* tag = container_of(node, FTTag, node);
+    FTLookup* lk = container_of(key, FTLookup, node);
+    return tag->tag.size() == lk->len && 0 == memcmp(tag->tag.data(), lk->str, lk->len);
+}
+
+static bool doc_eq(HNode* node, HNode* key) {
+    FTDoc* doc = container_of(node, FTDoc, node);
+    FTLookup* lk = container_of(key, FTLookup, node);
+    return doc->key.size() == lk->len && 0 == memcmp(doc->key.data(), lk->str, lk->len);
+}
+
+static FTLookup lookup_key(const char* str, size_t len) {
+    FTLookup lk;
+    lk.node.hcode = str_hash((const uint8_t*)str, len);
+    lk.str = str;
+    lk.len = len;
+    return lk;
+}
+
+static FTTag* tag_get(FTField* field, const char* str, size_t len, bool create) {
+    FTLookup lk = lookup_key(str, len);
+    HNode* node = hm_lookup(&field->tags, &lk.node, &tag_eq);
+    if (node || !create) {
+        return node ? container_of(node, FTTag, node) : NULL;
+    }
+    FTTag* tag = new FTTag();
+    tag->tag.assign(str, len);
+    tag->node.hcode = lk.node.hcode;
+    hm_insert(&field->tags, &tag->node);
+    return tag;
+}
+
+FTIndex* ft_new(const std::string &name, const std::string &prefix) {
+    FTIndex* idx = new FTIndex();
+    idx->name = name;
+    idx->prefix = prefix;
+    return idx;
+}
+
+void ft_add_field(FTIndex* idx, const std::string &name, uint32_t type) {
+    assert(hm_size(&idx->docs) == 0);
+    FTField* field = new FTField();
+    field->name = name;
+    field->type = type;
+    idx->fields.push_back(field);
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+    ((std::vector<HNode*>*)arg)->push_back(node);
+    return true;
+}
+
+void ft_del(FTIndex* idx) {
+    for (FTField* field : idx->fields) {
+        zset_clear(&field->num);
+        // `hm_foreach()` can't free the nodes it visits
+        std::vector<HNode*> tags;
+        hm_foreach(&field->tags, &cb_collect, &tags);
+        hm_clear(&field->tags);
+        for (HNode* node : tags) {
+            delete container_of(node, FTTag, node);
+        }
+        delete field;
+    }
+    for (FTDoc* doc : idx->by_docid) {
+        delete doc;
+    }
+    hm_clear(&idx->docs);
+    delete idx;
+}
+
+size_t ft_size(FTIndex* idx) {
+    return hm_size(&idx->docs);
+}
+
+// numbers are keyed by the big-endian docid
+static void docid_name(uint32_t docid, char* name) {
+    uint32_t be = __builtin_bswap32(docid);
+    memcpy(name, &be, 4);
+}
+
+// the tags are separated by commas, calls `f` with each of them
+template <class F>
+static void tag_split(const std::string &val, F f) {
+    size_t begin = 0;
+    while (begin <= val.size()) {
+        size_t end = val.find(',', begin);
+        end = end == std::string::npos ? val.size() : end;
+        if (end > begin) {
+            f(val.data() + begin, end - begin);
+        }
+        begin = end + 1;
+    }
+}
+
+static bool str2num(const std::string &s, double &out) {
+    char* endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return !s.empty() && endp == s.c_str() + s.size() && !isnan(out);
+}
+
+static void field_add(FTField* field, uint32_t docid, const std::string &val) {
+    if (field->type == FT_NUMERIC) {
+        double num = 0;
+        if (str2num(val, num)) {    // not indexed otherwise
+            char name[4];
+            docid_name(docid, name);
+            zset_insert(&field->num, name, 4, num);
+        }
+        return;
+    }
+    tag_split(val, [&](const char* str, size_t len) {
+        std::vector<uint32_t> &ids = tag_get(field, str, len, true)->docids;
+        // appended unless a docid is reused
+        auto it = std::lower_bound(ids.begin(), ids.end(), docid);
+        if (it == ids.end() || *it != docid) {
+            ids.insert(it, docid);
+        }
+    });
+}
+
+static void field_remove(FTField* field, uint32_t docid, const std::string &val) {
+    if (field->type == FT_NUMERIC) {
+        char name[4];
+        docid_name(docid, name);
+        if (ZNode* znode = zset_lookup(&field->num, name, 4)) {
+            zset_delete(&field->num, znode);
+        }
+        return;
+    }
+    tag_split(val, [&](const char* str, size_t len) {
+        FTTag* tag = tag_get(field, str, len, false);
+        if (!tag) {
+            return;     // a duplicate tag
+        }
+        std::vector<uint32_t> &ids = tag->docids;
+        auto it = std::lower_bound(ids.begin(), ids.end(), docid);
+        if (it != ids.end() && *it == docid) {
+            ids.erase(it);
+        }
+        if (ids.empty()) {
+            FTLookup lk = lookup_key(str, len);
+            hm_delete(&field->tags, &lk.node, &tag_eq);
+            delete tag;
+        }
+    });
+}
+
+static FTDoc* doc_lookup(FTIndex* idx, const std::string &key) {
+    FTLookup lk = lookup_key(key.data(), key.size());
+    HNode* node = hm_lookup(&idx->docs, &lk.node, &doc_eq);
+    return node ? container_of(node, FTDoc, node) : NULL;
+}
+
+void ft_doc_update(FTIndex* idx, const std::string &key, FTGetField get, void* ptr) {
+    FTDoc* doc = doc_lookup(idx, key);
+    if (!doc) {
+        doc = new FTDoc();
+        doc->key = key;
+        doc->node.hcode = str_hash((const uint8_t*)key.data(), key.size());
+        doc->vals.resize(idx->fields.size());
+        doc->has.resize(idx->fields.size());
+        if (idx->free_ids.empty()) {
+            doc->docid = (uint32_t)idx->by_docid.size();
+            idx->by_docid.push_back(doc);
+        } else {
+            doc->docid = idx->free_ids.back();
+            idx->free_ids.pop_back();
+            idx->by_docid[doc->docid] = doc;
+        }
+        hm_insert(&idx->docs, &doc->node);
+    }
+    // only the changed fields are reindexed
+    for (size_t i = 0; i < idx->fields.size(); i++) {
+        FTField* field = idx->fields[i];
+        const std::string* val = get(ptr, field->name);
+        if (val && doc->has[i] && *val == doc->vals[i]) {
+            continue;
+        }
+        if (doc->has[i]) {
+            field_remove(field, doc->docid, doc->vals[i]);
+        }
+        doc->has[i] = val != NULL;
+        doc->vals[i] = val ? *val : std::string();
+        if (val) {
+            field_add(field, doc->docid, *val);
+        }
+    }
+}
+
+void ft_doc_remove(FTIndex* idx, const std::string &key) {
+    FTLookup lk = lookup_key(key.data(), key.size());
+    HNode* node = hm_delete(&idx->docs, &lk.node, &doc_eq);
+    if (!node) {
+        return;
+    }
+    FTDoc* doc = container_of(node, FTDoc, node);
+    for (size_t i = 0; i < idx->fields.size(); i++) {
+        if (doc->has[i]) {
+            field_remove(idx->fields[i], doc->docid, doc->vals[i]);
+        }
+    }
+    idx->by_docid[doc->docid] = NULL;
+    idx->free_ids.push_back(doc->docid);
+    delete doc;
+}
+
+// sorted set intersection
+
+static size_t intersect_scalar(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+// a much smaller array is searched in the bigger one
+static size_t intersect_gallop(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* out) {
+    size_t n = 0;
+    const uint32_t* lo = b;
+    const uint32_t* end = b + nb;
+    for (size_t i = 0; i < na && lo < end; i++) {
+        size_t step = 1;
+        const uint32_t* hi = lo;
+        while (hi < end && *hi < a[i]) {
+            lo = hi;
+            hi = lo + step > end ? end : lo + step;
+            step *= 2;
+        }
+        lo = std::lower_bound(lo, hi, a[i]);
+        if (lo < end && *lo == a[i]) {
+            out[n++] = a[i];
+        }
+    }
+    return n;
+}
+
+// compare 8 x 8 elements at a time: `b` is rotated through all the lanes,
+// the matched lanes of `a` are written out, then the block with the lower
+// maximum is consumed
+__attribute__((target("avx2")))
+static size_t intersect_avx2(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* out) {
+    size_t i = 0, j = 0, n = 0;
+    const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb, rot);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        uint32_t amax = a[i + 7];
+        uint32_t bmax = b[j + 7];
+        if (amax <= bmax) {
+            // the whole block of `a` is decided
+            for (; mask; mask &= mask - 1) {
+                out[n++] = a[i + __builtin_ctz(mask)];
+            }
+            i += 8;
+        } else {
+            // only the lanes of `a` up to `bmax` are decided
+            uint32_t done = 0;
+            while (done < 8 && a[i + done] <= bmax) {
+                done++;
+            }
+            for (mask &= (1u << done) - 1; mask; mask &= mask - 1) {
+                out[n++] = a[i + __builtin_ctz(mask)];
+            }
+            i += done;
+        }
+        if (bmax <= amax) {
+            j += 8;
+        }
+    }
+    return n + intersect_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+size_t ft_intersect(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* out) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na * 32 < nb) {
+        return intersect_gallop(a, na, b, nb, out);
+    }
+    static bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? intersect_avx2(a, na, b, nb, out) : intersect_scalar(a, na, b, nb, out);
+}
+
+// query evaluation
+
+static FTField* field_get(FTIndex* idx, const std::string &name) {
+    for (FTField* field : idx->fields) {
+        if (field->name == name) {
+            return field;
+        }
+    }
+    return NULL;
+}
+
+static bool parse_bound(std::string s, double &val, bool &excl) {
+    excl = !s.empty() && s[0] == '(';
+    return str2num(excl ? s.substr(1) : s, val);
+}
+
+// @field:[min max]
+static bool eval_range(FTField* field, const std::string &arg, std::vector<uint32_t> &out) {
+    size_t sp = arg.find(' ');
+    if (arg.size() < 2 || arg.back() != ']' || sp == std::string::npos) {
+        return false;
+    }
+    double lo = 0, hi = 0;
+    bool lo_excl = false, hi_excl = false;
+    if (!parse_bound(arg.substr(1, sp - 1), lo, lo_excl)
+        || !parse_bound(arg.substr(sp + 1, arg.size() - sp - 2), hi, hi_excl))
+    {
+        return false;
+    }
+    out.clear();
+    for (ZNode* znode = zset_seekge(&field->num, lo, "", 0); znode; znode = znode_offset(znode, +1)) {
+        if (znode->score > hi || (hi_excl && znode->score == hi)) {
+            break;
+        }
+        if (lo_excl && znode->score == lo) {
+            continue;
+        }
+        uint32_t be = 0;
+        memcpy(&be, znode->name, 4);
+        out.push_back(__builtin_bswap32(be));
+    }
+    std::sort(out.begin(), out.end());
+    return true;
+}
+
+// @field:{a|b}
+static bool eval_tags(FTField* field, const std::string &arg, std::vector<uint32_t> &out) {
+    if (arg.size() < 2 || arg.back() != '}') {
+        return false;
+    }
+    out.clear();
+    std::vector<uint32_t> merged;
+    size_t begin = 1;
+    while (begin < arg.size()) {
+        size_t end = arg.find('|', begin);
+        end = end == std::string::npos ? arg.size() - 1 : end;
+        FTTag* tag = tag_get(field, arg.data() + begin, end - begin, false);
+        if (tag) {
+            merged.resize(out.size() + tag->docids.size());
+            auto last = std::set_union(out.begin(), out.end(),
+                tag->docids.begin(), tag->docids.end(), merged.begin());
+            merged.resize(last - merged.begin());
+            out.swap(merged);
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+// split into clauses, the spaces inside [] are kept
+static void split_clauses(const std::string &query, std::vector<std::string> &out) {
+    std::string cur;
+    bool in_range = false;
+    for (char ch : query) {
+        if (ch == ' ' && !in_range) {
+            if (!cur.empty()) {
+                out.push_back(cur);
+            }
+            cur.clear();
+            continue;
+        }
+        if (ch == '[') {
+            in_range = true;
+        } else if (ch == ']') {
+            in_range = false;
+        }
+        if (ch != ' ' || cur.back() != ' ') {
+            cur.push_back(ch);
+        }
+    }
+    if (!cur.empty()) {
+        out.push_back(cur);
+    }
+}
+
+bool ft_search(FTIndex* idx, const std::string &query, std::vector<uint32_t> &out, std::string &err) {
+    std::vector<std::string> clauses;
+    split_clauses(query, clauses);
+    if (clauses.empty()) {
+        err = "empty query";
+        return false;
+    }
+    std::vector<std::vector<uint32_t>> sets;
+    bool all = false;
+    for (const std::string &clause : clauses) {
+        if (clause == "*") {
+            all = true;
+            continue;
+        }
+        size_t colon = clause.find(':');
+        if (clause[0] != '@' || colon == std::string::npos || colon + 1 == clause.size()) {
+            err = "bad clause: " + clause;
+            return false;
+        }
+        FTField* field = field_get(idx, clause.substr(1, colon - 1));
+        if (!field) {
+            err = "unknown field: " + clause.substr(1, colon - 1);
+            return false;
+        }
+        std::string arg = clause.substr(colon + 1);
+        sets.emplace_back();
+        bool ok = field->type == FT_NUMERIC
+            ? arg[0] == '[' && eval_range(field, arg, sets.back())
+            : arg[0] == '{' && eval_tags(field, arg, sets.back());
+        if (!ok) {
+            err = "bad clause: " + clause;
+            return false;
+        }
+    }
+
+    out.clear();
+    if (sets.empty() && all) {
+        for (FTDoc* doc : idx->by_docid) {
+            if (doc) {
+                out.push_back(doc->docid);
+            }
+        }
+        return true;
+    }
+    // the smallest first, so the intermediate results stay small
+    std::sort(sets.begin(), sets.end(),
+        [](const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+            return a.size() < b.size();
+        });
+    out.swap(sets[0]);
+    std::vector<uint32_t> tmp;
+    for (size_t i = 1; i < sets.size() && !out.empty(); i++) {
+        tmp.resize(out.size());
+        tmp.resize(ft_intersect(out.data(), out.size(), sets[i].data(), sets[i].size(), tmp.data()));
+        out.swap(tmp);
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+#include "zset.h"
+
+// a secondary index over the hashes of a key prefix,
+// numeric fields are in a zset, tag fields are in posting lists
+enum {
+    FT_NUMERIC = 0,
+    FT_TAG = 1,
+};
+
+struct FTField {
+    std::string name;
+    uint32_t type = FT_NUMERIC;
+    // numeric: the name is the big-endian docid, so ties are in docid order
+    ZSet num;
+    // tag: the tag -> `FTTag`
+    HMap tags;
+};
+
+// a document is a key with its indexed values,
+// the docid is reused after the document is removed
+struct FTDoc {
+    HNode node;
+    std::string key;
+    uint32_t docid = 0;
+    // the raw value of each field, for removal, `has` is false if missing
+    std::vector<std::string> vals;
+    std::vector<bool> has;
+};
+
+struct FTIndex {
+    std::string name;
+    std::string prefix;
+    std::vector<FTField*> fields;
+    HMap docs;                      // key -> `FTDoc`
+    std::vector<FTDoc*> by_docid;   // NULL if free
+    std::vector<uint32_t> free_ids;
+};
+
+FTIndex* ft_new(const std::string &name, const std::string &prefix);
+void ft_add_field(FTIndex* idx, const std::string &name, uint32_t type);
+void ft_del(FTIndex* idx);
+// the value of a field of the document, NULL if missing
+typedef const std::string* (*FTGetField)(void* doc, const std::string &field);
+// index the current values of a document, replacing the old ones
+void ft_doc_update(FTIndex* idx, const std::string &key, FTGetField get, void* doc);
+void ft_doc_remove(FTIndex* idx, const std::string &key);
+size_t ft_size(FTIndex* idx);
+
+// the query is an AND of clauses:
+//   @field:[min max] numeric range, `(` before a bound excludes it
+//   @field:{a|b}     any of the tags
+//   *                all documents
+// the docids are sorted, returns false with a message on syntax errors
+bool ft_search(FTIndex* idx, const std::string &query, std::vector<uint32_t> &out, std::string &err);
+
+// intersect 2 sorted arrays, with AVX2 if the CPU supports it,
+// `out` must not overlap the inputs and must fit the smaller one
+size_t ft_intersect(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* out);
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <malloc.h>
 // system
 #include <time.h>
 #include <fcntl.h>
@@ -13,11 +14,15 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <netinet/ip.h>
 
 // c++
 #include <vector>
 #include <string>
+#include <set>
+#include <algorithm>
 
 // proj
 #include "hashtable.h"
@@ -25,6 +30,15 @@
 #include "common.h"
 #include "list.h"
 #include "heap.h"
+#include "spill.h"
+#include "thread_pool.h"
+#include "defrag.h"
+#include "mem.h"
+#include "ebr.h"
+#include "vset.h"
+#include "search.h"
+#include "json.h"
+#include "sketch.h"
 
 static void msg(const char* msg) {
     fprintf(stderr, "%s\n", msg);
@@ -45,6 +59,12 @@ static uint64_t get_monotonic_msec() {
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+static uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
 static void fd_set_nb(int fd) {
     errno = 0;
     int flags = fcntl(fd, F_GETFL, 0);
@@ -88,19 +108,135 @@ struct Conn {
     // timer
     uint64_t last_active_ms = 0;
     DList idle_node;
+    // waiting for an async result, following requests are not processed
+    bool blocked = false;
+    struct SpillRead* spill_read = NULL;
+    // a read-only connection owned by a reader thread
+    struct Reader* reader = NULL;
+    // blocked by BZPOPMIN/BZPOPMAX
+    struct BlockKey* block_key = NULL;
+    DList block_node;               // in `BlockKey::waiters`
+    bool block_max = false;
+    size_t block_heap_idx = -1;     // the timeout in `g_data.block_heap`
+    bool woken = false;             // in `g_data.woken`
+    // the database selected by SELECT
+    uint32_t db = 0;
+};
+
+typedef std::vector<HeapItem, HugeAlloc<HeapItem>> HeapVec;
+
+// a logical database, selected by SELECT
+struct DB {
+    uint32_t id = 0;
+    HMap keys;  // top-level hashtable
+    // timer for TTLs
+    HeapVec heap;
+    // the earliest member TTL of each zset
+    HeapVec member_heap;
+    // secondary indexes over hashes, by key prefix
+    std::vector<FTIndex*> indexes;
+    // per-tenant accounting, `Namespace` by prefix
+    HMap namespaces;
+    std::vector<struct Namespace*> ns_list;     // in the order of creation
 };
 
+const uint32_t k_num_dbs = 16;
+
 // global states
 static struct {
-    HMap db;    // top-level hashtable
+    DB dbs[k_num_dbs];
+    // the database being worked on: the client's for commands,
+    // and each in turn for timers and background work
+    DB* db = NULL;
     // a map of all client connections, keyed by fd
     std::vector<Conn*> fd2conn;
     // timers for idle connections
     DList idle_list;
-    // timer for TTLs
-    std::vector<HeapItem> heap;
+    // side arrays of per-key metadata
+    std::vector<struct MetaChunk*> meta;
+    std::vector<uint32_t> meta_free;
+    // the listening socket
+    int listen_fd = -1;
+    // command line, reused to exec the new binary on hot upgrade
+    std::vector<std::string> argv;
+    std::string upgrade_binary;     // set at startup, argv[0] by default
+    // hot upgrade: the channel to the new process, -1 if not upgrading
+    int upgrade_fd = -1;
+    pid_t upgrade_pid = -1;
+    // async work, the results are passed back to the event loop
+    ThreadPool thread_pool;
+    int wake_fds[2] = {-1, -1};     // a pipe to wake up poll()
+    pthread_mutex_t done_mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Work> done;         // callbacks to run in the event loop
+    size_t async_pending = 0;
+    // tiered storage: cold string values are moved to a file
+    std::string spill_path;
+    uint64_t spill_after_ms = 60 * 1000;
+    uint32_t spill_gen = 0;
+    SpillFile* spill = NULL;        // new values are appended to this file
+    SpillFile* spill_old = NULL;    // being compacted into `spill`
+    uint32_t spill_db = 0;
+    size_t spill_cursor = 0;
+    uint64_t spill_next_ms = 0;
+    bool spill_busy = false;        // a `SpillJob` is in the thread pool
+    // active defragmentation
+    bool defrag_enabled = false;
+    int defrag_state = 0;           // DEFRAG_*
+    uint32_t defrag_db = 0;
+    size_t defrag_cursor = 0;
+    std::vector<struct Entry*> defrag_zsets;   // big zsets to be processed
+    size_t defrag_zset_cursor = 0;
+    uint64_t defrag_next_ms = 0;
+    // allocations not used for relocation, freed after each time slice
+    std::vector<struct Entry*> defrag_spare_ents;
+    std::vector<std::string> defrag_spare_strs;
+    std::vector<void*> defrag_spare_nodes;
+    // point-in-time snapshots without fork()
+    std::string snap_path;
+    int snap_state = 0;             // SNAP_*
+    uint32_t snap_epoch = 0;        // each entry is written once per epoch
+    int snap_fd = -1;
+    uint32_t snap_db = 0;
+    size_t snap_cursor = 0;
+    size_t snap_pending = 0;        // entries of the snapshot not written yet
+    Buffer snap_buf;
+    int64_t snap_last_ok = 0;       // unix time of the last successful snapshot
+    // reader threads serving GET concurrently with this thread
+    int read_fd = -1;
+    std::vector<struct Reader*> readers;
+    EBR ebr;                        // for entries and tables seen by the readers
+    // clients blocked by BZPOPMIN/BZPOPMAX
+    HMap block_keys;                // the keys being waited on, in all databases
+    HeapVec block_heap;             // timeouts
+    std::vector<Conn*> woken;       // replied, to be unblocked by the event loop
+    // keys in namespaces written by the command, sized after it, by meta_id
+    std::vector<uint32_t> ns_dirty;
+    uint64_t ns_next_ms = 0;        // the next ops/sec sample
 } g_data;
 
+static void conn_cancel_spill_read(Conn* conn);
+static void conn_cancel_bzpop(Conn* conn);
+
+// create a 'struct Conn' and put it into the map
+static Conn* conn_new(int conn_fd) {
+    // set the new connection fd to non blocking mode
+    fd_set_nb(conn_fd);
+
+    Conn* conn = new Conn();
+    conn->fd = conn_fd;
+    conn->want_read = true;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+
+    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+
+    assert(!g_data.fd2conn[conn->fd]);
+    g_data.fd2conn[conn->fd] = conn;
+    return conn;
+}
+
 // application callback when the listening socket is ready
 static size_t handle_accept(int fd) {
     // accept
@@ -118,30 +254,24 @@ static size_t handle_accept(int fd) {
         ntohs(client_addr.sin_port)
     );
     
-    // set the new connection fd to non blocking mode
-    fd_set_nb(conn_fd);
-
-    // create a 'struct Conn'
-    Conn* conn = new Conn();
-    conn->fd = conn_fd;
-    conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
-
-    // put it into the map
-    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-        g_data.fd2conn.resize(conn->fd + 1);
-    }
-
-    assert(!g_data.fd2conn[conn->fd]);
-    g_data.fd2conn[conn->fd] = conn;
+    conn_new(conn_fd);
     return 0;
 }
 
+// stop processing requests until `conn_unblock()`
+static void conn_block(Conn* conn) {
+    conn->blocked = true;
+    // no idle timeout while waiting
+    dlist_detach(&conn->idle_node);
+    dlist_init(&conn->idle_node);   // so that detaching it again is harmless
+}
+
 static void conn_destroy(Conn* conn) {
     (void)close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
     dlist_detach(&conn->idle_node);
+    conn_cancel_spill_read(conn);
+    conn_cancel_bzpop(conn);
     delete conn;
 }
 
@@ -201,6 +331,7 @@ enum {
     ERR_TOO_BIG = 2,     // response too big
     ERR_BAD_TYP = 3,     // unexpected value type
     ERR_BAD_ARG = 4,     // bad arguments 
+    ERR_QUOTA = 5,       // over the namespace quota
 };
 
 // data types of serialized data
@@ -279,35 +410,236 @@ enum {
     T_INIT  = 0,
     T_STR   = 1,    // string
     T_ZSET  = 2,    // sorted set
+    T_ZSET_TTL = 3, // only in `entry_encode()`, a zset with member TTLs
+    T_ZSET_INT = 4, // only in `entry_encode()`, a zset of int scores
+    T_VSET  = 5,    // vector set
+    T_HASH  = 6,    // hash of fields
+    T_JSON  = 7,    // JSON document
+    T_THROTTLE = 8, // GCRA rate limiter state
+    T_CMS   = 9,    // count-min sketch
+    T_TOPK  = 10,   // top-k by HeavyKeeper
 };
 
 // KV pair for the top-level hashtable
 struct Entry {
     struct HNode node;  // hashtable node
     std::string key;
-    // for TTL
-    size_t heap_idx = -1;   // array index to the heap item
+    // index into the side arrays of metadata, see `MetaChunk`
+    uint32_t meta_id = -1;
     // value
     uint32_t type = 0;
-    // one of the following
+    // the string, the most common type, is kept inline
     std::string str;
-    ZSet zset;
+    // the other types, by `type`
+    union {
+        ZSet* zset = NULL;
+        VSet* vset;
+        HMap* hash;         // `HField` by the field name
+        JNode* json;
+        uint64_t tat_us;    // the theoretical arrival time of THROTTLE
+        CMS* cms;
+        TopK* topk;
+    };
+    // the string value when it's moved to the file
+    SpillFile* spill = NULL;
+    uint64_t spill_off = 0;
+    uint32_t spill_len = 0;
+};
+
+// metadata mutated by reads and timers, kept in dense side arrays instead of
+// the Entry, so that the pages holding keys and values are not dirtied by them,
+// which also means less copy-on-write after fork()
+const size_t k_meta_chunk = 4096;
+
+struct TTLSlot {
+    size_t heap_idx = -1;   // array index to the heap item
+    Entry* owner = NULL;
+};
+
+// the key's share of its namespace, if any
+struct NSSlot {
+    struct Namespace* ns = NULL;
+    uint32_t pos = 0;       // index in `Namespace::metas`
+    bool dirty = false;     // in `g_data.ns_dirty`
+    uint64_t bytes = 0;     // accounted to the namespace
+};
+
+struct MetaChunk {
+    uint64_t atime_ms[k_meta_chunk] = {};   // access clock, for the tiered storage
+    TTLSlot ttl[k_meta_chunk];              // for TTL
+    TTLSlot member_ttl[k_meta_chunk];       // for the member TTLs of a zset
+    uint32_t snap_epoch[k_meta_chunk] = {}; // the last snapshot that has the entry
+    NSSlot ns[k_meta_chunk];                // for the namespace accounting
 };
 
+static uint64_t &entry_atime(Entry* ent) {
+    return g_data.meta[ent->meta_id / k_meta_chunk]->atime_ms[ent->meta_id % k_meta_chunk];
+}
+
+static TTLSlot &entry_ttl(Entry* ent) {
+    return g_data.meta[ent->meta_id / k_meta_chunk]->ttl[ent->meta_id % k_meta_chunk];
+}
+
+static TTLSlot &entry_member_ttl(Entry* ent) {
+    return g_data.meta[ent->meta_id / k_meta_chunk]->member_ttl[ent->meta_id % k_meta_chunk];
+}
+
+// the TTL slots point back to the entry
+static void meta_set_owner(Entry* ent) {
+    entry_ttl(ent).owner = ent;
+    entry_member_ttl(ent).owner = ent;
+}
+
+static uint32_t &entry_snap_epoch(Entry* ent) {
+    return g_data.meta[ent->meta_id / k_meta_chunk]->snap_epoch[ent->meta_id % k_meta_chunk];
+}
+
+static NSSlot &meta_ns(uint32_t meta_id) {
+    return g_data.meta[meta_id / k_meta_chunk]->ns[meta_id % k_meta_chunk];
+}
+
+static NSSlot &entry_ns(Entry* ent) {
+    return meta_ns(ent->meta_id);
+}
+
+static Entry* meta_owner(uint32_t meta_id) {
+    return g_data.meta[meta_id / k_meta_chunk]->ttl[meta_id % k_meta_chunk].owner;
+}
+
+static void meta_new(Entry* ent) {
+    if (g_data.meta_free.empty()) {
+        // add a chunk, chunks are never moved since HeapItem::ref points to them
+        uint32_t base = (uint32_t)(g_data.meta.size() * k_meta_chunk);
+        g_data.meta.push_back(new MetaChunk());
+        for (size_t i = k_meta_chunk; i > 0; i--) {
+            g_data.meta_free.push_back(base + (uint32_t)i - 1);
+        }
+    }
+    ent->meta_id = g_data.meta_free.back();
+    g_data.meta_free.pop_back();
+    entry_atime(ent) = get_monotonic_msec();
+    entry_ttl(ent) = TTLSlot{};
+    entry_member_ttl(ent) = TTLSlot{};
+    entry_ns(ent) = NSSlot{};
+    meta_set_owner(ent);
+    // not in the snapshot being written, if any
+    entry_snap_epoch(ent) = g_data.snap_epoch;
+}
+
+static void meta_del(Entry* ent) {
+    g_data.meta_free.push_back(ent->meta_id);
+    ent->meta_id = -1;
+}
+
 static Entry* entry_new(uint32_t type) {
     Entry* ent = new Entry();
     ent->type = type;
+    if (type == T_ZSET) {
+        ent->zset = new ZSet();
+    } else if (type == T_HASH) {
+        ent->hash = new HMap();
+    }
+    meta_new(ent);
     return ent;
 }
 
 static void entry_set_ttl(Entry* ent, int64_t ttl_ms);
+static void zset_sync_ttl(Entry* ent);
+static void defrag_forget(Entry* ent);
+static void entry_before_write(Entry* ent);
+static void hash_del(Entry* ent);
+static void ns_add(Entry* ent);
+static void ns_remove(Entry* ent);
+
+// link a new key into the database being worked on
+static void entry_insert(Entry* ent) {
+    hm_insert(&g_data.db->keys, &ent->node);
+    ns_add(ent);
+}
+
+// the value in the file is no longer needed
+static void entry_drop_spill(Entry* ent) {
+    spill_forget(ent->spill, ent->spill_len);
+    ent->spill = NULL;
+    ent->spill_off = 0;
+    ent->spill_len = 0;
+}
+
+static void entry_free(void* ptr, size_t) {
+    delete (Entry*)ptr;
+}
+
+// values are immutable if there are readers, a new entry is published instead
+static void entry_replace_str(Entry* ent, std::string &val) {
+    Entry* fresh = new Entry();
+    fresh->type = T_STR;
+    fresh->key = ent->key;
+    fresh->meta_id = ent->meta_id;
+    meta_set_owner(fresh);
+    fresh->str.swap(val);
+    hm_replace(&g_data.db->keys, &ent->node, &fresh->node);
+    ebr_retire(&g_data.ebr, ent, 0, &entry_free);
+}
+
+// move the value and the metadata to another entry, except the key and
+// the string, which the caller either moves or copies
+static void entry_move_value(Entry* dst, Entry* src) {
+    dst->meta_id = src->meta_id;
+    meta_set_owner(dst);
+    dst->type = src->type;
+    // the whole union, whichever member it is
+    static_assert(sizeof(Entry::tat_us) == sizeof(Entry::zset), "");
+    dst->tat_us = src->tat_us;
+    src->tat_us = 0;            // owned by `dst` now
+    dst->spill = src->spill;
+    dst->spill_off = src->spill_off;
+    dst->spill_len = src->spill_len;
+}
 
 static void entry_del(Entry* ent) {
+    entry_before_write(ent);
     if (ent->type == T_ZSET) {
-        zset_clear(&ent->zset);
+        zset_clear(ent->zset);
+        zset_sync_ttl(ent);     // remove from `g_data.db->member_heap`
+        delete ent->zset;
+        ent->zset = NULL;
     }
+    if (ent->type == T_VSET) {
+        vset_del(ent->vset);
+        ent->vset = NULL;
+    }
+    if (ent->type == T_HASH) {
+        hash_del(ent);
+    }
+    if (ent->type == T_JSON) {
+        json_free(ent->json);
+        ent->json = NULL;
+    }
+    if (ent->type == T_CMS) {
+        cms_del(ent->cms);
+        ent->cms = NULL;
+    }
+    if (ent->type == T_TOPK) {
+        topk_del(ent->topk);
+        ent->topk = NULL;
+    }
+    if (ent->spill) {
+        entry_drop_spill(ent);
+    }
+    defrag_forget(ent);
     entry_set_ttl(ent, -1);     // remove from the heap data structure
-    delete ent;
+    ns_remove(ent);
+    meta_del(ent);
+    if (g_data.readers.empty()) {
+        delete ent;
+    } else {
+        // reader threads may still be looking at it
+        ebr_retire(&g_data.ebr, ent, 0, &entry_free);
+    }
+}
+
+static bool hnode_same (HNode* node, HNode* key) {
+    return node == key;
 }
 
 struct LookupKey {
@@ -322,13 +654,15 @@ static bool entry_eq(HNode* node, HNode* key) {
     return ent->key == keydata->key;
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
+static void spill_read_async(Conn* conn, Entry* ent);
+
+static void do_get(Conn* conn, std::vector<std::string> &cmd, Buffer &out) {
     // a dummy struct just for the lookup
     LookupKey key;
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
     // hashtable lookup
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode* node = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
     if (!node) {
         return out_nil(out);
     }
@@ -337,6 +671,11 @@ static void do_get(std::vector<std::string> &cmd, Buffer &out) {
     if (ent->type != T_STR) {
         return out_err(out, ERR_BAD_TYP, "not a string value");
     }
+    entry_atime(ent) = get_monotonic_msec();
+    if (ent->spill) {
+        // the response is generated when the read is done
+        return spill_read_async(conn, ent);
+    }
     return out_str(out, ent->str.data(), ent->str.size());
 }
 
@@ -346,21 +685,30 @@ static void do_set(std::vector<std::string> &cmd, Buffer &out) {
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
     // hashtable lookup
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode* node = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
     if(node) {
         // found, update the value
         Entry* ent = container_of(node, Entry, node);
         if (ent->type != T_STR) {
             return out_err(out, ERR_BAD_TYP, "a non-string value exists");
         }
+        entry_before_write(ent);
+        if (ent->spill) {
+            entry_drop_spill(ent);
+        }
+        if (!g_data.readers.empty()) {
+            entry_replace_str(ent, cmd[2]);
+            return out_nil(out);
+        }
         ent->str.swap(cmd[2]);
+        entry_atime(ent) = get_monotonic_msec();
     } else {
         // not found, allocate and insert a new pair
         Entry* ent = entry_new(T_STR);
         ent->key.swap(key.key);
         ent->node.hcode = key.node.hcode;
         ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        entry_insert(ent);
     }
     return out_nil(out);
 }
@@ -371,45 +719,85 @@ static void do_del(std::vector<std::string> &cmd, Buffer &out) {
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
     // hashtable delete
-    HNode* node = hm_delete(&g_data.db, &key.node, &entry_eq);
+    HNode* node = hm_delete(&g_data.db->keys, &key.node, &entry_eq);
     if(node) {  // deallocate the pair
         entry_del(container_of(node, Entry, node));
     }
     return out_int(out, node ? 1 : 0);
 }
 
-static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
-    // swap the erased item with the last item
-    a[pos] = a.back();
-    a.pop_back();
-    // update the swapped item
-    if (pos < a.size()) {
-        heap_update(a.data(), pos, a.size());
-    }
-}
-
-static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
-    if (pos < a.size()) {
-        a[pos] = t; // update an existing item
-    } else {
-        pos = a.size();
-        a.push_back(t);     // add a new item
+// the remaining TTL, or -1 if none
+static int64_t entry_get_ttl(Entry* ent) {
+    size_t heap_idx = entry_ttl(ent).heap_idx;
+    if (heap_idx == (size_t)-1) {
+        return -1;
     }
-    heap_update(a.data(), pos, a.size());
+    uint64_t expire_at = g_data.db->heap[heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return expire_at > now_ms ? (int64_t)(expire_at - now_ms) : 0;
 }
 
 // set or remove the TTL
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+    TTLSlot &slot = entry_ttl(ent);
+    if (ttl_ms < 0 && slot.heap_idx != (size_t)-1) {
         // setting a negative TTL means removing the TTL
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = -1;
+        heap_delete(g_data.db->heap, slot.heap_idx);
+        slot.heap_idx = -1;
     } else if (ttl_ms >= 0) {
         // add or update the heap data structure
         uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+        HeapItem item = {expire_at, &slot.heap_idx};
+        heap_upsert(g_data.db->heap, slot.heap_idx, item);
+    }
+}
+
+// keep the zset in `g_data.db->member_heap` by its earliest member TTL, the item
+// may be earlier than the actual one after deletions, which is harmless
+static void zset_sync_ttl(Entry* ent) {
+    TTLSlot &slot = entry_member_ttl(ent);
+    uint64_t expire_at = zset_next_expire(ent->zset);
+    if (expire_at == (uint64_t)-1 && slot.heap_idx != (size_t)-1) {
+        heap_delete(g_data.db->member_heap, slot.heap_idx);
+        slot.heap_idx = -1;
+    } else if (expire_at != (uint64_t)-1) {
+        HeapItem item = {expire_at, &slot.heap_idx};
+        heap_upsert(g_data.db->member_heap, slot.heap_idx, item);
+    }
+}
+
+// the expired keys and members deleted at once, shared by all databases,
+// don't stall the server if too many are expiring at once
+const size_t k_max_works = 2000;
+
+static void entry_remove(Entry* ent);
+
+// delete the expired members, at most `max` of them, the rest are left to
+// the timer; `gone` is set if the key is deleted because none is left
+static size_t zset_purge(Entry* ent, uint64_t now_ms, size_t max, bool &gone) {
+    gone = false;
+    if (zset_next_expire(ent->zset) > now_ms) {
+        return 0;
+    }
+    entry_before_write(ent);
+    size_t n = zset_expire(ent->zset, now_ms, max);
+    zset_sync_ttl(ent);
+    if (n && !ent->zset->root) {
+        entry_remove(ent);
+        gone = true;
+    }
+    return n;
+}
+
+// the member to be written, an expired one not purged yet is deleted
+static ZNode* zset_lookup_live(Entry* ent, const std::string &name, uint64_t now_ms) {
+    ZNode* znode = zset_lookup(ent->zset, name.data(), name.size());
+    if (znode && (uint64_t)zset_get_expire(ent->zset, znode) <= now_ms) {
+        zset_delete(ent->zset, znode);
+        zset_sync_ttl(ent);
+        znode = NULL;
     }
+    return znode;
 }
 
 static bool str2int(const std::string &s, int64_t &out) {
@@ -429,9 +817,10 @@ static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode *node = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
     if (node) {
         Entry *ent = container_of(node, Entry, node);
+        entry_before_write(ent);
         entry_set_ttl(ent, ttl_ms);
     }
     return out_int(out, node ? 1: 0);
@@ -443,17 +832,18 @@ static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
 
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode* node = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
     if (!node) {
         return out_int(out, -2);    // not found
     }
 
     Entry* ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
+    size_t heap_idx = entry_ttl(ent).heap_idx;
+    if (heap_idx == (size_t)-1) {
         return out_int(out, -1);    // no TTL
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t expire_at = g_data.db->heap[heap_idx].val;
     uint64_t now_ms = get_monotonic_msec();
     return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
@@ -466,8 +856,8 @@ static bool cb_keys(HNode *node, void *arg) {
 }
 
 static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void*)&out);
+    out_arr(out, (uint32_t)hm_size(&g_data.db->keys));
+    hm_foreach(&g_data.db->keys, &cb_keys, (void*)&out);
 }
 
 static bool str2dbl(const std::string &s, double &out) {
@@ -476,55 +866,188 @@ static bool str2dbl(const std::string &s, double &out) {
     return endp == s.c_str() + s.size() && !isnan(out);
 }
 
-// zadd zset score name
+static void zset_wakeup(Entry* ent);
+
+// the score of either mode
+static void out_score(Buffer &out, ZSet* zset, ZNode* znode) {
+    return zset->int_scores ? out_int(out, znode_iscore(znode)) : out_dbl(out, znode->score);
+}
+
+// look up the zset to be written, `*ent` is NULL if it doesn't exist,
+// `int_scores` is updated to the mode of the existing zset, which can only
+// be changed while empty, so an emptied zset takes the mode of this command,
+// returns false with a reply on error
+static bool expect_zset_write(std::string &key, bool &int_scores, Entry** ent, Buffer &out) {
+    LookupKey lkey;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size());
+    HNode* hnode = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    if (!*ent) {
+        return true;
+    }
+    if ((*ent)->type != T_ZSET) {
+        out_err(out, ERR_BAD_TYP, "expect zset");
+        return false;
+    }
+    ZSet* zset = (*ent)->zset;
+    if (int_scores && !zset->int_scores && zset->root) {
+        out_err(out, ERR_BAD_TYP, "expect a zset of int scores");
+        return false;
+    }
+    entry_before_write(*ent);
+    if (zset->root) {
+        int_scores = zset->int_scores;
+    }
+    return true;
+}
+
+// create the zset after the arguments are checked, or set its mode
+static Entry* zset_create(std::string &key, Entry* ent, bool int_scores) {
+    if (ent) {
+        ent->zset->int_scores = int_scores;
+        return ent;
+    }
+    ent = entry_new(T_ZSET);
+    ent->key.swap(key);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    ent->zset->int_scores = int_scores;
+    entry_insert(ent);
+    return ent;
+}
+
+// zadd zset score name [px ms | ex sec] [int]
+// without a TTL the member's TTL is removed, `int` creates a zset of int scores
 static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t ttl_ms = -1;
+    bool int_scores = false;
+    for (size_t i = 4; i < cmd.size(); i++) {
+        bool ex = cmd[i] == "ex";
+        if (cmd[i] == "int") {
+            int_scores = true;
+        } else if ((!ex && cmd[i] != "px") || i + 1 == cmd.size()
+            || !str2int(cmd[i + 1], ttl_ms) || ttl_ms < 0)
+        {
+            return out_err(out, ERR_BAD_ARG, "expect `px ms`, `ex sec` or `int`");
+        } else {
+            ttl_ms *= ex ? 1000 : 1;
+            i++;
+        }
+    }
+
+    // look up the zset
+    Entry* ent = NULL;
+    if (!expect_zset_write(cmd[1], int_scores, &ent, out)) {
+        return;
+    }
     double score = 0;
-    if (!str2dbl(cmd[2], score)) {
+    int64_t iscore = 0;
+    if (int_scores && !str2int(cmd[2], iscore)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    } else if (!int_scores && !str2dbl(cmd[2], score)) {
         return out_err(out, ERR_BAD_ARG, "expect float");
     }
+    // an expired member is added again
+    uint64_t now_ms = get_monotonic_msec();
+    bool gone = false;
+    if (ent) {
+        zset_purge(ent, now_ms, k_max_works, gone);
+        ent = gone ? NULL : ent;
+    }
+    ent = zset_create(cmd[1], ent, int_scores);
+    // add or update the tuple
+    const std::string &name = cmd[3];
+    zset_lookup_live(ent, name, now_ms);
+    bool added = int_scores
+        ? zset_insert_int(ent->zset, name.data(), name.size(), iscore)
+        : zset_insert(ent->zset, name.data(), name.size(), score);
+    ZNode* znode = zset_lookup(ent->zset, name.data(), name.size());
+    zset_set_expire(ent->zset, znode, ttl_ms < 0 ? -1 : (int64_t)(now_ms + ttl_ms));
+    zset_sync_ttl(ent);
+    out_int(out, (int64_t)added);
+    // serve the blocked clients
+    zset_wakeup(ent);
+}
 
-    // look up or create the zset
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
+// zincrby zset incr name [int] : the member's TTL is kept, int scores don't
+// round, an overflow is an error
+static void do_zincrby(std::vector<std::string> &cmd, Buffer &out) {
+    bool int_scores = cmd.size() == 5;
+    if (int_scores && cmd[4] != "int") {
+        return out_err(out, ERR_BAD_ARG, "expect `int`");
+    }
     Entry* ent = NULL;
-    if (!hnode) {   // insert a new key
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
-    } else {        // check the existing key
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_BAD_TYP, "expect zset");
-        }
+    if (!expect_zset_write(cmd[1], int_scores, &ent, out)) {
+        return;
+    }
+    double incr = 0;
+    int64_t iincr = 0;
+    if (int_scores && !str2int(cmd[2], iincr)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    } else if (!int_scores && !str2dbl(cmd[2], incr)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    bool gone = false;
+    if (ent) {
+        zset_purge(ent, now_ms, k_max_works, gone);
+        ent = gone ? NULL : ent;
     }
 
-    // add or update the tuple
     const std::string &name = cmd[3];
-    bool added  = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+    ZNode* znode = ent ? zset_lookup_live(ent, name, now_ms) : NULL;
+    double score = incr + (znode ? znode->score : 0);
+    int64_t iscore = iincr;
+    if (int_scores && znode && __builtin_add_overflow(znode_iscore(znode), iincr, &iscore)) {
+        return out_err(out, ERR_BAD_ARG, "int score overflow");
+    } else if (!int_scores && isnan(score)) {
+        return out_err(out, ERR_BAD_ARG, "the score is not a number");
+    }
+    ent = zset_create(cmd[1], ent, int_scores);
+    int_scores
+        ? zset_insert_int(ent->zset, name.data(), name.size(), iscore)
+        : zset_insert(ent->zset, name.data(), name.size(), score);
+    int_scores ? out_int(out, iscore) : out_dbl(out, score);
+    if (!znode) {
+        zset_wakeup(ent);
+    }
 }
 
 static const ZSet k_empty_zset;
 
-static ZSet* expect_zset(std::string &s) {
+// the zset of the key or an empty one, NULL on a type error,
+// `*owner` is set to its entry if it exists and is wanted, for writing
+static ZSet* expect_zset(std::string &s, Entry** owner) {
+    if (owner) {
+        *owner = NULL;
+    }
     LookupKey key;
     key.key.swap(s);
     key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode* hnode = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
     if (!hnode) {   // a non-existent key is treated as an empty zset
         return (ZSet*)&k_empty_zset;
     }
     Entry* ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    if (ent->type != T_ZSET) {
+        return NULL;
+    }
+    // expired members are not seen, unless there are too many to purge now
+    bool gone = false;
+    zset_purge(ent, get_monotonic_msec(), k_max_works, gone);
+    if (gone) {
+        return (ZSet*)&k_empty_zset;
+    }
+    if (owner) {
+        *owner = ent;
+    }
+    return ent->zset;
 }
 
 // zrem zset name
 static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet* zset = expect_zset(cmd[1]);
+    Entry* ent = NULL;
+    ZSet* zset = expect_zset(cmd[1], &ent);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
@@ -532,6 +1055,7 @@ static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
     const std::string &name = cmd[2];
     ZNode* znode = zset_lookup(zset, name.data(), name.size());
     if (znode) {
+        entry_before_write(ent);
         zset_delete(zset, znode);
     }
     return out_int(out, znode ? 1 : 0);
@@ -539,21 +1063,95 @@ static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
 
 // zscore zset nam
 static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet* zset = expect_zset(cmd[1]);
+    ZSet* zset = expect_zset(cmd[1], NULL);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
 
     const std::string &name = cmd[2];
     ZNode* znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    return znode ? out_score(out, zset, znode) : out_nil(out);
+}
+
+// look up the names of `cmd zset name...` in a batch
+static ZSet* expect_members(std::vector<std::string> &cmd, Buffer &out,
+    std::vector<ZNode*> &found)
+{
+    ZSet* zset = expect_zset(cmd[1], NULL);
+    if (!zset) {
+        out_err(out, ERR_BAD_TYP, "expect zset");
+        return NULL;
+    }
+    size_t n = cmd.size() - 2;
+    std::vector<const char*> names(n);
+    std::vector<size_t> lens(n);
+    for (size_t i = 0; i < n; i++) {
+        names[i] = cmd[i + 2].data();
+        lens[i] = cmd[i + 2].size();
+    }
+    found.resize(n);
+    zset_lookup_many(zset, n, names.data(), lens.data(), found.data());
+    return zset;
+}
+
+// zmscore zset name...
+static void do_zmscore(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<ZNode*> found;
+    ZSet* zset = expect_members(cmd, out, found);
+    if (!zset) {
+        return;
+    }
+    out_arr(out, (uint32_t)found.size());
+    for (ZNode* znode : found) {
+        znode ? out_score(out, zset, znode) : out_nil(out);
+    }
+}
+
+// zmrank zset name...
+static void do_zmrank(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<ZNode*> found;
+    if (!expect_members(cmd, out, found)) {
+        return;
+    }
+    out_arr(out, (uint32_t)found.size());
+    for (ZNode* znode : found) {
+        znode ? out_int(out, avl_rank(&znode->tree)) : out_nil(out);
+    }
+}
+
+// a score argument, the int value is exact for a zset of int scores
+struct ScoreArg {
+    double dbl = 0;
+    bool is_int = false;
+    int64_t i64 = 0;
+};
+
+static bool str2score(const std::string &s, ScoreArg &out) {
+    out.is_int = str2int(s, out.i64);
+    return str2dbl(s, out.dbl);
+}
+
+// the first (score, name) tuple that is >= the key
+static ZNode* zset_seekge_arg(ZSet* zset, const ScoreArg &score, const char* name, size_t len) {
+    if (zset->int_scores && score.is_int) {
+        return zset_seekge_int(zset, score.i64, name, len);
+    }
+    return zset_seekge(zset, score.dbl, name, len);
+}
+
+// the first tuple with a score > the argument
+static ZNode* zset_seekgt_arg(ZSet* zset, const ScoreArg &score) {
+    if (zset->int_scores && score.is_int) {
+        return score.i64 < INT64_MAX ? zset_seekge_int(zset, score.i64 + 1, "", 0) : NULL;
+    }
+    return score.dbl < INFINITY ? zset_seekge(zset, nextafter(score.dbl, INFINITY), "", 0) : NULL;
 }
 
 // zquery zset score name offset limit
 static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
+    ScoreArg score;
+    if (!str2score(cmd[2], score)) {
         return out_err(out, ERR_BAD_ARG, "expect fp number");
     }
     const std::string &name = cmd[3];
@@ -563,7 +1161,7 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     }
 
     // get the zset
-    ZSet* zset = expect_zset(cmd[1]);
+    ZSet* zset = expect_zset(cmd[1], NULL);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
@@ -572,7 +1170,7 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     if (limit <= 0) {
         return out_arr(out, 0);
     }
-    ZNode* znode = zset_seekge(zset, score, name.data(), name.size());
+    ZNode* znode = zset_seekge_arg(zset, score, name.data(), name.size());
     znode = znode_offset(znode, offset);
 
     //output
@@ -580,70 +1178,2900 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     int64_t n = 0;
     while (znode && n < limit) {
         out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
+        out_score(out, zset, znode);
         znode = znode_offset(znode, +1);
         n += 2;
     }
     out_end_arr(out, ctx, (uint32_t)n);
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    }  else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
+const size_t k_large_container_size = 1000;
+
+static void cb_tree_dispose(void* arg) {
+    zset_dispose_tree((AVLNode*)arg);
+}
+
+// remove the members of rank [begin, end), big ranges are freed by the thread pool
+static void zset_remove_range(Entry* ent, ZSet* zset, int64_t begin, int64_t end, Buffer &out) {
+    if (begin >= end) {
+        return out_int(out, 0);
+    }
+    entry_before_write(ent);
+    AVLNode* tree = zset_detach_range(zset, (uint32_t)begin, (uint32_t)end);
+    if (end - begin > (int64_t)k_large_container_size) {
+        thread_pool_queue(&g_data.thread_pool, &cb_tree_dispose, tree);
     } else {
-        return out_err(out, ERR_UNKNOWN, "unknown command.");
+        zset_dispose_tree(tree);
     }
+    return out_int(out, end - begin);
 }
 
-static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();   // message header position
-    buf_append_u32(out, 0); // reserve 4 bytes for the message length
+// the ranks of scores in [min, max] as [begin, end)
+static void zset_score_range(ZSet* zset, const ScoreArg &min, const ScoreArg &max,
+    int64_t &begin, int64_t &end)
+{
+    // [the first >= min, the first > max)
+    int64_t size = avl_cnt(zset->root);
+    ZNode* lo = zset_seekge_arg(zset, min, "", 0);
+    ZNode* hi = zset_seekgt_arg(zset, max);
+    begin = lo ? avl_rank(&lo->tree) : size;
+    end = hi ? avl_rank(&hi->tree) : size;
+    end = end < begin ? begin : end;
 }
 
-static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+// parse `cmd zset min max`, `*owner` is as in `expect_zset()`
+static ZSet* expect_score_range(std::vector<std::string> &cmd, Buffer &out,
+    int64_t &begin, int64_t &end, Entry** owner)
+{
+    ScoreArg min, max;
+    if (!str2score(cmd[2], min) || !str2score(cmd[3], max)) {
+        out_err(out, ERR_BAD_ARG, "expect fp number");
+        return NULL;
+    }
+    ZSet* zset = expect_zset(cmd[1], owner);
+    if (!zset) {
+        out_err(out, ERR_BAD_TYP, "expect zset");
+        return NULL;
+    }
+    zset_score_range(zset, min, max, begin, end);
+    return zset;
 }
 
-static void response_end(Buffer &out, size_t header) {
-    size_t msg_size = response_size(out, header);
-    if (msg_size > k_max_msg) {
-        out.resize(header + 4);
-        out_err(out, ERR_TOO_BIG, "response too big.");
-        msg_size = response_size(out, header);
+// zremrangebyscore zset min max
+static void do_zremrangebyscore(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    Entry* ent = NULL;
+    ZSet* zset = expect_score_range(cmd, out, begin, end, &ent);
+    if (!zset) {
+        return;
     }
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
+    return zset_remove_range(ent, zset, begin, end, out);
 }
 
-// process 1 request if there is enough data
-static bool try_one_request(Conn* conn) {
-    // try to parse the protocol: message header
-    if (conn->incoming.size() < 4) {
-        return false; // not enough data, want more read
+// zcount zset min max
+static void do_zcount(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    if (!expect_score_range(cmd, out, begin, end, NULL)) {
+        return;
     }
+    return out_int(out, end - begin);
+}
 
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
-    if (len > k_max_msg) {
+// zsumrange zset min max : the sum of scores in O(log N), an int for int scores
+static void do_zsumrange(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    ZSet* zset = expect_score_range(cmd, out, begin, end, NULL);
+    if (!zset) {
+        return;
+    }
+    if (zset->int_scores) {
+        return out_int(out, zset_isum_range(zset, (uint32_t)begin, (uint32_t)end));
+    }
+    return out_dbl(out, zset_sum_range(zset, (uint32_t)begin, (uint32_t)end));
+}
+
+// zavgrange zset min max : the mean of scores, nil if empty
+static void do_zavgrange(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    ZSet* zset = expect_score_range(cmd, out, begin, end, NULL);
+    if (!zset) {
+        return;
+    }
+    if (begin == end) {
+        return out_nil(out);
+    }
+    double sum = zset->int_scores
+        ? (double)zset_isum_range(zset, (uint32_t)begin, (uint32_t)end)
+        : zset_sum_range(zset, (uint32_t)begin, (uint32_t)end);
+    return out_dbl(out, sum / (double)(end - begin));
+}
+
+// the rank of a lex bound: `-`, `+`, `[name` or `(name`, within the score of
+// the `band` node, the exclusive bounds use the successor `name\0`
+static bool zset_lex_rank(ZSet* zset, ZNode* band, const std::string &bound,
+    bool is_max, int64_t &rank)
+{
+    int64_t size = avl_cnt(zset->root);
+    ZNode* znode = NULL;
+    if (bound == "-") {
+        znode = band;
+    } else if (bound == "+") {
+        znode = band ? zset_seekge_like(zset, band, NULL, 0) : NULL;
+    } else if (bound.empty() || (bound[0] != '[' && bound[0] != '(')) {
+        return false;
+    } else if (!band) {
+        znode = NULL;
+    } else if ((bound[0] == '[') == is_max) {
+        std::string next = bound.substr(1) + '\0';
+        znode = zset_seekge_like(zset, band, next.data(), next.size());
+    } else {
+        znode = zset_seekge_like(zset, band, bound.data() + 1, bound.size() - 1);
+    }
+    rank = znode ? avl_rank(&znode->tree) : size;
+    return true;
+}
+
+// parse `cmd zset min max`, the members are expected to share a score as
+// the tree is only lex-ordered within a score, the lowest score is used,
+// `*owner` is as in `expect_zset()`
+static ZSet* expect_lex_range(std::vector<std::string> &cmd, Buffer &out,
+    int64_t &begin, int64_t &end, Entry** owner)
+{
+    ZSet* zset = expect_zset(cmd[1], owner);
+    if (!zset) {
+        out_err(out, ERR_BAD_TYP, "expect zset");
+        return NULL;
+    }
+    if (!zset_lex_rank(zset, zset->min, cmd[2], false, begin)
+        || !zset_lex_rank(zset, zset->min, cmd[3], true, end))
+    {
+        out_err(out, ERR_BAD_ARG, "expect `-`, `+`, `[name` or `(name`");
+        return NULL;
+    }
+    end = end < begin ? begin : end;
+    return zset;
+}
+
+// zrangebylex zset min max [limit offset count]
+static void do_zrangebylex(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t offset = 0, count = -1;
+    if (cmd.size() == 7) {
+        if (cmd[4] != "limit" || !str2int(cmd[5], offset) || !str2int(cmd[6], count)) {
+            return out_err(out, ERR_BAD_ARG, "expect `limit offset count`");
+        }
+    }
+    int64_t begin = 0, end = 0;
+    ZSet* zset = expect_lex_range(cmd, out, begin, end, NULL);
+    if (!zset) {
+        return;
+    }
+    if (offset < 0 || offset >= end - begin || count == 0) {
+        return out_arr(out, 0);
+    }
+    begin += offset;
+    if (count > 0 && count < end - begin) {
+        end = begin + count;
+    }
+
+    out_arr(out, (uint32_t)(end - begin));
+    ZNode* znode = zset_at(zset, (uint32_t)begin);
+    for (int64_t i = begin; i < end; i++) {
+        out_str(out, znode->name, znode->len);
+        znode = znode_offset(znode, +1);
+    }
+}
+
+// zlexcount zset min max : by the ranks in O(log N)
+static void do_zlexcount(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    if (!expect_lex_range(cmd, out, begin, end, NULL)) {
+        return;
+    }
+    return out_int(out, end - begin);
+}
+
+// zremrangebylex zset min max
+static void do_zremrangebylex(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t begin = 0, end = 0;
+    Entry* ent = NULL;
+    ZSet* zset = expect_lex_range(cmd, out, begin, end, &ent);
+    if (!zset) {
+        return;
+    }
+    return zset_remove_range(ent, zset, begin, end, out);
+}
+
+// zremrangebyrank zset start stop, inclusive, negative ranks count from the end
+static void do_zremrangebyrank(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    Entry* ent = NULL;
+    ZSet* zset = expect_zset(cmd[1], &ent);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t size = avl_cnt(zset->root);
+    if (start < 0) {
+        start += size;
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    start = start < 0 ? 0 : start;
+    stop = stop >= size ? size - 1 : stop;
+    return zset_remove_range(ent, zset, start, stop + 1, out);
+}
+
+// zquantile zset q : the member at the q-quantile by the nearest rank
+static void do_zquantile(std::vector<std::string> &cmd, Buffer &out) {
+    double q = 0;
+    if (!str2dbl(cmd[2], q) || q < 0 || q > 1) {
+        return out_err(out, ERR_BAD_ARG, "expect a number in [0, 1]");
+    }
+    ZSet* zset = expect_zset(cmd[1], NULL);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint32_t size = avl_cnt(zset->root);
+    if (size == 0) {
+        return out_nil(out);
+    }
+    double rank = ceil(q * size) - 1;
+    ZNode* znode = zset_at(zset, rank < 0 ? 0 : (uint32_t)rank);
+    out_arr(out, 2);
+    out_str(out, znode->name, znode->len);
+    out_score(out, zset, znode);
+}
+
+// xorshift64*, not for security
+static uint64_t rand_u64() {
+    static uint64_t state = 0;
+    if (state == 0) {
+        state = get_monotonic_usec() | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
+// zrandmember zset [count] : sampled by rank, so each member is equally likely;
+// a positive count returns distinct members, a negative count allows repeats
+static void do_zrandmember(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t count = 0;
+    if (cmd.size() == 3 && !str2int(cmd[2], count)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet* zset = expect_zset(cmd[1], NULL);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint64_t size = avl_cnt(zset->root);
+    if (cmd.size() == 2) {
+        if (size == 0) {
+            return out_nil(out);
+        }
+        ZNode* znode = zset_at(zset, (uint32_t)(rand_u64() % size));
+        return out_str(out, znode->name, znode->len);
+    }
+
+    std::vector<uint32_t> ranks;
+    if (count < 0) {
+        for (int64_t i = 0; size > 0 && i < -count && i < (int64_t)k_max_args; i++) {
+            ranks.push_back((uint32_t)(rand_u64() % size));
+        }
+    } else if ((uint64_t)count >= size) {
+        for (uint64_t i = 0; i < size; i++) {
+            ranks.push_back((uint32_t)i);
+        }
+    } else {
+        // Floyd's algorithm for distinct samples
+        std::set<uint32_t> picked;
+        for (uint64_t j = size - (uint64_t)count; j < size; j++) {
+            uint32_t r = (uint32_t)(rand_u64() % (j + 1));
+            picked.insert(picked.count(r) ? (uint32_t)j : r);
+        }
+        ranks.assign(picked.begin(), picked.end());
+    }
+    out_arr(out, (uint32_t)ranks.size());
+    for (uint32_t rank : ranks) {
+        ZNode* znode = zset_at(zset, rank);
+        out_str(out, znode->name, znode->len);
+    }
+}
+
+// remove the min or max member and output | name | score |
+static void zset_pop(ZSet* zset, bool max, Buffer &out) {
+    ZNode* znode = max ? zset->max : zset->min;
+    out_str(out, znode->name, znode->len);
+    out_score(out, zset, znode);
+    zset_delete(zset, znode);
+}
+
+// zpopmin zset [count], zpopmax zset [count]
+static void do_zpop(std::vector<std::string> &cmd, Buffer &out, bool max) {
+    int64_t count = 1;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+        return out_err(out, ERR_BAD_ARG, "expect a non-negative int");
+    }
+    Entry* ent = NULL;
+    ZSet* zset = expect_zset(cmd[1], &ent);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t size = avl_cnt(zset->root);
+    count = count < size ? count : size;
+    if (count > 0) {
+        entry_before_write(ent);
+    }
+    out_arr(out, (uint32_t)(count * 2));
+    for (int64_t i = 0; i < count; i++) {
+        zset_pop(zset, max, out);
+    }
+}
+
+// a key waited on by BZPOPMIN/BZPOPMAX
+struct BlockKey {
+    HNode node;
+    uint32_t db = 0;
+    std::string key;
+    DList waiters;      // `Conn::block_node`, first come first served
+};
+
+static bool block_key_eq(HNode* node, HNode* key) {
+    BlockKey* bk = container_of(node, BlockKey, node);
+    BlockKey* lkey = container_of(key, BlockKey, node);
+    return bk->db == lkey->db && bk->key == lkey->key;
+}
+
+// the key in the current database
+static BlockKey* block_key_get(const std::string &key, bool create) {
+    BlockKey lkey;
+    lkey.db = g_data.db->id;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size()) + lkey.db;
+    HNode* node = hm_lookup(&g_data.block_keys, &lkey.node, &block_key_eq);
+    if (node || !create) {
+        return node ? container_of(node, BlockKey, node) : NULL;
+    }
+    BlockKey* bk = new BlockKey();
+    bk->db = lkey.db;
+    bk->key = key;
+    bk->node.hcode = lkey.node.hcode;
+    dlist_init(&bk->waiters);
+    hm_insert(&g_data.block_keys, &bk->node);
+    return bk;
+}
+
+static void block_key_release(BlockKey* bk) {
+    if (dlist_empty(&bk->waiters)) {
+        hm_delete(&g_data.block_keys, &bk->node, &hnode_same);
+        delete bk;
+    }
+}
+
+// no longer waiting, the BlockKey is released by the caller
+static void bzpop_unregister(Conn* conn) {
+    dlist_detach(&conn->block_node);
+    conn->block_key = NULL;
+    if (conn->block_heap_idx != (size_t)-1) {
+        heap_delete(g_data.block_heap, conn->block_heap_idx);
+        conn->block_heap_idx = -1;
+    }
+}
+
+static void response_begin(Buffer &out, size_t *header);
+static void response_end(Buffer &out, size_t header);
+
+// reply | key | name | score | to the client, it's unblocked later by `process_woken()`
+static void bzpop_reply(Conn* conn, Entry* ent) {
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    out_arr(conn->outgoing, 3);
+    out_str(conn->outgoing, ent->key.data(), ent->key.size());
+    zset_pop(ent->zset, conn->block_max, conn->outgoing);
+    response_end(conn->outgoing, header_pos);
+    conn->woken = true;
+    g_data.woken.push_back(conn);
+}
+
+// the zset got new members
+static void zset_wakeup(Entry* ent) {
+    BlockKey* bk = block_key_get(ent->key, false);
+    if (!bk) {
+        return;
+    }
+    while (!dlist_empty(&bk->waiters) && ent->zset->root) {
+        Conn* conn = container_of(bk->waiters.next, Conn, block_node);
+        bzpop_unregister(conn);
+        entry_before_write(ent);
+        bzpop_reply(conn, ent);
+    }
+    block_key_release(bk);
+}
+
+// bzpopmin zset timeout, bzpopmax zset timeout : wait for a member if empty,
+// the timeout is in seconds, 0 means forever
+static void do_bzpop(Conn* conn, std::vector<std::string> &cmd, Buffer &out, bool max) {
+    double timeout = 0;
+    if (!str2dbl(cmd[2], timeout) || timeout < 0) {
+        return out_err(out, ERR_BAD_ARG, "expect a non-negative timeout");
+    }
+    std::string key = cmd[1];   // `expect_zset()` takes the string
+    Entry* ent = NULL;
+    ZSet* zset = expect_zset(cmd[1], &ent);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    if (zset->root) {
+        entry_before_write(ent);
+        out_arr(out, 3);
+        out_str(out, key.data(), key.size());
+        return zset_pop(zset, max, out);
+    }
+
+    // the response is generated by `zset_wakeup()` or the timer
+    BlockKey* bk = block_key_get(key, true);
+    dlist_insert_before(&bk->waiters, &conn->block_node);
+    conn->block_key = bk;
+    conn->block_max = max;
+    if (timeout > 0) {
+        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ceil(timeout * 1000);
+        HeapItem item = {expire_at, &conn->block_heap_idx};
+        heap_upsert(g_data.block_heap, conn->block_heap_idx, item);
+    }
+    conn_block(conn);
+}
+
+static void async_run(void (*work)(void*), void (*done)(void*), void* arg);
+
+// the HNSW graph is built in the thread pool while the set is being used
+static void vset_build_work(void* arg) {
+    vset_build_run((VBuild*)arg);
+}
+
+static void vset_build_start(VSet* vset);
+
+static void vset_build_done(void* arg) {
+    if (VSet* vset = vset_build_finish((VBuild*)arg)) {
+        vset_build_start(vset);  // more slots may have been added
+    }
+}
+
+static void vset_build_start(VSet* vset) {
+    if (VBuild* build = vset_build_begin(vset)) {
+        async_run(&vset_build_work, &vset_build_done, build);
+    }
+}
+
+static bool str2vec(std::vector<std::string> &cmd, size_t begin, size_t end,
+    std::vector<float> &vec)
+{
+    vec.resize(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        double val = 0;
+        if (!str2dbl(cmd[i], val) || isinf(val)) {
+            return false;
+        }
+        vec[i - begin] = (float)val;
+    }
+    return true;
+}
+
+// `*ent` is NULL if the key doesn't exist, returns false on a type error
+static bool expect_vset(std::string &key, Entry** ent) {
+    LookupKey lkey;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size());
+    HNode* hnode = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    return !*ent || (*ent)->type == T_VSET;
+}
+
+// vadd vset id [l2 | cos | dot] [q8] float...
+// the metric and the quantization are set when the set is created,
+// the number of floats is the dimension
+static void do_vadd(std::vector<std::string> &cmd, Buffer &out) {
+    uint32_t metric = VM_COS;
+    bool q8 = false;
+    size_t i = 3;
+    for (; i < cmd.size(); i++) {
+        if (cmd[i] == "l2" || cmd[i] == "cos" || cmd[i] == "dot") {
+            metric = cmd[i] == "l2" ? VM_L2 : (cmd[i] == "cos" ? VM_COS : VM_DOT);
+        } else if (cmd[i] == "q8") {
+            q8 = true;
+        } else {
+            break;
+        }
+    }
+    std::vector<float> vec;
+    if (i == cmd.size() || !str2vec(cmd, i, cmd.size(), vec)) {
+        return out_err(out, ERR_BAD_ARG, "expect floats");
+    }
+
+    Entry* ent = NULL;
+    if (!expect_vset(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect vset");
+    }
+    if (ent && ent->vset->store.dim != vec.size()) {
+        return out_err(out, ERR_BAD_ARG, "dimension mismatch");
+    }
+    if (ent && ent->vset->nslots == UINT32_MAX) {
+        // until a compaction frees the deleted slots
+        return out_err(out, ERR_TOO_BIG, "too many slots");
+    }
+    if (ent) {
+        entry_before_write(ent);
+    } else {
+        ent = entry_new(T_VSET);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+        ent->vset = vset_new((uint32_t)vec.size(), metric, q8);
+        entry_insert(ent);
+    }
+    const std::string &id = cmd[2];
+    bool added = vset_add(ent->vset, id.data(), id.size(), vec.data());
+    vset_build_start(ent->vset);
+    return out_int(out, (int64_t)added);
+}
+
+// vrem vset id
+static void do_vrem(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_vset(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect vset");
+    }
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    entry_before_write(ent);
+    const std::string &id = cmd[2];
+    bool removed = vset_remove(ent->vset, id.data(), id.size());
+    vset_build_start(ent->vset);    // maybe compact
+    return out_int(out, removed ? 1 : 0);
+}
+
+// vcard vset
+static void do_vcard(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_vset(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect vset");
+    }
+    return out_int(out, ent ? (int64_t)vset_size(ent->vset) : 0);
+}
+
+const size_t k_vsim_default_ef = 64;
+
+// vsim vset k float... [ef n] : the k nearest ids and their distances
+static void do_vsim(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t k = 0;
+    if (!str2int(cmd[2], k) || k <= 0) {
+        return out_err(out, ERR_BAD_ARG, "expect a positive k");
+    }
+    size_t end = cmd.size();
+    int64_t ef = k_vsim_default_ef;
+    if (end >= 5 && cmd[end - 2] == "ef") {
+        if (!str2int(cmd[end - 1], ef) || ef <= 0) {
+            return out_err(out, ERR_BAD_ARG, "expect a positive ef");
+        }
+        end -= 2;
+    }
+    std::vector<float> vec;
+    if (end == 3 || !str2vec(cmd, 3, end, vec)) {
+        return out_err(out, ERR_BAD_ARG, "expect floats");
+    }
+    Entry* ent = NULL;
+    if (!expect_vset(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect vset");
+    }
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    VSet* vset = ent->vset;
+    if (vset->store.dim != vec.size()) {
+        return out_err(out, ERR_BAD_ARG, "dimension mismatch");
+    }
+    std::vector<VResult> found;
+    vset_search(vset, vec.data(), (size_t)k, (size_t)ef, found);
+    out_arr(out, (uint32_t)found.size() * 2);
+    for (const VResult &r : found) {
+        const std::string &id = vset->slots[r.slot]->id;
+        out_str(out, id.data(), id.size());
+        out_dbl(out, r.dist);
+    }
+}
+
+// a field of a hash
+struct HField {
+    HNode node;
+    std::string field;
+    std::string val;
+};
+
+struct HKey {
+    HNode node;
+    const std::string* field = NULL;
+};
+
+static bool hfield_eq(HNode* node, HNode* key) {
+    return container_of(node, HField, node)->field == *container_of(key, HKey, node)->field;
+}
+
+static HField* hash_lookup(HMap* hash, const std::string &field) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t*)field.data(), field.size());
+    key.field = &field;
+    HNode* node = hm_lookup(hash, &key.node, &hfield_eq);
+    return node ? container_of(node, HField, node) : NULL;
+}
+
+// for `ft_doc_update()`
+static const std::string* hash_get_field(void* hash, const std::string &field) {
+    HField* hf = hash_lookup((HMap*)hash, field);
+    return hf ? &hf->val : NULL;
+}
+
+static bool key_has_prefix(const std::string &key, const std::string &prefix) {
+    return key.size() >= prefix.size() && 0 == memcmp(key.data(), prefix.data(), prefix.size());
+}
+
+// update the indexes covering the key after the hash is written
+static void hash_reindex(Entry* ent) {
+    for (FTIndex* idx : g_data.db->indexes) {
+        if (key_has_prefix(ent->key, idx->prefix)) {
+            ft_doc_update(idx, ent->key, &hash_get_field, ent->hash);
+        }
+    }
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+    ((std::vector<HNode*>*)arg)->push_back(node);
+    return true;
+}
+
+// remove the key from the indexes covering it
+static void hash_unindex(Entry* ent) {
+    for (FTIndex* idx : g_data.db->indexes) {
+        if (key_has_prefix(ent->key, idx->prefix)) {
+            ft_doc_remove(idx, ent->key);
+        }
+    }
+}
+
+static void hash_free(HMap* hash) {
+    // `hm_foreach()` can't free the nodes it visits
+    std::vector<HNode*> nodes;
+    hm_foreach(hash, &cb_collect, &nodes);
+    hm_clear(hash);
+    for (HNode* node : nodes) {
+        delete container_of(node, HField, node);
+    }
+    delete hash;
+}
+
+static void hash_del(Entry* ent) {
+    hash_unindex(ent);
+    hash_free(ent->hash);
+    ent->hash = NULL;
+}
+
+// `*ent` is NULL if the key doesn't exist, returns false on a type error
+static bool expect_hash(std::string &key, Entry** ent) {
+    LookupKey lkey;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size());
+    HNode* hnode = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    return !*ent || (*ent)->type == T_HASH;
+}
+
+// hset hash field value [field value...] : the number of new fields
+static void do_hset(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect field value pairs");
+    }
+    Entry* ent = NULL;
+    if (!expect_hash(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    if (ent) {
+        entry_before_write(ent);
+    } else {
+        ent = entry_new(T_HASH);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+        entry_insert(ent);
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        HField* hf = hash_lookup(ent->hash, cmd[i]);
+        if (!hf) {
+            hf = new HField();
+            hf->field.swap(cmd[i]);
+            hf->node.hcode = str_hash((uint8_t*)hf->field.data(), hf->field.size());
+            hm_insert(ent->hash, &hf->node);
+            added++;
+        }
+        hf->val.swap(cmd[i + 1]);
+    }
+    hash_reindex(ent);
+    return out_int(out, added);
+}
+
+// hget hash field
+static void do_hget(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_hash(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    HField* hf = ent ? hash_lookup(ent->hash, cmd[2]) : NULL;
+    return hf ? out_str(out, hf->val.data(), hf->val.size()) : out_nil(out);
+}
+
+// hdel hash field
+static void do_hdel(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_hash(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    HKey key;
+    key.node.hcode = str_hash((uint8_t*)cmd[2].data(), cmd[2].size());
+    key.field = &cmd[2];
+    entry_before_write(ent);
+    HNode* node = hm_delete(ent->hash, &key.node, &hfield_eq);
+    if (node) {
+        delete container_of(node, HField, node);
+        hash_reindex(ent);
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+static bool cb_hgetall(HNode* node, void* arg) {
+    HField* hf = container_of(node, HField, node);
+    Buffer &out = *(Buffer*)arg;
+    out_str(out, hf->field.data(), hf->field.size());
+    out_str(out, hf->val.data(), hf->val.size());
+    return true;
+}
+
+// hgetall hash : field value pairs
+static void do_hgetall(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_hash(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t)hm_size(ent->hash) * 2);
+    hm_foreach(ent->hash, &cb_hgetall, &out);
+}
+
+// hlen hash
+static void do_hlen(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_hash(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    return out_int(out, ent ? (int64_t)hm_size(ent->hash) : 0);
+}
+
+static FTIndex* index_get(const std::string &name) {
+    for (FTIndex* idx : g_data.db->indexes) {
+        if (idx->name == name) {
+            return idx;
+        }
+    }
+    return NULL;
+}
+
+struct IndexScan {
+    FTIndex* idx = NULL;
+    std::vector<Entry*> ents;
+};
+
+static bool cb_index_scan(HNode* node, void* arg) {
+    Entry* ent = container_of(node, Entry, node);
+    IndexScan* scan = (IndexScan*)arg;
+    if (ent->type == T_HASH && key_has_prefix(ent->key, scan->idx->prefix)) {
+        scan->ents.push_back(ent);
+    }
+    return true;
+}
+
+// index the existing hashes under the prefix and add the index
+static void index_build(FTIndex* idx) {
+    // in key order, so that the docids follow it
+    IndexScan scan;
+    scan.idx = idx;
+    hm_foreach(&g_data.db->keys, &cb_index_scan, &scan);
+    std::sort(scan.ents.begin(), scan.ents.end(),
+        [](Entry* a, Entry* b) { return a->key < b->key; });
+    for (Entry* ent : scan.ents) {
+        ft_doc_update(idx, ent->key, &hash_get_field, ent->hash);
+    }
+    g_data.db->indexes.push_back(idx);
+}
+
+// ft.create index prefix field numeric|tag [field numeric|tag...]
+// the existing hashes under the prefix are indexed now, the rest on writes
+static void do_ft_create(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 1) {
+        return out_err(out, ERR_BAD_ARG, "expect field type pairs");
+    }
+    if (index_get(cmd[1])) {
+        return out_err(out, ERR_BAD_ARG, "the index exists");
+    }
+    FTIndex* idx = ft_new(cmd[1], cmd[2]);
+    for (size_t i = 3; i < cmd.size(); i += 2) {
+        bool num = cmd[i + 1] == "numeric";
+        if (!num && cmd[i + 1] != "tag") {
+            ft_del(idx);
+            return out_err(out, ERR_BAD_ARG, "expect `numeric` or `tag`");
+        }
+        ft_add_field(idx, cmd[i], num ? FT_NUMERIC : FT_TAG);
+    }
+    index_build(idx);
+    return out_nil(out);
+}
+
+// ft.dropindex index
+static void do_ft_dropindex(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<FTIndex*> &indexes = g_data.db->indexes;
+    for (size_t i = 0; i < indexes.size(); i++) {
+        if (indexes[i]->name == cmd[1]) {
+            ft_del(indexes[i]);
+            indexes.erase(indexes.begin() + i);
+            return out_int(out, 1);
+        }
+    }
+    return out_int(out, 0);
+}
+
+const int64_t k_ft_default_limit = 10;
+
+// ft.search index query [limit offset count] : the number of matches, then
+// the keys in the index order
+static void do_ft_search(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t offset = 0;
+    int64_t limit = k_ft_default_limit;
+    if (cmd.size() == 6 && (cmd[3] != "limit" || !str2int(cmd[4], offset)
+        || !str2int(cmd[5], limit) || offset < 0 || limit < 0))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect `limit offset count`");
+    }
+    FTIndex* idx = index_get(cmd[1]);
+    if (!idx) {
+        return out_err(out, ERR_BAD_ARG, "no such index");
+    }
+    std::vector<uint32_t> docids;
+    std::string err;
+    if (!ft_search(idx, cmd[2], docids, err)) {
+        return out_err(out, ERR_BAD_ARG, err);
+    }
+    size_t begin = std::min((size_t)offset, docids.size());
+    size_t end = begin + std::min((size_t)limit, docids.size() - begin);
+    out_arr(out, (uint32_t)(1 + end - begin));
+    out_int(out, (int64_t)docids.size());
+    for (size_t i = begin; i < end; i++) {
+        const std::string &key = idx->by_docid[docids[i]]->key;
+        out_str(out, key.data(), key.size());
+    }
+}
+
+// look up the JSON document and the path, `*ent` is NULL if the key
+// doesn't exist, returns false with a reply on error
+static bool expect_json(std::vector<std::string> &cmd, Entry** ent,
+    std::vector<JStep> &path, Buffer &out)
+{
+    LookupKey lkey;
+    lkey.key = cmd[1];
+    lkey.node.hcode = str_hash((uint8_t*)lkey.key.data(), lkey.key.size());
+    HNode* hnode = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    if (*ent && (*ent)->type != T_JSON) {
+        out_err(out, ERR_BAD_TYP, "expect json");
+        return false;
+    }
+    if (cmd.size() > 2 && !json_path(cmd[2], path)) {
+        out_err(out, ERR_BAD_ARG, "bad path");
+        return false;
+    }
+    return true;
+}
+
+// json.set key path value : 0 if the parent of the path doesn't exist,
+// a new key must be set at the root `$`
+static void do_json_set(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    std::vector<JStep> path;
+    if (!expect_json(cmd, &ent, path, out)) {
+        return;
+    }
+    JNode* val = json_parse(cmd[3].data(), cmd[3].size());
+    if (!val) {
+        return out_err(out, ERR_BAD_ARG, "bad json");
+    }
+    // the document must parse again, for DUMP, COPY and snapshots
+    if (path.size() + json_depth(val) > k_json_max_depth) {
+        json_free(val);
+        return out_err(out, ERR_BAD_ARG, "json too deep");
+    }
+    if (!ent && !path.empty()) {
+        json_free(val);
+        return out_int(out, 0);
+    }
+    if (ent) {
+        entry_before_write(ent);
+    } else {
+        ent = entry_new(T_JSON);
+        ent->key.swap(cmd[1]);
+        ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+        entry_insert(ent);
+    }
+    if (!json_set(ent->json, path, val)) {
+        json_free(val);
+        return out_int(out, 0);
+    }
+    return out_int(out, 1);
+}
+
+// json.get key [path] : the serialized value
+static void do_json_get(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    std::vector<JStep> path;
+    if (!expect_json(cmd, &ent, path, out)) {
+        return;
+    }
+    JNode* node = ent ? json_get(ent->json, path.data(), path.size()) : NULL;
+    if (!node) {
+        return out_nil(out);
+    }
+    std::string text;
+    json_dump(node, text);
+    return out_str(out, text.data(), text.size());
+}
+
+// json.numincrby key path incr : the new number
+static void do_json_numincrby(std::vector<std::string> &cmd, Buffer &out) {
+    double incr = 0;
+    if (!str2dbl(cmd[3], incr) || isinf(incr)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    Entry* ent = NULL;
+    std::vector<JStep> path;
+    if (!expect_json(cmd, &ent, path, out)) {
+        return;
+    }
+    JNode* node = ent ? json_get(ent->json, path.data(), path.size()) : NULL;
+    if (!node) {
+        return out_nil(out);
+    }
+    if (node->type != J_NUM) {
+        return out_err(out, ERR_BAD_TYP, "not a number");
+    }
+    if (!isfinite(node->num + incr)) {
+        return out_err(out, ERR_BAD_ARG, "number overflow");
+    }
+    entry_before_write(ent);
+    json_set_num(node, node->num + incr);
+    return out_str(out, node->str.data(), node->str.size());
+}
+
+// json.arrappend key path value... : the new length of the array
+static void do_json_arrappend(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    std::vector<JStep> path;
+    if (!expect_json(cmd, &ent, path, out)) {
+        return;
+    }
+    JNode* node = ent ? json_get(ent->json, path.data(), path.size()) : NULL;
+    if (!node) {
+        return out_nil(out);
+    }
+    if (node->type != J_ARR) {
+        return out_err(out, ERR_BAD_TYP, "not an array");
+    }
+    // all or nothing
+    std::vector<JNode*> vals;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        JNode* val = json_parse(cmd[i].data(), cmd[i].size());
+        bool deep = val && path.size() + 1 + json_depth(val) > k_json_max_depth;
+        if (!val || deep) {
+            for (JNode* v : vals) {
+                json_free(v);
+            }
+            if (val) {
+                json_free(val);
+            }
+            return out_err(out, ERR_BAD_ARG, deep ? "json too deep" : "bad json");
+        }
+        vals.push_back(val);
+    }
+    entry_before_write(ent);
+    node->kids.insert(node->kids.end(), vals.begin(), vals.end());
+    return out_int(out, (int64_t)node->kids.size());
+}
+
+// throttle key max_burst count period [quantity]
+// GCRA: `count` per `period` seconds with bursts of up to `max_burst + 1`,
+// the state is the theoretical arrival time of the next request, and the
+// key expires when it's in the past, which is the same as a fresh key;
+// replies with (allowed, limit, remaining, retry after ms, reset after ms)
+static void do_throttle(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t max_burst = 0, count = 0, quantity = 1;
+    double period = 0;
+    if (!str2int(cmd[2], max_burst) || max_burst < 0 || max_burst >= INT32_MAX
+        || !str2int(cmd[3], count) || count <= 0
+        || !str2dbl(cmd[4], period) || !(period > 0 && period < 1e9)
+        || (cmd.size() == 6 && (!str2int(cmd[5], quantity) || quantity < 0)))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect `max_burst count period [quantity]`");
+    }
+    // the emission interval and the burst tolerance, in microseconds
+    double interval = period * 1e6 / (double)count;
+    double limit = (double)(max_burst + 1);
+    double tolerance = interval * limit;
+    uint64_t now = get_monotonic_usec();
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.db->keys, &key.node, &entry_eq);
+    Entry* ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_THROTTLE) {
+        return out_err(out, ERR_BAD_TYP, "expect throttle");
+    }
+
+    double tat = (double)(ent && ent->tat_us > now ? ent->tat_us : now);
+    double new_tat = tat + interval * (double)quantity;
+    double allow_at = new_tat - tolerance;
+    bool allowed = (double)now >= allow_at;
+    double retry_after = -1;
+    if (allowed) {
+        tat = new_tat;
+        if (!ent) {
+            ent = entry_new(T_THROTTLE);
+            ent->key.swap(key.key);
+            ent->node.hcode = key.node.hcode;
+            entry_insert(ent);
+        }
+        entry_before_write(ent);
+        ent->tat_us = (uint64_t)tat;
+        entry_set_ttl(ent, (int64_t)ceil((tat - (double)now) / 1000));
+    } else {
+        // when the request would conform, if the quantity can ever be allowed
+        retry_after = interval * (double)quantity > tolerance
+            ? -1 : ceil((allow_at - (double)now) / 1000);
+    }
+    double remaining = floor(((double)now - (tat - tolerance)) / interval);
+    out_arr(out, 5);
+    out_int(out, allowed ? 1 : 0);
+    out_int(out, (int64_t)limit);
+    out_int(out, (int64_t)std::max(0.0, remaining));
+    out_int(out, (int64_t)retry_after);
+    out_int(out, (int64_t)ceil((tat - (double)now) / 1000));
+}
+
+// look up a key of the type, `*ent` is NULL if the key doesn't exist,
+// returns false on a type error
+static bool expect_type(std::string &key, uint32_t type, Entry** ent) {
+    LookupKey lkey;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size());
+    HNode* hnode = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    return !*ent || (*ent)->type == type;
+}
+
+static Entry* entry_insert_new(std::string &key, uint32_t type) {
+    Entry* ent = entry_new(type);
+    ent->key.swap(key);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    entry_insert(ent);
+    return ent;
+}
+
+// the counters of a sketch
+const int64_t k_sketch_max_cells = 1 << 26;
+
+// cms.initbydim key width depth
+static void do_cms_init(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t width = 0, depth = 0;
+    if (!str2int(cmd[2], width) || !str2int(cmd[3], depth) || width <= 0 || depth <= 0
+        || width > k_sketch_max_cells || depth > k_sketch_max_cells
+        || width * depth > k_sketch_max_cells)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad dimensions");
+    }
+    Entry* ent = NULL;
+    expect_type(cmd[1], T_CMS, &ent);
+    if (ent) {
+        return out_err(out, ERR_BAD_ARG, "the key exists");
+    }
+    ent = entry_insert_new(cmd[1], T_CMS);
+    ent->cms = cms_new((uint32_t)width, (uint32_t)depth);
+    return out_nil(out);
+}
+
+static CMS* expect_cms(std::string &key, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_type(key, T_CMS, &ent)) {
+        out_err(out, ERR_BAD_TYP, "expect cms");
+        return NULL;
+    }
+    if (!ent) {
+        out_err(out, ERR_BAD_ARG, "no such key");
+        return NULL;
+    }
+    entry_before_write(ent);
+    return ent->cms;
+}
+
+// cms.incrby key item incr [item incr...] : the new counts
+static void do_cms_incrby(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect item incr pairs");
+    }
+    size_t n = (cmd.size() - 2) / 2;
+    std::vector<std::string> items(n);
+    std::vector<uint32_t> incrs(n);
+    for (size_t i = 0; i < n; i++) {
+        int64_t incr = 0;
+        if (!str2int(cmd[3 + 2 * i], incr) || incr < 0 || incr > UINT32_MAX) {
+            return out_err(out, ERR_BAD_ARG, "expect a non-negative int");
+        }
+        items[i].swap(cmd[2 + 2 * i]);
+        incrs[i] = (uint32_t)incr;
+    }
+    CMS* cms = expect_cms(cmd[1], out);
+    if (!cms) {
+        return;
+    }
+    std::vector<uint32_t> counts(n);
+    cms_incrby(cms, n, items.data(), incrs.data(), counts.data());
+    out_arr(out, (uint32_t)n);
+    for (uint32_t c : counts) {
+        out_int(out, c);
+    }
+}
+
+// cms.query key item...
+static void do_cms_query(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_type(cmd[1], T_CMS, &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect cms");
+    }
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "no such key");
+    }
+    size_t n = cmd.size() - 2;
+    std::vector<uint32_t> counts(n);
+    cms_query(ent->cms, n, &cmd[2], counts.data());
+    out_arr(out, (uint32_t)n);
+    for (uint32_t c : counts) {
+        out_int(out, c);
+    }
+}
+
+const uint32_t k_topk_default_depth = 4;
+const double k_topk_default_decay = 0.9;
+
+// topk.reserve key k [width depth decay]
+static void do_topk_reserve(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t k = 0;
+    if (!str2int(cmd[2], k) || k <= 0 || k > k_sketch_max_cells) {
+        return out_err(out, ERR_BAD_ARG, "expect a positive k");
+    }
+    int64_t width = std::max<int64_t>(8 * k, 64);
+    int64_t depth = k_topk_default_depth;
+    double decay = k_topk_default_decay;
+    if (cmd.size() == 6 && (!str2int(cmd[3], width) || !str2int(cmd[4], depth)
+        || !str2dbl(cmd[5], decay) || width <= 0 || depth <= 0 || !(decay > 0 && decay < 1)))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect `width depth decay`");
+    }
+    if (width > k_sketch_max_cells || depth > k_sketch_max_cells
+        || width * depth > k_sketch_max_cells)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad dimensions");
+    }
+    Entry* ent = NULL;
+    expect_type(cmd[1], T_TOPK, &ent);
+    if (ent) {
+        return out_err(out, ERR_BAD_ARG, "the key exists");
+    }
+    ent = entry_insert_new(cmd[1], T_TOPK);
+    ent->topk = topk_new((uint32_t)k, (uint32_t)width, (uint32_t)depth, decay);
+    return out_nil(out);
+}
+
+// topk.add key item... : the item pushed out of the top-k by each, or nil
+static void do_topk_add(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = NULL;
+    if (!expect_type(cmd[1], T_TOPK, &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect topk");
+    }
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "no such key");
+    }
+    entry_before_write(ent);
+    size_t n = cmd.size() - 2;
+    std::vector<std::string> expelled;
+    std::vector<bool> has_expelled;
+    topk_add(ent->topk, n, &cmd[2], expelled, has_expelled);
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        const std::string &item = expelled[i];
+        has_expelled[i] ? out_str(out, item.data(), item.size()) : out_nil(out);
+    }
+}
+
+// topk.list key [withcount] : the items by count, descending
+static void do_topk_list(std::vector<std::string> &cmd, Buffer &out) {
+    bool withcount = cmd.size() == 3;
+    if (withcount && cmd[2] != "withcount") {
+        return out_err(out, ERR_BAD_ARG, "expect `withcount`");
+    }
+    Entry* ent = NULL;
+    if (!expect_type(cmd[1], T_TOPK, &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect topk");
+    }
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "no such key");
+    }
+    std::vector<TopKItem*> items;
+    topk_list(ent->topk, items);
+    out_arr(out, (uint32_t)(items.size() * (withcount ? 2 : 1)));
+    for (TopKItem* item : items) {
+        out_str(out, item->item.data(), item->item.size());
+        if (withcount) {
+            out_int(out, item->count);
+        }
+    }
+}
+
+static bool read_u8(const uint8_t* &cur, const uint8_t* end, uint8_t &out) {
+    if (cur + 1 > end) {
+        return false;
+    }
+    out = *cur++;
+    return true;
+}
+
+static bool read_i64(const uint8_t* &cur, const uint8_t* end, int64_t &out) {
+    if (cur + 8 > end) {
+        return false;
+    }
+    memcpy(&out, cur, 8);
+    cur += 8;
+    return true;
+}
+
+static bool read_dbl(const uint8_t* &cur, const uint8_t* end, double &out) {
+    if (cur + 8 > end) {
+        return false;
+    }
+    memcpy(&out, cur, 8);
+    cur += 8;
+    return true;
+}
+
+static bool cb_encode_hfield(HNode* node, void* arg) {
+    HField* hf = container_of(node, HField, node);
+    Buffer &out = *(Buffer*)arg;
+    buf_append_u32(out, (uint32_t)hf->field.size());
+    buf_append(out, (const uint8_t*)hf->field.data(), hf->field.size());
+    buf_append_u32(out, (uint32_t)hf->val.size());
+    buf_append(out, (const uint8_t*)hf->val.data(), hf->val.size());
+    return true;
+}
+
+// the binary encoding of a key and its value
+// +-----+-----+--------+------+-------+
+// | len | key | ttl_ms | type | value |
+// +-----+-----+--------+------+-------+
+// string: | len | str |
+// zset:   | n | score | len | name | ... |
+// zset with member TTLs: | n | score | len | name | ttl_ms | ... |
+// zset of int scores: | n | int score | len | name | ttl_ms | ... |
+// vset:   | dim | metric | q8 | n | len | id | float[dim] | ... |
+// hash:   | n | len | field | len | value | ... |
+// json:   | len | text |
+// throttle: | the theoretical arrival time from now in us |
+// cms:    | width | depth | counters |
+// topk:   | k | width | depth | decay | buckets | n | len | item | count | ... |
+// false if the value can't be read from the file
+static bool entry_encode_value(Buffer &out, Entry* ent) {
+    bool int_scores = ent->type == T_ZSET && ent->zset->int_scores;
+    bool member_ttl = int_scores || (ent->type == T_ZSET && ent->zset->ttl);
+    uint8_t type = (uint8_t)ent->type;
+    if (int_scores) {
+        type = T_ZSET_INT;
+    } else if (member_ttl) {
+        type = T_ZSET_TTL;
+    }
+    buf_append_u8(out, type);
+    if (ent->type == T_STR) {
+        std::string spilled;
+        if (ent->spill && !spill_read(ent->spill, ent->spill_off, ent->spill_len, spilled)) {
+            msg_errno("spill_read() error");
+            return false;
+        }
+        const std::string &str = ent->spill ? spilled : ent->str;
+        buf_append_u32(out, (uint32_t)str.size());
+        buf_append(out, (const uint8_t*)str.data(), str.size());
+    } else if (ent->type == T_ZSET) {
+        buf_append_u32(out, avl_cnt(ent->zset->root));
+        for (ZNode* znode = ent->zset->min; znode; znode = znode_offset(znode, +1)) {
+            if (int_scores) {
+                buf_append_i64(out, znode_iscore(znode));
+            } else {
+                buf_append_dbl(out, znode->score);
+            }
+            buf_append_u32(out, (uint32_t)znode->len);
+            buf_append(out, (const uint8_t*)znode->name, znode->len);
+            if (member_ttl) {
+                int64_t expire_at = zset_get_expire(ent->zset, znode);
+                int64_t now_ms = (int64_t)get_monotonic_msec();
+                if (expire_at >= 0) {
+                    expire_at = expire_at > now_ms ? expire_at - now_ms : 0;
+                }
+                buf_append_i64(out, expire_at);     // the TTL or -1
+            }
+        }
+    } else if (ent->type == T_VSET) {
+        VSet* vset = ent->vset;
+        buf_append_u32(out, vset->store.dim);
+        buf_append_u8(out, (uint8_t)vset->store.metric);
+        buf_append_u8(out, vset->store.q8 ? 1 : 0);
+        buf_append_u32(out, (uint32_t)vset_size(vset));
+        std::vector<float> vec(vset->store.dim);
+        for (VNode* vnode : vset->slots) {
+            if (!vnode) {
+                continue;   // deleted or replaced
+            }
+            vset_get(vset, vnode->slot, vec.data());
+            buf_append_u32(out, (uint32_t)vnode->id.size());
+            buf_append(out, (const uint8_t*)vnode->id.data(), vnode->id.size());
+            buf_append(out, (const uint8_t*)vec.data(), vec.size() * sizeof(float));
+        }
+    } else if (ent->type == T_HASH) {
+        buf_append_u32(out, (uint32_t)hm_size(ent->hash));
+        hm_foreach(ent->hash, &cb_encode_hfield, &out);
+    } else if (ent->type == T_JSON) {
+        std::string text;
+        json_dump(ent->json, text);
+        buf_append_u32(out, (uint32_t)text.size());
+        buf_append(out, (const uint8_t*)text.data(), text.size());
+    } else if (ent->type == T_THROTTLE) {
+        uint64_t now_us = get_monotonic_usec();
+        buf_append_i64(out, ent->tat_us > now_us ? (int64_t)(ent->tat_us - now_us) : 0);
+    } else if (ent->type == T_CMS) {
+        CMS* cms = ent->cms;
+        buf_append_u32(out, cms->width);
+        buf_append_u32(out, cms->depth);
+        buf_append(out, (const uint8_t*)cms->counters.data(), cms->counters.size() * 4);
+    } else if (ent->type == T_TOPK) {
+        TopK* topk = ent->topk;
+        buf_append_u32(out, topk->k);
+        buf_append_u32(out, topk->width);
+        buf_append_u32(out, topk->depth);
+        buf_append_dbl(out, topk->decay);
+        buf_append(out, (const uint8_t*)topk->buckets.data(),
+            topk->buckets.size() * sizeof(TopKBucket));
+        buf_append_u32(out, (uint32_t)topk->heap.size());
+        for (const HeapItem &h : topk->heap) {
+            TopKItem* item = container_of(h.ref, TopKItem, heap_idx);
+            buf_append_u32(out, (uint32_t)item->item.size());
+            buf_append(out, (const uint8_t*)item->item.data(), item->item.size());
+            buf_append_u32(out, item->count);
+        }
+    }
+    return true;
+}
+
+// the key, the TTL, then the value
+static bool entry_encode(Buffer &out, Entry* ent) {
+    buf_append_u32(out, (uint32_t)ent->key.size());
+    buf_append(out, (const uint8_t*)ent->key.data(), ent->key.size());
+    buf_append_i64(out, entry_get_ttl(ent));
+    return entry_encode_value(out, ent);
+}
+
+// the reverse of `entry_encode_value()`, returns NULL on bad data
+static Entry* entry_decode_value(const uint8_t* &cur, const uint8_t* end) {
+    uint32_t len = 0;
+    uint8_t type = 0;
+    if (!read_u8(cur, end, type)) {
+        return NULL;
+    }
+
+    Entry* ent = NULL;
+    if (type == T_STR) {
+        ent = entry_new(T_STR);
+        if (!read_u32(cur, end, len) || !read_str(cur, end, len, ent->str)) {
+            entry_del(ent);
+            return NULL;
+        }
+    } else if (type == T_ZSET || type == T_ZSET_TTL || type == T_ZSET_INT) {
+        ent = entry_new(T_ZSET);
+        ent->zset->int_scores = type == T_ZSET_INT;
+        uint32_t n = 0;
+        if (!read_u32(cur, end, n)) {
+            entry_del(ent);
+            return NULL;
+        }
+        std::string name;
+        uint64_t now_ms = get_monotonic_msec();
+        for (uint32_t i = 0; i < n; i++) {
+            double score = 0;
+            int64_t iscore = 0;
+            int64_t member_ttl = -1;
+            bool ok = type == T_ZSET_INT
+                ? read_i64(cur, end, iscore) : read_dbl(cur, end, score);
+            if (!ok || !read_u32(cur, end, len) || !read_str(cur, end, len, name)
+                || (type != T_ZSET && !read_i64(cur, end, member_ttl)))
+            {
+                entry_del(ent);
+                return NULL;
+            }
+            if (type == T_ZSET_INT) {
+                zset_insert_int(ent->zset, name.data(), name.size(), iscore);
+            } else {
+                zset_insert(ent->zset, name.data(), name.size(), score);
+            }
+            if (member_ttl >= 0) {
+                ZNode* znode = zset_lookup(ent->zset, name.data(), name.size());
+                zset_set_expire(ent->zset, znode, (int64_t)(now_ms + member_ttl));
+            }
+        }
+        zset_sync_ttl(ent);
+    } else if (type == T_VSET) {
+        uint32_t dim = 0;
+        uint8_t metric = 0;
+        uint8_t q8 = 0;
+        uint32_t n = 0;
+        if (!read_u32(cur, end, dim) || !read_u8(cur, end, metric) || !read_u8(cur, end, q8)
+            || !read_u32(cur, end, n) || dim == 0 || dim > k_max_args || metric > VM_DOT)
+        {
+            return NULL;
+        }
+        ent = entry_new(T_VSET);
+        ent->vset = vset_new(dim, metric, q8 != 0);
+        std::string id;
+        std::vector<float> vec(dim);
+        for (uint32_t i = 0; i < n; i++) {
+            if (!read_u32(cur, end, len) || !read_str(cur, end, len, id)
+                || (size_t)(end - cur) < dim * sizeof(float))
+            {
+                entry_del(ent);
+                return NULL;
+            }
+            memcpy(vec.data(), cur, dim * sizeof(float));
+            cur += dim * sizeof(float);
+            vset_add(ent->vset, id.data(), id.size(), vec.data());
+        }
+        vset_build_start(ent->vset);
+    } else if (type == T_HASH) {
+        ent = entry_new(T_HASH);
+        uint32_t n = 0;
+        if (!read_u32(cur, end, n)) {
+            entry_del(ent);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            HField* hf = new HField();
+            if (!read_u32(cur, end, len) || !read_str(cur, end, len, hf->field)
+                || !read_u32(cur, end, len) || !read_str(cur, end, len, hf->val))
+            {
+                delete hf;
+                entry_del(ent);
+                return NULL;
+            }
+            if (hash_lookup(ent->hash, hf->field)) {
+                delete hf;          // a duplicate field, the payload is not ours
+                entry_del(ent);
+                return NULL;
+            }
+            hf->node.hcode = str_hash((uint8_t*)hf->field.data(), hf->field.size());
+            hm_insert(ent->hash, &hf->node);
+        }
+    } else if (type == T_JSON) {
+        std::string text;
+        if (!read_u32(cur, end, len) || !read_str(cur, end, len, text)) {
+            return NULL;
+        }
+        JNode* json = json_parse(text.data(), text.size());
+        if (!json) {
+            return NULL;
+        }
+        ent = entry_new(T_JSON);
+        ent->json = json;
+    } else if (type == T_THROTTLE) {
+        int64_t tat_us = 0;
+        if (!read_i64(cur, end, tat_us) || tat_us < 0) {
+            return NULL;
+        }
+        ent = entry_new(T_THROTTLE);
+        ent->tat_us = get_monotonic_usec() + (uint64_t)tat_us;
+    } else if (type == T_CMS) {
+        uint32_t width = 0, depth = 0;
+        if (!read_u32(cur, end, width) || !read_u32(cur, end, depth) || width == 0
+            || depth == 0 || (uint64_t)width * depth > (uint64_t)k_sketch_max_cells
+            || (uint64_t)(end - cur) < (uint64_t)width * depth * 4)
+        {
+            return NULL;
+        }
+        ent = entry_new(T_CMS);
+        ent->cms = cms_new(width, depth);
+        memcpy(ent->cms->counters.data(), cur, (size_t)width * depth * 4);
+        cur += (size_t)width * depth * 4;
+    } else if (type == T_TOPK) {
+        uint32_t k = 0, width = 0, depth = 0, n = 0;
+        double decay = 0;
+        if (!read_u32(cur, end, k) || !read_u32(cur, end, width) || !read_u32(cur, end, depth)
+            || !read_dbl(cur, end, decay) || k == 0 || width == 0 || depth == 0
+            || (uint64_t)width * depth > (uint64_t)k_sketch_max_cells || !(decay > 0 && decay < 1)
+            || (uint64_t)(end - cur) < (uint64_t)width * depth * sizeof(TopKBucket))
+        {
+            return NULL;
+        }
+        ent = entry_new(T_TOPK);
+        ent->topk = topk_new(k, width, depth, decay);
+        size_t size = (size_t)width * depth * sizeof(TopKBucket);
+        memcpy(ent->topk->buckets.data(), cur, size);
+        cur += size;
+        std::string item;
+        uint32_t count = 0;
+        bool ok = read_u32(cur, end, n) && n <= k;
+        for (uint32_t i = 0; ok && i < n; i++) {
+            ok = read_u32(cur, end, len) && read_str(cur, end, len, item)
+                && read_u32(cur, end, count);
+            if (ok) {
+                topk_restore_item(ent->topk, item, count);
+            }
+        }
+        if (!ok) {
+            entry_del(ent);
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+    return ent;
+}
+
+// the reverse of `entry_encode()`, returns NULL on bad data
+static Entry* entry_decode(const uint8_t* &cur, const uint8_t* end, int64_t &ttl_ms) {
+    uint32_t len = 0;
+    std::string key;
+    if (!read_u32(cur, end, len) || !read_str(cur, end, len, key)
+        || !read_i64(cur, end, ttl_ms))
+    {
+        return NULL;
+    }
+    Entry* ent = entry_decode_value(cur, end);
+    if (!ent) {
+        return NULL;
+    }
+    ent->key.swap(key);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    return ent;
+}
+
+static Entry* entry_lookup(const std::string &key) {
+    LookupKey lkey;
+    lkey.key = key;
+    lkey.node.hcode = str_hash((uint8_t*)key.data(), key.size());
+    HNode* node = hm_lookup(&g_data.db->keys, &lkey.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+static void entry_remove(Entry* ent) {
+    hm_delete(&g_data.db->keys, &ent->node, &hnode_same);
+    entry_del(ent);
+}
+
+// the value is now under the key
+static void entry_published(Entry* ent) {
+    if (ent->type == T_HASH) {
+        hash_reindex(ent);
+    }
+    if (ent->type == T_ZSET) {
+        zset_wakeup(ent);
+    }
+}
+
+// re-link the entry under another key, maybe in another database,
+// the value is not copied
+static void entry_relink(Entry* ent, DB* db, std::string &newkey) {
+    entry_before_write(ent);     // the snapshot has the old key
+    if (ent->type == T_HASH) {
+        hash_unindex(ent);
+    }
+    ns_remove(ent);             // the new key may be in another namespace
+    // the heap items point to the metadata slot, which goes with the entry,
+    // so they are only moved between databases
+    DB* from = g_data.db;
+    int64_t ttl_ms = -1;
+    if (db != from) {
+        ttl_ms = entry_get_ttl(ent);
+        entry_set_ttl(ent, -1);
+        TTLSlot &slot = entry_member_ttl(ent);
+        if (slot.heap_idx != (size_t)-1) {
+            heap_delete(from->member_heap, slot.heap_idx);
+            slot.heap_idx = -1;
+        }
+    }
+    hm_delete(&from->keys, &ent->node, &hnode_same);
+    if (!g_data.readers.empty()) {
+        // the readers may be on the old chain or reading the string,
+        // so the old entry is left intact and retired
+        Entry* fresh = new Entry();
+        fresh->str = ent->str;
+        entry_move_value(fresh, ent);
+        ebr_retire(&g_data.ebr, ent, 0, &entry_free);
+        ent = fresh;
+    }
+    ent->key.swap(newkey);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    g_data.db = db;
+    entry_insert(ent);
+    if (db != from) {
+        entry_set_ttl(ent, ttl_ms);
+        if (ent->type == T_ZSET) {
+            zset_sync_ttl(ent);
+        }
+    }
+    entry_published(ent);
+    g_data.db = from;
+}
+
+// rename key newkey : replaces newkey
+// renamenx key newkey : 1 if renamed, 0 if newkey exists
+static void do_rename(std::vector<std::string> &cmd, Buffer &out, bool nx) {
+    Entry* ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "no such key");
+    }
+    Entry* dst = entry_lookup(cmd[2]);
+    if (dst && nx) {
+        return out_int(out, 0);
+    }
+    if (dst != ent) {
+        if (dst) {
+            entry_remove(dst);
+        }
+        entry_relink(ent, g_data.db, cmd[2]);
+    }
+    return nx ? out_int(out, 1) : out_nil(out);
+}
+
+static bool str2db(const std::string &s, uint32_t &out) {
+    int64_t db = 0;
+    if (!str2int(s, db) || db < 0 || db >= (int64_t)k_num_dbs) {
+        return false;
+    }
+    out = (uint32_t)db;
+    return true;
+}
+
+// move key db : 1 if moved, 0 if the key doesn't exist or exists in db
+static void do_move(std::vector<std::string> &cmd, Buffer &out) {
+    uint32_t id = 0;
+    if (!str2db(cmd[2], id)) {
+        return out_err(out, ERR_BAD_ARG, "bad database index");
+    }
+    DB* db = &g_data.dbs[id];
+    if (db == g_data.db) {
+        return out_err(out, ERR_BAD_ARG, "same database");
+    }
+    Entry* ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = ent->node.hcode;
+    if (hm_lookup(&db->keys, &key.node, &entry_eq)) {
+        return out_int(out, 0);
+    }
+    entry_relink(ent, db, cmd[1]);
+    return out_int(out, 1);
+}
+
+// copy src dst [replace] : 1 if copied, 0 if dst exists,
+// the value is copied through its binary encoding
+static void do_copy(std::vector<std::string> &cmd, Buffer &out) {
+    bool replace = cmd.size() == 4;
+    if (replace && cmd[3] != "replace") {
+        return out_err(out, ERR_BAD_ARG, "expect `replace`");
+    }
+    Entry* src = entry_lookup(cmd[1]);
+    Entry* dst = entry_lookup(cmd[2]);
+    if (src && src == dst) {
+        return out_err(out, ERR_BAD_ARG, "same key");
+    }
+    if (!src || (dst && !replace)) {
+        return out_int(out, 0);
+    }
+    Buffer data;
+    if (!entry_encode_value(data, src)) {
+        return out_err(out, ERR_UNKNOWN, "can't read the value");
+    }
+    const uint8_t* cur = data.data();
+    Entry* ent = entry_decode_value(cur, data.data() + data.size());
+    if (ent && cur != data.data() + data.size()) {
+        entry_del(ent);
+        ent = NULL;
+    }
+    if (!ent) {
+        return out_err(out, ERR_UNKNOWN, "can't copy the value");
+    }
+    if (dst) {
+        entry_remove(dst);
+    }
+    ent->key.swap(cmd[2]);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    entry_insert(ent);
+    entry_set_ttl(ent, entry_get_ttl(src));
+    entry_published(ent);
+    return out_int(out, 1);
+}
+
+// DUMP/RESTORE payload:
+// +------+-------+---------+----------+
+// | type | value | version | checksum |
+// +------+-------+---------+----------+
+// the value is the same as in snapshots, the checksum is of the rest
+const uint8_t k_dump_version = 1;
+
+// dump key : the payload, nil if the key doesn't exist
+static void do_dump(std::vector<std::string> &cmd, Buffer &out) {
+    Entry* ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    Buffer data;
+    if (!entry_encode_value(data, ent)) {
+        return out_err(out, ERR_UNKNOWN, "can't read the value");
+    }
+    buf_append_u8(data, k_dump_version);
+    buf_append_u32(data, (uint32_t)str_hash(data.data(), data.size()));
+    return out_str(out, (const char*)data.data(), data.size());
+}
+
+// restore key ttl_ms payload [replace] : ttl_ms 0 means no TTL
+static void do_restore(std::vector<std::string> &cmd, Buffer &out) {
+    bool replace = cmd.size() == 5;
+    if (replace && cmd[4] != "replace") {
+        return out_err(out, ERR_BAD_ARG, "expect `replace`");
+    }
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms) || ttl_ms < 0) {
+        return out_err(out, ERR_BAD_ARG, "expect TTL");
+    }
+    Entry* dst = entry_lookup(cmd[1]);
+    if (dst && !replace) {
+        return out_err(out, ERR_BAD_ARG, "key exists");
+    }
+    // check the trailer before decoding anything
+    const std::string &data = cmd[3];
+    uint32_t checksum = 0;
+    if (data.size() < 1 + 1 + 4) {
+        return out_err(out, ERR_BAD_ARG, "bad payload");
+    }
+    size_t size = data.size() - 4;
+    memcpy(&checksum, data.data() + size, 4);
+    if ((uint8_t)data[size - 1] != k_dump_version
+        || checksum != (uint32_t)str_hash((const uint8_t*)data.data(), size))
+    {
+        return out_err(out, ERR_BAD_ARG, "bad payload");
+    }
+    const uint8_t* cur = (const uint8_t*)data.data();
+    const uint8_t* end = cur + size - 1;
+    Entry* ent = entry_decode_value(cur, end);
+    if (ent && cur != end) {
+        entry_del(ent);
+        ent = NULL;
+    }
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "bad payload");
+    }
+    if (dst) {
+        entry_remove(dst);
+    }
+    ent->key.swap(cmd[1]);
+    ent->node.hcode = str_hash((uint8_t*)ent->key.data(), ent->key.size());
+    entry_insert(ent);
+    entry_set_ttl(ent, ttl_ms > 0 ? ttl_ms : -1);
+    entry_published(ent);
+    return out_nil(out);
+}
+
+// per-tenant accounting: a namespace is the keys sharing a prefix that ends
+// at the first `:`, so the namespace of a key is a single hash lookup; the keys,
+// their estimated memory and the ops are counted, the quotas are enforced
+// before the writes to the namespace
+struct Namespace {
+    HNode node;                 // in `DB::namespaces`
+    std::string prefix;
+    // quotas, 0 for none
+    uint64_t max_keys = 0;
+    uint64_t max_bytes = 0;
+    bool evict = false;         // evict keys or reject the writes over the quota
+    // the meta_id of each key, for sampling
+    std::vector<uint32_t> metas;
+    uint64_t bytes = 0;
+    uint64_t ops = 0;
+    uint64_t ops_last = 0;      // `ops` at the last sample
+    uint64_t ops_per_sec = 0;
+    uint64_t evicted = 0;
+    uint64_t rejected = 0;
+};
+
+struct NSKey {
+    HNode node;
+    const char* prefix = NULL;
+    size_t len = 0;
+};
+
+static bool ns_eq(HNode* node, HNode* key) {
+    Namespace* ns = container_of(node, Namespace, node);
+    NSKey* nkey = container_of(key, NSKey, node);
+    return ns->prefix.size() == nkey->len
+        && 0 == memcmp(ns->prefix.data(), nkey->prefix, nkey->len);
+}
+
+// the namespace of the key in the database being worked on
+static Namespace* ns_find(const std::string &key) {
+    const char* sep = (const char*)memchr(key.data(), ':', key.size());
+    if (!sep) {
+        return NULL;
+    }
+    NSKey nkey;
+    nkey.prefix = key.data();
+    nkey.len = sep + 1 - key.data();
+    nkey.node.hcode = str_hash((const uint8_t*)nkey.prefix, nkey.len);
+    HNode* node = hm_lookup(&g_data.db->namespaces, &nkey.node, &ns_eq);
+    return node ? container_of(node, Namespace, node) : NULL;
+}
+
+// per member of a container: the links, the hashtable slot and the allocator
+const uint64_t k_ns_member_bytes = 64;
+
+// the memory of the key, estimated in O(1) from the sizes kept by the values;
+// a string moved to the file still counts, a JSON document is sized by its
+// top-level items
+static uint64_t entry_mem(Entry* ent) {
+    uint64_t bytes = sizeof(Entry) + ent->key.size();
+    if (ent->type == T_STR) {
+        bytes += ent->spill ? ent->spill_len : ent->str.size();
+    } else if (ent->type == T_ZSET) {
+        bytes += sizeof(ZSet) + hm_size(&ent->zset->hmap) * (sizeof(ZNode) + k_ns_member_bytes);
+    } else if (ent->type == T_HASH) {
+        bytes += sizeof(HMap) + hm_size(ent->hash) * (sizeof(HField) + k_ns_member_bytes);
+    } else if (ent->type == T_VSET && ent->vset) {
+        const VStore &store = ent->vset->store;
+        uint64_t vec = (uint64_t)store.dim * (store.q8 ? 1 : sizeof(float));
+        bytes += vset_size(ent->vset) * (vec + sizeof(VNode) + k_ns_member_bytes);
+    } else if (ent->type == T_JSON && ent->json) {
+        bytes += (1 + ent->json->kids.size()) * (sizeof(JNode) + k_ns_member_bytes);
+    } else if (ent->type == T_CMS && ent->cms) {
+        bytes += ent->cms->counters.size() * sizeof(uint32_t);
+    } else if (ent->type == T_TOPK && ent->topk) {
+        bytes += ent->topk->buckets.size() * sizeof(TopKBucket)
+            + ent->topk->heap.size() * (sizeof(TopKItem) + k_ns_member_bytes);
+    }
+    return bytes;
+}
+
+// the key is sized after the command, see `ns_sync()`
+static void ns_before_write(Entry* ent) {
+    NSSlot &slot = entry_ns(ent);
+    if (slot.ns && !slot.dirty) {
+        slot.dirty = true;
+        g_data.ns_dirty.push_back(ent->meta_id);
+    }
+}
+
+static void ns_link(Namespace* ns, Entry* ent) {
+    NSSlot &slot = entry_ns(ent);
+    slot.ns = ns;
+    slot.pos = (uint32_t)ns->metas.size();
+    slot.bytes = 0;
+    ns->metas.push_back(ent->meta_id);
+    ns_before_write(ent);
+}
+
+// the key is added to the database
+static void ns_add(Entry* ent) {
+    if (g_data.db->ns_list.empty()) {
+        return;
+    }
+    Namespace* ns = ns_find(ent->key);
+    if (ns) {
+        ns_link(ns, ent);
+    }
+}
+
+// the key is deleted or renamed
+static void ns_remove(Entry* ent) {
+    NSSlot &slot = entry_ns(ent);
+    Namespace* ns = slot.ns;
+    if (!ns) {
+        return;
+    }
+    uint32_t last = ns->metas.back();
+    ns->metas[slot.pos] = last;
+    meta_ns(last).pos = slot.pos;
+    ns->metas.pop_back();
+    ns->bytes -= slot.bytes;
+    slot = NSSlot{};
+}
+
+// size the keys written by the command
+static void ns_sync() {
+    for (uint32_t meta_id : g_data.ns_dirty) {
+        NSSlot &slot = meta_ns(meta_id);
+        if (!slot.dirty) {
+            continue;   // deleted
+        }
+        slot.dirty = false;
+        uint64_t bytes = entry_mem(meta_owner(meta_id));
+        slot.ns->bytes += bytes - slot.bytes;
+        slot.bytes = bytes;
+    }
+    g_data.ns_dirty.clear();
+}
+
+// the database is flushed, the keys are gone
+static void ns_clear(DB* db) {
+    for (Namespace* ns : db->ns_list) {
+        std::vector<uint32_t>().swap(ns->metas);
+        ns->bytes = 0;
+    }
+}
+
+// the commands that may add or grow a key, and the argument of the key
+struct NSWrite {
+    const char* name;
+    size_t arg;
+};
+
+static const NSWrite k_ns_writes[] = {
+    {"set", 1}, {"zadd", 1}, {"zincrby", 1}, {"hset", 1}, {"vadd", 1},
+    {"json.set", 1}, {"json.arrappend", 1}, {"throttle", 1},
+    {"cms.initbydim", 1}, {"topk.reserve", 1}, {"restore", 1},
+    {"copy", 2}, {"rename", 2}, {"renamenx", 2},
+};
+
+static size_t ns_write_arg(std::vector<std::string> &cmd) {
+    for (const NSWrite &w : k_ns_writes) {
+        if (cmd[0] == w.name) {
+            return w.arg < cmd.size() ? w.arg : 0;
+        }
+    }
+    return 0;
+}
+
+// the commands whose first argument is not a key
+static const char* const k_ns_unkeyed[] = {
+    "select", "flushdb", "flushall", "info", "bgsave", "hotupgrade",
+    "ft.create", "ft.dropindex", "ft.search", "ns.set", "ns.del",
+};
+
+static bool ns_keyed(std::vector<std::string> &cmd) {
+    for (const char* name : k_ns_unkeyed) {
+        if (cmd[0] == name) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the estimated size of writing `cmd[arg]`: `add` bytes, replacing `sub`
+// bytes, and whether the namespace has one more key; a new value replaces
+// the key, the other writes add their arguments to it
+struct NSWriteSize {
+    uint64_t add = 0;
+    uint64_t sub = 0;
+    bool new_key = false;
+};
+
+static NSWriteSize ns_write_size(Namespace* ns, std::vector<std::string> &cmd, size_t arg) {
+    const std::string &key = cmd[arg];
+    Entry* old = entry_lookup(key);
+    NSWriteSize size;
+    size.new_key = !old;
+    bool replace = true;
+    if (arg == 2) {             // copy, rename
+        Entry* src = entry_lookup(cmd[1]);
+        if (!src || src == old) {
+            return NSWriteSize{};
+        }
+        // renamed within the namespace, the key and its bytes stay
+        bool moved = cmd[0] != "copy" && ns_find(cmd[1]) == ns;
+        size.add = moved ? 0 : entry_mem(src);
+        size.new_key = !old && !moved;
+    } else if (cmd[0] == "set" || cmd[0] == "restore") {
+        size_t val = cmd[0] == "set" ? 2 : 3;
+        size.add = sizeof(Entry) + key.size() + (val < cmd.size() ? cmd[val].size() : 0);
+    } else {
+        size.add = (old ? 0 : sizeof(Entry) + key.size()) + k_ns_member_bytes;
+        for (size_t i = arg + 1; i < cmd.size(); i++) {
+            size.add += cmd[i].size();
+        }
+        replace = false;
+    }
+    size.sub = old && replace ? entry_mem(old) : 0;
+    return size;
+}
+
+// the write would exceed the quota, by the size after it
+static bool ns_over(Namespace* ns, const NSWriteSize &size) {
+    if (ns->max_bytes && ns->bytes + size.add > ns->max_bytes + size.sub) {
+        return true;
+    }
+    return size.new_key && ns->max_keys && ns->metas.size() >= ns->max_keys;
+}
+
+const size_t k_ns_evict_samples = 5;
+
+// evict the least recently used of a few random keys, except the keys of
+// the command, returns false if there is nothing else
+static bool ns_evict(Namespace* ns, std::vector<std::string> &cmd, size_t arg) {
+    auto evictable = [&](Entry* ent) {
+        return ent->key != cmd[1] && ent->key != cmd[arg];
+    };
+    Entry* victim = NULL;
+    for (size_t i = 0; i < k_ns_evict_samples; i++) {
+        Entry* ent = meta_owner(ns->metas[rand_u64() % ns->metas.size()]);
+        if (evictable(ent) && (!victim || entry_atime(ent) < entry_atime(victim))) {
+            victim = ent;
+        }
+    }
+    // only the keys of the command were sampled, at most 2 are skipped
+    for (size_t i = 0; !victim && i < ns->metas.size() && i < 3; i++) {
+        Entry* ent = meta_owner(ns->metas[i]);
+        victim = evictable(ent) ? ent : NULL;
+    }
+    if (!victim) {
+        return false;
+    }
+    entry_remove(victim);
+    ns->evicted++;
+    return true;
+}
+
+// make room for the write or reject it, returns false if rejected
+static bool ns_admit_write(Namespace* ns, std::vector<std::string> &cmd, size_t arg,
+    const NSWriteSize &size, Buffer &out)
+{
+    if (!ns_over(ns, size)) {
+        return true;
+    }
+    // a write bigger than the quota can't fit, nothing is evicted for it;
+    // the keys of the command are kept, so the size of the write stays
+    if (ns->evict && (!ns->max_bytes || size.add <= ns->max_bytes)) {
+        while (ns_over(ns, size) && ns_evict(ns, cmd, arg)) {}
+    }
+    if (ns_over(ns, size)) {
+        ns->rejected++;
+        out_err(out, ERR_QUOTA, "namespace over quota");
+        return false;
+    }
+    return true;
+}
+
+// move key db : a new key in the namespace of the other database
+static bool ns_admit_move(std::vector<std::string> &cmd, Buffer &out) {
+    uint32_t id = 0;
+    Entry* src = entry_lookup(cmd[1]);
+    if (cmd.size() != 3 || !str2db(cmd[2], id) || &g_data.dbs[id] == g_data.db || !src) {
+        return true;
+    }
+    DB* from = g_data.db;
+    g_data.db = &g_data.dbs[id];
+    Namespace* ns = ns_find(cmd[1]);
+    bool ok = true;
+    if (ns && !entry_lookup(cmd[1])) {
+        NSWriteSize size;
+        size.add = entry_mem(src);
+        size.new_key = true;
+        ok = ns_admit_write(ns, cmd, 1, size, out);
+    }
+    g_data.db = from;
+    return ok;
+}
+
+// count the op, and make room for the write or reject it,
+// returns false if rejected
+static bool ns_admit(std::vector<std::string> &cmd, Buffer &out) {
+    if (!ns_keyed(cmd)) {
+        return true;
+    }
+    Namespace* ns = ns_find(cmd[1]);
+    if (ns) {
+        ns->ops++;
+    }
+    if (cmd[0] == "move") {
+        return ns_admit_move(cmd, out);
+    }
+    size_t arg = ns_write_arg(cmd);
+    if (arg > 1) {
+        ns = ns_find(cmd[arg]);
+    }
+    if (!arg || !ns) {
+        return true;
+    }
+    return ns_admit_write(ns, cmd, arg, ns_write_size(ns, cmd, arg), out);
+}
+
+// a new namespace with the existing keys under the prefix
+static Namespace* ns_create(const std::string &prefix) {
+    Namespace* ns = new Namespace();
+    ns->prefix = prefix;
+    ns->node.hcode = str_hash((const uint8_t*)ns->prefix.data(), ns->prefix.size());
+    std::vector<HNode*> nodes;
+    hm_foreach(&g_data.db->keys, &cb_collect, &nodes);
+    for (HNode* node : nodes) {
+        Entry* ent = container_of(node, Entry, node);
+        if (key_has_prefix(ent->key, ns->prefix)) {
+            ns_link(ns, ent);
+        }
+    }
+    hm_insert(&g_data.db->namespaces, &ns->node);
+    g_data.db->ns_list.push_back(ns);
+    return ns;
+}
+
+// the prefix ends with its only `:`
+static bool ns_prefix_ok(const std::string &prefix) {
+    const char* sep = (const char*)memchr(prefix.data(), ':', prefix.size());
+    return sep && sep + 1 == prefix.data() + prefix.size();
+}
+
+// ns.set prefix max_keys max_bytes [evict] : create or update the namespace,
+// 0 for no quota, writes over the quota are rejected unless `evict`;
+// the existing keys under the prefix are accounted now
+static void do_ns_set(std::vector<std::string> &cmd, Buffer &out) {
+    if (!ns_prefix_ok(cmd[1])) {
+        return out_err(out, ERR_BAD_ARG, "expect a prefix ending with its only `:`");
+    }
+    int64_t max_keys = 0, max_bytes = 0;
+    if (!str2int(cmd[2], max_keys) || max_keys < 0
+        || !str2int(cmd[3], max_bytes) || max_bytes < 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "expect quotas");
+    }
+    bool evict = cmd.size() == 5;
+    if (evict && cmd[4] != "evict") {
+        return out_err(out, ERR_BAD_ARG, "expect `evict`");
+    }
+    Namespace* ns = ns_find(cmd[1]);
+    if (!ns) {
+        ns = ns_create(cmd[1]);
+    }
+    ns->max_keys = (uint64_t)max_keys;
+    ns->max_bytes = (uint64_t)max_bytes;
+    ns->evict = evict;
+    return out_nil(out);
+}
+
+// ns.del prefix : 1 if deleted, the keys are kept
+static void do_ns_del(std::vector<std::string> &cmd, Buffer &out) {
+    Namespace* ns = ns_prefix_ok(cmd[1]) ? ns_find(cmd[1]) : NULL;
+    if (!ns) {
+        return out_int(out, 0);
+    }
+    for (uint32_t meta_id : ns->metas) {
+        meta_ns(meta_id) = NSSlot{};
+    }
+    hm_delete(&g_data.db->namespaces, &ns->node, &hnode_same);
+    std::vector<Namespace*> &list = g_data.db->ns_list;
+    list.erase(std::find(list.begin(), list.end(), ns));
+    delete ns;
+    return out_int(out, 1);
+}
+
+const uint64_t k_ns_sample_ms = 1000;
+
+// sample the ops/sec
+static void ns_cron(uint64_t now_ms) {
+    if (now_ms < g_data.ns_next_ms) {
+        return;
+    }
+    uint64_t elapsed_ms = now_ms + k_ns_sample_ms - g_data.ns_next_ms;
+    for (DB &db : g_data.dbs) {
+        for (Namespace* ns : db.ns_list) {
+            ns->ops_per_sec = (ns->ops - ns->ops_last) * 1000 / elapsed_ms;
+            ns->ops_last = ns->ops;
+        }
+    }
+    g_data.ns_next_ms = now_ms + k_ns_sample_ms;
+}
+
+// info : the keys of each database and the accounting of each namespace
+static void do_info(std::vector<std::string> &, Buffer &out) {
+    std::string text = "# keyspace\n";
+    for (DB &db : g_data.dbs) {
+        if (hm_size(&db.keys)) {
+            text += "db" + std::to_string(db.id)
+                + ":keys=" + std::to_string(hm_size(&db.keys)) + "\n";
+        }
+    }
+    text += "# namespaces\n";
+    for (DB &db : g_data.dbs) {
+        for (Namespace* ns : db.ns_list) {
+            text += "ns:db=" + std::to_string(db.id)
+                + ",prefix=" + ns->prefix
+                + ",keys=" + std::to_string(ns->metas.size())
+                + ",bytes=" + std::to_string(ns->bytes)
+                + ",ops=" + std::to_string(ns->ops)
+                + ",ops_per_sec=" + std::to_string(ns->ops_per_sec)
+                + ",max_keys=" + std::to_string(ns->max_keys)
+                + ",max_bytes=" + std::to_string(ns->max_bytes)
+                + ",policy=" + (ns->evict ? "evict" : "reject")
+                + ",evicted=" + std::to_string(ns->evicted)
+                + ",rejected=" + std::to_string(ns->rejected) + "\n";
+        }
+    }
+    return out_str(out, text.data(), text.size());
+}
+
+// snapshots are written incrementally in the event loop without fork(),
+// an entry modified before it's visited has its old value written first,
+// so the file is still a point-in-time image
+enum {
+    SNAP_IDLE = 0,
+    SNAP_WALK = 1,  // writing the entries in time slices
+    SNAP_SYNC = 2,  // fsync() and rename() in the thread pool
+};
+
+const uint64_t k_snap_budget_us = 1000;
+const size_t k_snap_scan_slots = 64;
+const size_t k_snap_flush_size = 1 << 20;
+// each entry is | db | entry_encode() |, version 1 has no `db` and is all in database 0
+static const uint8_t k_snap_magic[8] = {'S', 'N', 'A', 'P', '0', '0', '0', '2'};
+static const uint8_t k_snap_magic_v1[8] = {'S', 'N', 'A', 'P', '0', '0', '0', '1'};
+
+// write out the buffered data
+static bool snap_flush() {
+    const uint8_t* data = g_data.snap_buf.data();
+    size_t n = g_data.snap_buf.size();
+    while (n > 0) {
+        ssize_t rv = write(g_data.snap_fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        n -= (size_t)rv;
+        data += rv;
+    }
+    g_data.snap_buf.clear();
+    return true;
+}
+
+static void snap_abort() {
+    msg_errno("snapshot failed");
+    close(g_data.snap_fd);
+    g_data.snap_fd = -1;
+    unlink((g_data.snap_path + ".tmp").c_str());
+    Buffer().swap(g_data.snap_buf);
+    g_data.snap_state = SNAP_IDLE;
+}
+
+// write the entry if it's in the snapshot and not written yet,
+// the snapshot is aborted if the value is lost
+static void snap_write(Entry* ent) {
+    uint32_t &epoch = entry_snap_epoch(ent);
+    if (g_data.snap_state != SNAP_WALK || epoch == g_data.snap_epoch) {
+        return;
+    }
+    epoch = g_data.snap_epoch;
+    buf_append_u32(g_data.snap_buf, g_data.db->id);
+    if (!entry_encode(g_data.snap_buf, ent)) {
+        return snap_abort();
+    }
+    assert(g_data.snap_pending > 0);
+    g_data.snap_pending--;
+}
+
+static void snap_before_write(Entry* ent) {
+    if (g_data.snap_state == SNAP_WALK) {
+        snap_write(ent);
+    }
+}
+
+// must be called before an entry is modified or deleted
+static void entry_before_write(Entry* ent) {
+    snap_before_write(ent);
+    ns_before_write(ent);
+}
+
+static void cb_snap(HNode* node, void*) {
+    snap_write(container_of(node, Entry, node));
+}
+
+struct SnapSync {
+    int fd = -1;
+    std::string tmp_path;
+    std::string path;
+    bool ok = false;
+};
+
+static void snap_sync_work(void* arg) {
+    SnapSync* sync = (SnapSync*)arg;
+    sync->ok = fsync(sync->fd) == 0;
+    sync->ok = close(sync->fd) == 0 && sync->ok;
+    sync->ok = sync->ok && rename(sync->tmp_path.c_str(), sync->path.c_str()) == 0;
+}
+
+static void snap_sync_done(void* arg) {
+    SnapSync* sync = (SnapSync*)arg;
+    if (sync->ok) {
+        g_data.snap_last_ok = (int64_t)time(NULL);
+        fprintf(stderr, "snapshot done: %s\n", sync->path.c_str());
+    } else {
+        msg_errno("snapshot failed");
+        unlink(sync->tmp_path.c_str());
+    }
+    g_data.snap_state = SNAP_IDLE;
+    delete sync;
+}
+
+// a time slice of writing the snapshot
+static void snap_cron() {
+    if (g_data.snap_state != SNAP_WALK) {
+        return;
+    }
+    uint64_t deadline = get_monotonic_usec() + k_snap_budget_us;
+    while (g_data.snap_pending > 0 && get_monotonic_usec() < deadline) {
+        // rescan if something was missed due to rehashing
+        uint32_t &db = g_data.snap_db;
+        g_data.db = &g_data.dbs[db];
+        g_data.snap_cursor = hm_scan(&g_data.db->keys, g_data.snap_cursor,
+            k_snap_scan_slots, &cb_snap, NULL);
+        if (g_data.snap_state != SNAP_WALK) {
+            return;     // aborted
+        }
+        if (g_data.snap_cursor == 0) {
+            db = (db + 1) % k_num_dbs;
+        }
+        if (g_data.snap_buf.size() >= k_snap_flush_size && !snap_flush()) {
+            return snap_abort();
+        }
+    }
+    if (g_data.snap_pending > 0) {
+        return;     // continue in the next iteration
+    }
+    if (!snap_flush()) {
+        return snap_abort();
+    }
+    Buffer().swap(g_data.snap_buf);
+
+    // don't block the event loop on the disk
+    SnapSync* sync = new SnapSync();
+    sync->fd = g_data.snap_fd;
+    sync->tmp_path = g_data.snap_path + ".tmp";
+    sync->path = g_data.snap_path;
+    g_data.snap_fd = -1;
+    g_data.snap_state = SNAP_SYNC;
+    async_run(&snap_sync_work, &snap_sync_done, sync);
+}
+
+// BGSAVE : start writing a snapshot to the --snapshot-file
+static void do_bgsave(std::vector<std::string> &, Buffer &out) {
+    if (g_data.snap_path.empty()) {
+        return out_err(out, ERR_BAD_ARG, "no snapshot file");
+    }
+    if (g_data.snap_state != SNAP_IDLE) {
+        return out_err(out, ERR_BAD_ARG, "snapshot in progress");
+    }
+    std::string tmp_path = g_data.snap_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        msg_errno("open() error");
+        return out_err(out, ERR_UNKNOWN, "open() failed");
+    }
+    // the existing entries are in the new epoch
+    g_data.snap_fd = fd;
+    g_data.snap_epoch++;
+    g_data.snap_db = 0;
+    g_data.snap_cursor = 0;
+    g_data.snap_pending = 0;
+    for (DB &db : g_data.dbs) {
+        g_data.snap_pending += hm_size(&db.keys);
+    }
+    g_data.snap_state = SNAP_WALK;
+    buf_append(g_data.snap_buf, k_snap_magic, sizeof(k_snap_magic));
+    return out_nil(out);
+}
+
+// LASTSAVE : the unix time of the last successful snapshot
+static void do_lastsave(std::vector<std::string> &, Buffer &out) {
+    return out_int(out, g_data.snap_last_ok);
+}
+
+// load the snapshot file on startup if it exists
+static void snap_load() {
+    int fd = open(g_data.snap_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        return;
+    }
+    if (fd < 0) {
+        die("open()");
+    }
+    Buffer data;
+    uint8_t chunk[64 * 1024];
+    while (true) {
+        ssize_t rv = read(fd, chunk, sizeof(chunk));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            die("read()");
+        }
+        if (rv == 0) {
+            break;  // EOF
+        }
+        buf_append(data, chunk, (size_t)rv);
+    }
+    close(fd);
+
+    const uint8_t* cur = data.data();
+    const uint8_t* end = cur + data.size();
+    if (data.size() < sizeof(k_snap_magic)) {
+        die("bad snapshot file");
+    }
+    bool v1 = memcmp(cur, k_snap_magic_v1, sizeof(k_snap_magic_v1)) == 0;
+    if (!v1 && memcmp(cur, k_snap_magic, sizeof(k_snap_magic)) != 0) {
+        die("bad snapshot file");
+    }
+    cur += sizeof(k_snap_magic);
+    size_t nkeys = 0;
+    while (cur < end) {
+        uint32_t db = 0;
+        if (!v1 && (!read_u32(cur, end, db) || db >= k_num_dbs)) {
+            die("bad snapshot file");
+        }
+        g_data.db = &g_data.dbs[db];
+        int64_t ttl_ms = -1;
+        Entry* ent = entry_decode(cur, end, ttl_ms);
+        if (!ent) {
+            die("bad snapshot file");
+        }
+        hm_insert(&g_data.db->keys, &ent->node);
+        entry_set_ttl(ent, ttl_ms);
+        nkeys++;
+    }
+    g_data.db = &g_data.dbs[0];
+    fprintf(stderr, "loaded %zu keys\n", nkeys);
+}
+
+// select db : for this connection
+static void do_select(Conn* conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (!str2db(cmd[1], conn->db)) {
+        return out_err(out, ERR_BAD_ARG, "bad database index");
+    }
+    return out_nil(out);
+}
+
+// dbsize : the number of keys in the database
+static void do_dbsize(std::vector<std::string> &, Buffer &out) {
+    return out_int(out, (int64_t)hm_size(&g_data.db->keys));
+}
+
+// the contents of a flushed database, freed in the thread pool
+struct DBDrop {
+    HMap keys;
+    HeapVec heap;
+    HeapVec member_heap;
+    std::vector<FTIndex*> indexes;
+    // to be released by the event loop
+    std::vector<uint32_t> meta_ids;
+    std::vector<std::pair<SpillFile*, uint32_t>> spills;
+    std::vector<VSet*> vsets;
+};
+
+static void db_drop_work(void* arg) {
+    DBDrop* drop = (DBDrop*)arg;
+    std::vector<HNode*> nodes;
+    hm_foreach(&drop->keys, &cb_collect, &nodes);
+    hm_clear(&drop->keys);
+    for (HNode* node : nodes) {
+        Entry* ent = container_of(node, Entry, node);
+        drop->meta_ids.push_back(ent->meta_id);
+        if (ent->spill) {
+            drop->spills.push_back({ent->spill, ent->spill_len});
+        }
+        if (ent->type == T_ZSET) {
+            zset_clear(ent->zset);
+            delete ent->zset;
+        } else if (ent->type == T_VSET) {
+            drop->vsets.push_back(ent->vset);
+        } else if (ent->type == T_HASH) {
+            hash_free(ent->hash);
+        } else if (ent->type == T_JSON) {
+            json_free(ent->json);
+        } else if (ent->type == T_CMS) {
+            cms_del(ent->cms);
+        } else if (ent->type == T_TOPK) {
+            topk_del(ent->topk);
+        }
+        delete ent;
+    }
+    HeapVec().swap(drop->heap);
+    HeapVec().swap(drop->member_heap);
+    for (FTIndex* idx : drop->indexes) {
+        ft_del(idx);
+    }
+}
+
+static void cb_vset_dispose(void* arg) {
+    vset_del((VSet*)arg);
+}
+
+static void db_drop_done(void* arg) {
+    DBDrop* drop = (DBDrop*)arg;
+    g_data.meta_free.insert(g_data.meta_free.end(),
+        drop->meta_ids.begin(), drop->meta_ids.end());
+    for (const std::pair<SpillFile*, uint32_t> &spill : drop->spills) {
+        spill_forget(spill.first, spill.second);
+    }
+    // a vset with an index build in flight is still seen by the event loop
+    for (VSet* vset : drop->vsets) {
+        if (vset->build) {
+            vset_del(vset);
+        } else {
+            thread_pool_queue(&g_data.thread_pool, &cb_vset_dispose, vset);
+        }
+    }
+    delete drop;
+}
+
+// the readers are done with the entries
+static void db_drop_start(void* arg, size_t) {
+    async_run(&db_drop_work, &db_drop_done, arg);
+}
+
+// the same, but freed in the event loop for a sync flush
+static void db_drop_now(void* arg, size_t) {
+    db_drop_work(arg);
+    db_drop_done(arg);
+}
+
+static bool cb_snap_db(HNode* node, void* arg) {
+    cb_snap(node, arg);
+    return true;
+}
+
+// empty the database, the old contents are freed in the thread pool if async
+static void db_flush(DB* db, bool async) {
+    if (hm_size(&db->keys) == 0) {
+        return;
+    }
+    ns_sync();
+    ns_clear(db);
+    if (g_data.snap_state == SNAP_WALK) {
+        // the snapshot must have them
+        DB* cur = g_data.db;
+        g_data.db = db;
+        hm_foreach(&db->keys, &cb_snap_db, NULL);
+        g_data.db = cur;
+    }
+    // the big zsets of this database are gone, the others are done in the next pass
+    g_data.defrag_zsets.clear();
+    g_data.defrag_zset_cursor = 0;
+
+    DBDrop* drop = new DBDrop();
+    hm_move(&db->keys, &drop->keys);
+    drop->heap.swap(db->heap);
+    drop->member_heap.swap(db->member_heap);
+    // the indexes are kept, but emptied
+    for (FTIndex* &idx : db->indexes) {
+        FTIndex* fresh = ft_new(idx->name, idx->prefix);
+        for (FTField* field : idx->fields) {
+            ft_add_field(fresh, field->name, field->type);
+        }
+        drop->indexes.push_back(idx);
+        idx = fresh;
+    }
+
+    // the reader threads may still be on the entries
+    bool readers = db->keys.ebr && !g_data.readers.empty();
+    if (readers) {
+        ebr_retire(&g_data.ebr, drop, 0, async ? &db_drop_start : &db_drop_now);
+    } else if (async) {
+        db_drop_start(drop, 0);
+    } else {
+        db_drop_now(drop, 0);
+    }
+}
+
+static bool expect_async(std::vector<std::string> &cmd, size_t i, bool &async, Buffer &out) {
+    async = cmd.size() > i;
+    if (async && cmd[i] != "async") {
+        out_err(out, ERR_BAD_ARG, "expect `async`");
+        return false;
+    }
+    return true;
+}
+
+// flushdb [async] : remove all keys of the database
+static void do_flushdb(std::vector<std::string> &cmd, Buffer &out) {
+    bool async = false;
+    if (!expect_async(cmd, 1, async, out)) {
+        return;
+    }
+    db_flush(g_data.db, async);
+    return out_nil(out);
+}
+
+// flushall [async] : remove all keys of all databases
+static void do_flushall(std::vector<std::string> &cmd, Buffer &out) {
+    bool async = false;
+    if (!expect_async(cmd, 1, async, out)) {
+        return;
+    }
+    for (DB &db : g_data.dbs) {
+        db_flush(&db, async);
+    }
+    return out_nil(out);
+}
+
+// HOTUPGRADE : replace the running binary without dropping clients,
+// the new binary is only set on the command line, never by a client;
+// handed over: the listening socket, the clients with their buffers and
+// databases, the keys with their TTLs, the search indexes and the namespaces
+static void do_hotupgrade(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2) {
+        return out_err(out, ERR_BAD_ARG, "the binary is set by --upgrade-binary");
+    }
+    if (g_data.upgrade_fd >= 0) {
+        return out_err(out, ERR_BAD_ARG, "upgrade in progress");
+    }
+    if (g_data.snap_state != SNAP_IDLE) {
+        return out_err(out, ERR_BAD_ARG, "snapshot in progress");
+    }
+    if (!g_data.readers.empty()) {
+        return out_err(out, ERR_BAD_ARG, "not supported with reader threads");
+    }
+    std::vector<std::string> args = g_data.argv;
+    args[0] = g_data.upgrade_binary;
+
+    // the channel to hand the state over
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        msg_errno("socketpair() error");
+        return out_err(out, ERR_UNKNOWN, "socketpair() failed");
+    }
+    args.push_back("--upgrade-fd");
+    args.push_back(std::to_string(sv[1]));
+    // no allocations after fork() since there are other threads
+    std::vector<char*> cargs;
+    for (std::string &s : args) {
+        cargs.push_back((char*)s.c_str());
+    }
+    cargs.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        msg_errno("fork() error");
+        close(sv[0]);
+        close(sv[1]);
+        return out_err(out, ERR_UNKNOWN, "fork() failed");
+    }
+    if (pid == 0) {
+        // the child only keeps the channel, sockets are passed explicitly
+        close(sv[0]);
+        close(g_data.listen_fd);
+        for (Conn* conn : g_data.fd2conn) {
+            if (conn) {
+                close(conn->fd);
+            }
+        }
+        execv(cargs[0], cargs.data());
+        _exit(127);
+    }
+    close(sv[1]);
+    // the state is sent after this response is queued, see `upgrade_send()`
+    g_data.upgrade_fd = sv[0];
+    g_data.upgrade_pid = pid;
+    return out_int(out, pid);
+}
+
+static void do_request(Conn* conn, std::vector<std::string> &cmd, Buffer &out) {
+    g_data.db = &g_data.dbs[conn->db];
+    // a move may be into a database with namespaces
+    bool ns_any = !g_data.db->ns_list.empty() || cmd[0] == "move";
+    if (cmd.size() >= 2 && ns_any && !ns_admit(cmd, out)) {
+        return;
+    }
+    if (cmd.size() == 2 && cmd[0] == "get") {
+        return do_get(conn, cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "set") {
+        return do_set(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "del") {
+        return do_del(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
+        return do_expire(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
+        return do_ttl(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "keys") {
+        return do_keys(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "zadd") {
+        return do_zadd(cmd, out);
+    } else if ((cmd.size() == 4 || cmd.size() == 5) && cmd[0] == "zincrby") {
+        return do_zincrby(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
+        return do_zrem(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zremrangebyscore") {
+        return do_zremrangebyscore(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zcount") {
+        return do_zcount(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zsumrange") {
+        return do_zsumrange(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zavgrange") {
+        return do_zavgrange(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "zpopmin") {
+        return do_zpop(cmd, out, false);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "zpopmax") {
+        return do_zpop(cmd, out, true);
+    } else if (cmd.size() == 3 && cmd[0] == "bzpopmin") {
+        return do_bzpop(conn, cmd, out, false);
+    } else if (cmd.size() == 3 && cmd[0] == "bzpopmax") {
+        return do_bzpop(conn, cmd, out, true);
+    } else if (cmd.size() == 3 && cmd[0] == "zquantile") {
+        return do_zquantile(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "zrandmember") {
+        return do_zrandmember(cmd, out);
+    } else if ((cmd.size() == 4 || cmd.size() == 7) && cmd[0] == "zrangebylex") {
+        return do_zrangebylex(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zlexcount") {
+        return do_zlexcount(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zremrangebylex") {
+        return do_zremrangebylex(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zremrangebyrank") {
+        return do_zremrangebyrank(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "zmscore") {
+        return do_zmscore(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "zmrank") {
+        return do_zmrank(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
+        return do_zscore(cmd, out);
+    }  else if (cmd.size() == 6 && cmd[0] == "zquery") {
+        return do_zquery(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "vadd") {
+        return do_vadd(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "vrem") {
+        return do_vrem(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "vcard") {
+        return do_vcard(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "vsim") {
+        return do_vsim(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "hset") {
+        return do_hset(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "hget") {
+        return do_hget(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "hdel") {
+        return do_hdel(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "hgetall") {
+        return do_hgetall(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "hlen") {
+        return do_hlen(cmd, out);
+    } else if (cmd.size() >= 5 && cmd[0] == "ft.create") {
+        return do_ft_create(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "ft.dropindex") {
+        return do_ft_dropindex(cmd, out);
+    } else if ((cmd.size() == 3 || cmd.size() == 6) && cmd[0] == "ft.search") {
+        return do_ft_search(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "json.set") {
+        return do_json_set(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "json.get") {
+        return do_json_get(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "json.numincrby") {
+        return do_json_numincrby(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "json.arrappend") {
+        return do_json_arrappend(cmd, out);
+    } else if ((cmd.size() == 5 || cmd.size() == 6) && cmd[0] == "throttle") {
+        return do_throttle(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "cms.initbydim") {
+        return do_cms_init(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "cms.incrby") {
+        return do_cms_incrby(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "cms.query") {
+        return do_cms_query(cmd, out);
+    } else if ((cmd.size() == 3 || cmd.size() == 6) && cmd[0] == "topk.reserve") {
+        return do_topk_reserve(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "topk.add") {
+        return do_topk_add(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "topk.list") {
+        return do_topk_list(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "rename") {
+        return do_rename(cmd, out, false);
+    } else if (cmd.size() == 3 && cmd[0] == "renamenx") {
+        return do_rename(cmd, out, true);
+    } else if ((cmd.size() == 3 || cmd.size() == 4) && cmd[0] == "copy") {
+        return do_copy(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "dump") {
+        return do_dump(cmd, out);
+    } else if ((cmd.size() == 4 || cmd.size() == 5) && cmd[0] == "restore") {
+        return do_restore(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "move") {
+        return do_move(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "select") {
+        return do_select(conn, cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "dbsize") {
+        return do_dbsize(cmd, out);
+    } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "flushdb") {
+        return do_flushdb(cmd, out);
+    } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "flushall") {
+        return do_flushall(cmd, out);
+    } else if ((cmd.size() == 4 || cmd.size() == 5) && cmd[0] == "ns.set") {
+        return do_ns_set(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "ns.del") {
+        return do_ns_del(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "info") {
+        return do_info(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "bgsave") {
+        return do_bgsave(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "lastsave") {
+        return do_lastsave(cmd, out);
+    } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "hotupgrade") {
+        return do_hotupgrade(cmd, out);
+    } else {
+        return out_err(out, ERR_UNKNOWN, "unknown command.");
+    }
+}
+
+// GET from a reader thread, see `reader_main()`
+static void do_read_request(Reader* reader, std::vector<std::string> &cmd, Buffer &out);
+
+static void response_begin(Buffer &out, size_t *header) {
+    *header = out.size();   // message header position
+    buf_append_u32(out, 0); // reserve 4 bytes for the message length
+}
+
+static size_t response_size(Buffer &out, size_t header) {
+    return out.size() - header - 4;
+}
+
+static void response_end(Buffer &out, size_t header) {
+    size_t msg_size = response_size(out, header);
+    if (msg_size > k_max_msg) {
+        out.resize(header + 4);
+        out_err(out, ERR_TOO_BIG, "response too big.");
+        msg_size = response_size(out, header);
+    }
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(&out[header], &len, 4);
+}
+
+// process 1 request if there is enough data
+static bool try_one_request(Conn* conn) {
+    if (conn->blocked) {
+        return false;   // waiting for the previous request
+    }
+    // try to parse the protocol: message header
+    if (conn->incoming.size() < 4) {
+        return false; // not enough data, want more read
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+    if (len > k_max_msg) {
         msg("message too long");
         conn->want_close = true;
         return false; // want close
@@ -665,13 +4093,23 @@ static bool try_one_request(Conn* conn) {
 
     size_t header_pos = 0;
     response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
+    if (conn->reader) {
+        do_read_request(conn->reader, cmd, conn->outgoing);
+    } else {
+        do_request(conn, cmd, conn->outgoing);
+        ns_sync();
+    }
+    if (conn->blocked) {
+        // the response is generated later by `conn_unblock()`
+        conn->outgoing.resize(header_pos);
+    } else {
+        response_end(conn->outgoing, header_pos);
+    }
 
     // application logic done! remove the request message
     buf_consume(conn->incoming, 4 + len);
     // Q. Why not just empty the buffer? see the explanation of "pipelining"
-    return true; // success
+    return !conn->blocked; // success
 }
 
 // application callback when the socket is writable
@@ -699,52 +4137,656 @@ static void handle_write(Conn* conn) {
     }   // else: want write
 }
 
-// application callback when the socket is readable
-static void handle_read(Conn* conn) {
-    // read some data
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-    if (rv < 0 && errno == EAGAIN) {
-        return; // EAGAIN means actually not ready
+// application callback when the socket is readable
+static void handle_read(Conn* conn) {
+    // read some data
+    uint8_t buf[64 * 1024];
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EAGAIN) {
+        return; // EAGAIN means actually not ready
+    }
+
+    // handle IO error
+    if (rv < 0) {
+        msg_errno("read() error");
+        conn->want_close = true;
+        return; // want close
+    }
+    
+    // handle EOF
+    if (rv == 0) {
+        if (conn->incoming.size() == 0) {
+            msg("client closed");
+        } else {
+            msg("unexpected EOF");
+        }
+        conn->want_close = true;
+        return; // want close
+    }
+
+    // got some new data
+    buf_append(conn->incoming, buf, (size_t)rv);
+
+    // parse requests and generate responses
+    // try_one_request(conn); wrong!
+    while (try_one_request(conn)) {}
+    // Why calling this in a loop? See the explanation of "pipelining"
+
+    // update the readiness intention
+    if (conn->outgoing.size() > 0) {
+        conn->want_read = false;
+        conn->want_write = true;
+        // The socket is likely ready to write in a request-response protocol,
+        // try to write it without waiting for the next iteration
+        return handle_write(conn);
+    }   // else: want read
+}
+
+// run a callback in the event loop, called from any thread
+static void loop_post(void (*f)(void*), void* arg) {
+    Work w;
+    w.f = f;
+    w.arg = arg;
+    pthread_mutex_lock(&g_data.done_mu);
+    g_data.done.push_back(w);
+    pthread_mutex_unlock(&g_data.done_mu);
+    // a full pipe will wake up poll() anyway
+    uint8_t dummy = 0;
+    (void)!write(g_data.wake_fds[1], &dummy, 1);
+}
+
+struct AsyncWork {
+    void (*work)(void*) = NULL; // runs in the thread pool
+    void (*done)(void*) = NULL; // runs in the event loop
+    void* arg = NULL;
+};
+
+static void async_finish(void* arg) {
+    AsyncWork* aw = (AsyncWork*)arg;
+    aw->done(aw->arg);
+    g_data.async_pending--;
+    delete aw;
+}
+
+static void async_worker(void* arg) {
+    AsyncWork* aw = (AsyncWork*)arg;
+    aw->work(aw->arg);
+    loop_post(&async_finish, aw);
+}
+
+static void async_run(void (*work)(void*), void (*done)(void*), void* arg) {
+    AsyncWork* aw = new AsyncWork();
+    aw->work = work;
+    aw->done = done;
+    aw->arg = arg;
+    g_data.async_pending++;
+    thread_pool_queue(&g_data.thread_pool, &async_worker, aw);
+}
+
+// run the callbacks posted by other threads
+static void process_async() {
+    uint8_t buf[256];
+    while (read(g_data.wake_fds[0], buf, sizeof(buf)) > 0) {}
+
+    std::vector<Work> done;
+    pthread_mutex_lock(&g_data.done_mu);
+    done.swap(g_data.done);
+    pthread_mutex_unlock(&g_data.done_mu);
+    for (Work &w : done) {
+        w.f(w.arg);
+    }
+}
+
+// wait for all async work to finish
+static void async_drain() {
+    while (g_data.async_pending > 0) {
+        struct pollfd pfd = {g_data.wake_fds[0], POLLIN, 0};
+        (void)poll(&pfd, 1, -1);
+        process_async();
+    }
+}
+
+// resume a blocked connection, its response is already in `outgoing`
+static void conn_unblock(Conn* conn) {
+    conn->blocked = false;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    // the pipelined requests
+    while (try_one_request(conn)) {}
+    if (conn->want_close) {
+        return conn_destroy(conn);
+    }
+    if (conn->outgoing.size() > 0) {
+        conn->want_read = false;
+        conn->want_write = true;
+        handle_write(conn);
+    }
+}
+
+// a GET of a value in the file
+// unblock the clients replied by `zset_wakeup()`
+static void process_woken() {
+    while (!g_data.woken.empty()) {
+        std::vector<Conn*> woken;
+        woken.swap(g_data.woken);
+        for (Conn* conn : woken) {
+            conn->woken = false;
+            conn_unblock(conn);
+        }
+    }
+}
+
+// BZPOPMIN/BZPOPMAX timed out, reply nil
+static void bzpop_timeout(Conn* conn) {
+    BlockKey* bk = conn->block_key;
+    bzpop_unregister(conn);
+    block_key_release(bk);
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    out_nil(conn->outgoing);
+    response_end(conn->outgoing, header_pos);
+    conn_unblock(conn);
+}
+
+static void conn_cancel_bzpop(Conn* conn) {
+    if (BlockKey* bk = conn->block_key) {
+        bzpop_unregister(conn);
+        block_key_release(bk);
+    }
+    if (conn->woken) {
+        std::vector<Conn*> &woken = g_data.woken;
+        for (size_t i = 0; i < woken.size(); i++) {
+            if (woken[i] == conn) {
+                woken.erase(woken.begin() + i);
+                break;
+            }
+        }
+    }
+}
+
+struct SpillRead {
+    Conn* conn = NULL;      // NULL if the client is gone
+    SpillFile* file = NULL;
+    uint64_t off = 0;
+    uint32_t len = 0;
+    uint32_t db = 0;        // for bringing the value back into memory
+    std::string key;
+    std::string val;
+    bool ok = false;
+};
+
+static void spill_read_work(void* arg) {
+    SpillRead* rd = (SpillRead*)arg;
+    rd->ok = spill_read(rd->file, rd->off, rd->len, rd->val);
+}
+
+// find the key again after the file I/O
+static Entry* spill_lookup(uint32_t db, std::string &key_str) {
+    LookupKey key;
+    key.key.swap(key_str);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.dbs[db].keys, &key.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+static void spill_read_done(void* arg) {
+    SpillRead* rd = (SpillRead*)arg;
+    SpillFile* file = rd->file;
+    // the value is hot again, unless it was changed in the meantime
+    if (rd->ok) {
+        Entry* ent = spill_lookup(rd->db, rd->key);
+        if (ent && ent->spill == file && ent->spill_off == rd->off) {
+            entry_drop_spill(ent);
+            ent->str = rd->val;
+        }
+    }
+    if (--file->refs == 0 && file->retired) {
+        spill_close(file);
+    }
+    // reply to the blocked client
+    if (Conn* conn = rd->conn) {
+        conn->spill_read = NULL;
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        if (rd->ok) {
+            out_str(conn->outgoing, rd->val.data(), rd->val.size());
+        } else {
+            out_err(conn->outgoing, ERR_UNKNOWN, "spill read error");
+        }
+        response_end(conn->outgoing, header_pos);
+        conn_unblock(conn);
+    }
+    delete rd;
+}
+
+static void spill_read_async(Conn* conn, Entry* ent) {
+    SpillRead* rd = new SpillRead();
+    rd->conn = conn;
+    rd->file = ent->spill;
+    rd->off = ent->spill_off;
+    rd->len = ent->spill_len;
+    rd->db = g_data.db->id;
+    rd->key = ent->key;
+    rd->file->refs++;
+    conn->spill_read = rd;
+    conn_block(conn);
+    async_run(&spill_read_work, &spill_read_done, rd);
+}
+
+static void conn_cancel_spill_read(Conn* conn) {
+    if (conn->spill_read) {
+        conn->spill_read->conn = NULL;
+    }
+}
+
+const uint64_t k_spill_interval_ms = 100;
+const size_t k_spill_scan_slots = 4096;
+const size_t k_spill_min_size = 64;     // not worth it for small values
+const size_t k_compact_scan_slots = 256;
+const uint64_t k_compact_min_size = 1 << 20;
+
+const size_t k_spill_batch_bytes = 4 << 20;
+
+// values moved to a file by the thread pool, one batch at a time
+struct SpillItem {
+    uint32_t db = 0;
+    std::string key;
+    std::string val;
+    uint64_t from_off = 0;  // compaction: the value in the old file
+    uint64_t off = 0;       // reserved in the new file
+    uint32_t len = 0;
+    bool ok = false;
+};
+
+struct SpillJob {
+    SpillFile* from = NULL; // compaction: the old file
+    SpillFile* to = NULL;
+    std::vector<SpillItem> items;
+    size_t bytes = 0;
+    uint64_t now_ms = 0;
+};
+
+static void spill_job_add(SpillJob* job, Entry* ent, uint32_t db) {
+    SpillItem item;
+    item.db = db;
+    item.key = ent->key;
+    if (job->from) {
+        item.from_off = ent->spill_off;
+        item.len = ent->spill_len;
+    } else {
+        item.val = ent->str;    // the value stays readable until it's written
+        item.len = (uint32_t)ent->str.size();
+    }
+    item.off = spill_reserve(job->to, item.len);
+    job->bytes += item.len;
+    job->items.push_back(std::move(item));
+}
+
+// move a cold value to the file
+static void cb_spill(HNode* node, void* arg) {
+    SpillJob* job = (SpillJob*)arg;
+    Entry* ent = container_of(node, Entry, node);
+    if (ent->type != T_STR || ent->spill || ent->str.size() < k_spill_min_size) {
+        return;
+    }
+    if (entry_atime(ent) + g_data.spill_after_ms > job->now_ms) {
+        return;
+    }
+    if (job->bytes < k_spill_batch_bytes) {
+        spill_job_add(job, ent, g_data.spill_db);
+    }
+}
+
+// move a live value from the old file to the new file
+static void cb_compact(HNode* node, void* arg) {
+    SpillJob* job = (SpillJob*)arg;
+    Entry* ent = container_of(node, Entry, node);
+    if (ent->spill == job->from && job->bytes < k_spill_batch_bytes) {
+        spill_job_add(job, ent, g_data.spill_db);
+    }
+}
+
+static void spill_job_work(void* arg) {
+    SpillJob* job = (SpillJob*)arg;
+    for (SpillItem &item : job->items) {
+        if (job->from && !spill_read(job->from, item.from_off, item.len, item.val)) {
+            msg_errno("spill_read() error");
+            item.val.clear();
+            continue;   // retried in the next pass
+        }
+        item.ok = spill_write(job->to, item.off, item.val.data(), item.len);
+    }
+}
+
+// point the keys to the written values, unless they were changed meanwhile,
+// in which case the written values are unreferenced garbage
+static void spill_job_done(void* arg) {
+    SpillJob* job = (SpillJob*)arg;
+    for (SpillItem &item : job->items) {
+        Entry* ent = spill_lookup(item.db, item.key);
+        if (!ent) {
+            continue;
+        }
+        if (job->from) {
+            if (ent->spill != job->from || ent->spill_off != item.from_off) {
+                continue;
+            }
+            if (!item.ok && item.val.empty()) {
+                continue;   // the read failed
+            }
+            entry_drop_spill(ent);
+            if (!item.ok) {
+                ent->str.swap(item.val);    // back to memory
+                continue;
+            }
+        } else {
+            bool cold = entry_atime(ent) + g_data.spill_after_ms <= job->now_ms;
+            if (!item.ok || !cold || ent->type != T_STR || ent->spill || ent->str != item.val) {
+                continue;
+            }
+            std::string().swap(ent->str);   // release the memory
+        }
+        if (item.ok) {
+            ent->spill = job->to;
+            ent->spill_off = item.off;
+            ent->spill_len = item.len;
+            spill_keep(job->to, item.len);
+        }
+    }
+    if (job->from && --job->from->refs == 0 && job->from->retired) {
+        spill_close(job->from);
+    }
+    g_data.spill_busy = false;
+    delete job;
+}
+
+static SpillFile* spill_new_file() {
+    // the pid avoids clobbering the files of the old process on hot upgrade
+    std::string path = g_data.spill_path + "." + std::to_string(getpid())
+        + "." + std::to_string(g_data.spill_gen++);
+    SpillFile* file = spill_open(path);
+    if (!file) {
+        die("spill_open()");
+    }
+    return file;
+}
+
+static void spill_job_start(SpillJob* job) {
+    if (job->items.empty()) {
+        delete job;
+        return;
+    }
+    if (job->from) {
+        job->from->refs++;
+    }
+    g_data.spill_busy = true;
+    async_run(&spill_job_work, &spill_job_done, job);
+}
+
+// incremental work for the file: spilling cold values and compaction,
+// the file I/O is done by the thread pool
+static void spill_cron() {
+    uint64_t now_ms = get_monotonic_msec();
+    if (!g_data.spill || g_data.spill_busy || now_ms < g_data.spill_next_ms) {
+        return;
+    }
+
+    uint32_t &db = g_data.spill_db;
+    SpillJob* job = new SpillJob();
+    job->from = g_data.spill_old;
+    job->to = g_data.spill;
+    job->now_ms = now_ms;
+    if (g_data.spill_old) {
+        // compaction, rescan if something was missed due to rehashing
+        g_data.spill_cursor = hm_scan(&g_data.dbs[db].keys, g_data.spill_cursor,
+            k_compact_scan_slots, &cb_compact, job);
+        if (g_data.spill_cursor == 0) {
+            db = (db + 1) % k_num_dbs;
+        }
+        if (g_data.spill_cursor == 0 && db == 0 && g_data.spill_old->live == 0) {
+            SpillFile* old = g_data.spill_old;
+            g_data.spill_old = NULL;
+            old->retired = true;
+            if (old->refs == 0) {
+                spill_close(old);
+            }
+        }
+        spill_job_start(job);
+        return;     // continue in the next iteration without waiting
+    }
+
+    // start the compaction when most of the file is garbage
+    SpillFile* file = g_data.spill;
+    if (file->size >= k_compact_min_size && file->live < file->size / 2) {
+        g_data.spill_old = file;
+        g_data.spill = spill_new_file();
+        g_data.spill_db = 0;
+        g_data.spill_cursor = 0;
+        delete job;
+        return;
+    }
+
+    g_data.spill_cursor = hm_scan(&g_data.dbs[db].keys, g_data.spill_cursor,
+        k_spill_scan_slots, &cb_spill, job);
+    if (g_data.spill_cursor == 0) {
+        db = (db + 1) % k_num_dbs;
+    }
+    g_data.spill_next_ms = now_ms + k_spill_interval_ms;
+    spill_job_start(job);
+}
+
+// resident memory, from /proc
+static size_t get_rss_bytes() {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// memory handed out by malloc()
+static size_t get_used_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+const uint64_t k_defrag_check_ms = 1000;
+const uint64_t k_defrag_interval_ms = 10;
+const uint64_t k_defrag_budget_us = 1000;       // at most 10% of the CPU
+const double k_defrag_min_ratio = 1.4;          // RSS / used memory
+const size_t k_defrag_min_waste = 64 << 20;
+const size_t k_defrag_inline_zset = 128;        // small zsets are done at once
+const size_t k_defrag_zset_slots = 64;
+const size_t k_defrag_max_spares = 4096;
+
+enum {
+    DEFRAG_IDLE = 0,
+    DEFRAG_CENSUS = 1,  // building the page map
+    DEFRAG_MOVE = 2,    // moving data out of sparse pages
+};
+
+static void defrag_str_census(const std::string &str) {
+    if (str.capacity() > 15) {  // not inline
+        defrag_census_add(str.data());
+    }
+}
+
+static void cb_defrag_census(HNode* node, void*) {
+    Entry* ent = container_of(node, Entry, node);
+    defrag_census_add(ent);
+    defrag_str_census(ent->key);
+    defrag_str_census(ent->str);
+    if (ent->type == T_ZSET) {
+        if (hm_size(&ent->zset->hmap) <= k_defrag_inline_zset) {
+            size_t cursor = 0;
+            do {
+                cursor = zset_defrag_census(ent->zset, cursor, k_defrag_inline_zset);
+            } while (cursor != 0);
+        } else {
+            g_data.defrag_zsets.push_back(ent);
+        }
+    }
+}
+
+static void defrag_str(std::string &str) {
+    if (str.capacity() <= 15 || !defrag_sparse(str.data())) {
+        return;
+    }
+    std::string fresh = str;
+    if (defrag_better(str.data(), fresh.data())) {
+        str.swap(fresh);
+    } else {
+        g_data.defrag_spare_strs.push_back(std::move(fresh));
+    }
+}
+
+// move an entry on a sparse page, and fix the pointers to it
+static HNode* entry_relocate(HNode* node, void*) {
+    Entry* ent = container_of(node, Entry, node);
+    defrag_str(ent->key);
+    defrag_str(ent->str);
+
+    if (defrag_sparse(ent)) {
+        Entry* fresh = new Entry();
+        if (defrag_better(ent, fresh)) {
+            fresh->node = ent->node;
+            fresh->key.swap(ent->key);
+            fresh->str.swap(ent->str);
+            entry_move_value(fresh, ent);
+            delete ent;
+            ent = fresh;
+        } else {
+            // keep it allocated so that the next malloc() returns another chunk
+            g_data.defrag_spare_ents.push_back(fresh);
+        }
+    }
+
+    // then the zset nodes
+    if (ent->type == T_ZSET) {
+        if (hm_size(&ent->zset->hmap) <= k_defrag_inline_zset) {
+            size_t cursor = 0;
+            do {
+                cursor = zset_defrag(ent->zset, cursor, k_defrag_inline_zset,
+                    g_data.defrag_spare_nodes);
+            } while (cursor != 0);
+        } else {
+            g_data.defrag_zsets.push_back(ent);
+        }
+    }
+    return &ent->node;  // the hashtable link is updated by the caller
+}
+
+static void defrag_release_spares() {
+    for (Entry* ent : g_data.defrag_spare_ents) {
+        delete ent;
+    }
+    for (void* p : g_data.defrag_spare_nodes) {
+        free(p);
+    }
+    g_data.defrag_spare_ents.clear();
+    g_data.defrag_spare_strs.clear();
+    g_data.defrag_spare_nodes.clear();
+}
+
+static size_t defrag_nspares() {
+    return g_data.defrag_spare_ents.size() + g_data.defrag_spare_strs.size()
+        + g_data.defrag_spare_nodes.size();
+}
+
+// the entry is being deleted
+static void defrag_forget(Entry* ent) {
+    std::vector<Entry*> &zsets = g_data.defrag_zsets;
+    for (size_t i = 0; i < zsets.size(); i++) {
+        if (zsets[i] == ent) {
+            zsets.erase(zsets.begin() + i);
+            if (i == 0) {
+                g_data.defrag_zset_cursor = 0;
+            }
+            break;
+        }
     }
+}
 
-    // handle IO error
-    if (rv < 0) {
-        msg_errno("read() error");
-        conn->want_close = true;
-        return; // want close
-    }
-    
-    // handle EOF
-    if (rv == 0) {
-        if (conn->incoming.size() == 0) {
-            msg("client closed");
-        } else {
-            msg("unexpected EOF");
+// one step of the census or the move, returns false when the phase is done
+static bool defrag_step() {
+    std::vector<Entry*> &zsets = g_data.defrag_zsets;
+    bool census = g_data.defrag_state == DEFRAG_CENSUS;
+    if (!zsets.empty()) {
+        ZSet* zset = zsets[0]->zset;
+        g_data.defrag_zset_cursor = census
+            ? zset_defrag_census(zset, g_data.defrag_zset_cursor, k_defrag_zset_slots)
+            : zset_defrag(zset, g_data.defrag_zset_cursor, k_defrag_zset_slots,
+                g_data.defrag_spare_nodes);
+        if (g_data.defrag_zset_cursor == 0) {
+            zsets.erase(zsets.begin());
         }
-        conn->want_close = true;
-        return; // want close
+        return true;
     }
+    // 1 slot at a time, the big zsets found are processed first
+    uint32_t &db = g_data.defrag_db;
+    HMap* keys = &g_data.dbs[db].keys;
+    g_data.defrag_cursor = census
+        ? hm_scan(keys, g_data.defrag_cursor, 1, &cb_defrag_census, NULL)
+        : hm_relocate(keys, g_data.defrag_cursor, 1, &entry_relocate, NULL);
+    if (g_data.defrag_cursor == 0) {
+        db = (db + 1) % k_num_dbs;
+    }
+    return g_data.defrag_cursor != 0 || db != 0 || !zsets.empty();
+}
 
-    // got some new data
-    buf_append(conn->incoming, buf, (size_t)rv);
+// move data out of sparsely used pages in time slices when the RSS is
+// much larger than the used memory, then return the free pages to the kernel
+static void defrag_cron() {
+    uint64_t now_ms = get_monotonic_msec();
+    if (!g_data.defrag_enabled || now_ms < g_data.defrag_next_ms) {
+        return;
+    }
 
-    // parse requests and generate responses
-    // try_one_request(conn); wrong!
-    while (try_one_request(conn)) {}
-    // Why calling this in a loop? See the explanation of "pipelining"
+    if (g_data.defrag_state == DEFRAG_IDLE) {
+        g_data.defrag_next_ms = now_ms + k_defrag_check_ms;
+        size_t rss = get_rss_bytes();
+        size_t used = get_used_bytes();
+        if (rss > used * k_defrag_min_ratio && rss - used >= k_defrag_min_waste) {
+            fprintf(stderr, "defrag started, rss: %zu, used: %zu\n", rss, used);
+            defrag_census_reset();
+            g_data.defrag_state = DEFRAG_CENSUS;
+            g_data.defrag_db = 0;
+            g_data.defrag_cursor = 0;
+        }
+        return;
+    }
 
-    // update the readiness intention
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
-        // The socket is likely ready to write in a request-response protocol,
-        // try to write it without waiting for the next iteration
-        return handle_write(conn);
-    }   // else: want read
+    uint64_t deadline = get_monotonic_usec() + k_defrag_budget_us;
+    while (get_monotonic_usec() < deadline) {
+        if (defrag_nspares() > k_defrag_max_spares) {
+            defrag_release_spares();
+        }
+        if (defrag_step()) {
+            continue;
+        }
+        if (g_data.defrag_state == DEFRAG_CENSUS) {
+            g_data.defrag_state = DEFRAG_MOVE;
+            continue;
+        }
+        // madvise(MADV_DONTNEED) on the free pages
+        defrag_release_spares();
+        malloc_trim(0);
+        fprintf(stderr, "defrag done, rss: %zu, used: %zu\n",
+            get_rss_bytes(), get_used_bytes());
+        g_data.defrag_state = DEFRAG_IDLE;
+        g_data.defrag_next_ms = now_ms + k_defrag_check_ms;
+        return;
+    }
+    g_data.defrag_next_ms = now_ms + k_defrag_interval_ms;
 }
 
 const uint64_t k_idle_timeout_ms = 5 * 1000;
+const uint64_t k_reclaim_interval_ms = 10;
 
 static uint32_t next_timer_ms() {
     uint64_t now_ms = get_monotonic_msec();
@@ -754,9 +4796,39 @@ static uint32_t next_timer_ms() {
         Conn* conn = container_of(g_data.idle_list.next, Conn, idle_node);
         next_ms = conn->last_active_ms + k_idle_timeout_ms;
     }
-    // TTL timers using a heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-        next_ms = g_data.heap[0].val;
+    for (DB &db : g_data.dbs) {
+        // TTL timers using a heap
+        if (!db.heap.empty() && db.heap[0].val < next_ms) {
+            next_ms = db.heap[0].val;
+        }
+        // zset member TTLs
+        if (!db.member_heap.empty() && db.member_heap[0].val < next_ms) {
+            next_ms = db.member_heap[0].val;
+        }
+        // namespace ops/sec
+        if (!db.ns_list.empty() && g_data.ns_next_ms < next_ms) {
+            next_ms = g_data.ns_next_ms;
+        }
+    }
+    // BZPOPMIN/BZPOPMAX timeouts
+    if (!g_data.block_heap.empty() && g_data.block_heap[0].val < next_ms) {
+        next_ms = g_data.block_heap[0].val;
+    }
+    // tiered storage
+    if (g_data.spill && !g_data.spill_busy && g_data.spill_next_ms < next_ms) {
+        next_ms = g_data.spill_next_ms;
+    }
+    // active defragmentation
+    if (g_data.defrag_enabled && g_data.defrag_next_ms < next_ms) {
+        next_ms = g_data.defrag_next_ms;
+    }
+    // snapshot in progress, continue without waiting
+    if (g_data.snap_state == SNAP_WALK) {
+        next_ms = now_ms;
+    }
+    // memory waiting for the readers
+    if (!g_data.ebr.retired.empty() && now_ms + k_reclaim_interval_ms < next_ms) {
+        next_ms = now_ms + k_reclaim_interval_ms;
     }
     // timeout val
     if (next_ms == (uint64_t)-1) {
@@ -768,10 +4840,6 @@ static uint32_t next_timer_ms() {
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same (HNode* node, HNode* key) {
-    return node == key;
-}
-
 static void process_timers() {
     uint64_t now_ms = get_monotonic_msec();
     // idle timers using a linked list
@@ -786,26 +4854,420 @@ static void process_timers() {
         conn_destroy(conn);
     }
     // TTL timers using a heap
-    const size_t k_max_works = 2000;
     size_t nworks = 0;
-    const std::vector<HeapItem> &heap = g_data.heap;
-    while (!heap.empty() && heap[0].val < now_ms) {
-        Entry* ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
-        // fprintf(stderr, "key expired: %s\n", ent->key.c_str());
-        // delete the key
-        entry_del(ent);
-        if (nworks++ >= k_max_works) {
-            // don't stall the server if too many keys are expiring at once
-            break;
+    for (DB &db : g_data.dbs) {
+        g_data.db = &db;
+        const HeapVec &heap = db.heap;
+        while (!heap.empty() && heap[0].val < now_ms && nworks < k_max_works) {
+            Entry* ent = container_of(heap[0].ref, TTLSlot, heap_idx)->owner;
+            hm_delete(&db.keys, &ent->node, &hnode_same);
+            // fprintf(stderr, "key expired: %s\n", ent->key.c_str());
+            // delete the key
+            entry_del(ent);
+            nworks++;
+        }
+        // zset member TTLs
+        const HeapVec &member_heap = db.member_heap;
+        while (!member_heap.empty() && member_heap[0].val <= now_ms && nworks < k_max_works) {
+            Entry* ent = container_of(member_heap[0].ref, TTLSlot, heap_idx)->owner;
+            bool gone = false;
+            nworks += zset_purge(ent, now_ms, k_max_works - nworks, gone);
+            if (!gone && zset_next_expire(ent->zset) > now_ms) {
+                zset_sync_ttl(ent);     // the item was earlier than the actual one
+            }
         }
     }
+    ns_sync();
+    ns_cron(now_ms);
+    // BZPOPMIN/BZPOPMAX timeouts
+    while (!g_data.block_heap.empty() && g_data.block_heap[0].val <= now_ms) {
+        bzpop_timeout(container_of(g_data.block_heap[0].ref, Conn, block_heap_idx));
+    }
+    // tiered storage
+    spill_cron();
+    // active defragmentation
+    defrag_cron();
+    // snapshot
+    snap_cron();
+    // free what is no longer seen by the readers
+    ebr_reclaim(&g_data.ebr);
 }
 
-int main() {
-    // initialisation
-    dlist_init(&g_data.idle_list);
+// hot upgrade records, each is | kind | len | payload |
+// the kind byte may carry a file descriptor
+enum {
+    UP_LISTEN = 1,  // the listening socket
+    UP_CONN = 2,    // a client socket, payload: | len | incoming | len | outgoing | db |
+    UP_KEYS = 3,    // a batch of `entry_encode()` data
+    UP_END = 4,     // no more records
+    UP_DB = 5,      // the following keys are in this database, payload: | db |
+    // an index of this database, rebuilt from its keys, which are sent first,
+    // payload: | len | name | len | prefix | n | (len | field | type)... |
+    UP_INDEX = 6,
+    // a namespace of this database, the keys are accounted again,
+    // payload: | len | prefix | max_keys | max_bytes | evict | ops | evicted | rejected |
+    UP_NS = 7,
+};
+
+static int32_t read_full(int fd, uint8_t* buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return -1;  // error, or unexpected EOF
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_all(int fd, const uint8_t* buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = send(fd, buf, n, MSG_NOSIGNAL);
+        if (rv <= 0) {
+            return -1;  // error
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t send_record(int sock, uint8_t kind, int fd, const Buffer &payload) {
+    // the kind byte, with the fd as ancillary data
+    struct iovec iov = {&kind, 1};
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0) {
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) != 1) {
+        return -1;
+    }
+    // the payload
+    uint32_t len = (uint32_t)payload.size();
+    if (write_all(sock, (const uint8_t*)&len, 4)) {
+        return -1;
+    }
+    return write_all(sock, payload.data(), payload.size());
+}
+
+static int32_t recv_record(int sock, uint8_t &kind, int &fd, Buffer &payload) {
+    struct iovec iov = {&kind, 1};
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    if (recvmsg(sock, &mh, 0) != 1) {
+        return -1;
+    }
+    fd = -1;
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    }
+
+    uint32_t len = 0;
+    if (read_full(sock, (uint8_t*)&len, 4)) {
+        return -1;
+    }
+    payload.resize(len);
+    return read_full(sock, payload.data(), len);
+}
+
+const size_t k_upgrade_batch = 1 << 20;
+// the event loop is stopped while the state is sent, so the whole transfer
+// is bounded by this, then the upgrade is abandoned and this process goes on
+const uint64_t k_upgrade_timeout_ms = 10 * 1000;
+
+struct UpgradeCtx {
+    int sock = -1;
+    int32_t err = 0;
+    uint64_t deadline_ms = 0;
+    Buffer keys;
+};
+
+// limit the next blocking send or receive to the time left
+static bool upgrade_time_left(UpgradeCtx &ctx) {
+    uint64_t now_ms = get_monotonic_msec();
+    if (now_ms >= ctx.deadline_ms) {
+        msg("hot upgrade timed out");
+        return false;
+    }
+    uint64_t left_ms = ctx.deadline_ms - now_ms;
+    struct timeval tv = {(time_t)(left_ms / 1000), (suseconds_t)(left_ms % 1000 * 1000)};
+    return 0 == setsockopt(ctx.sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))
+        && 0 == setsockopt(ctx.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int32_t upgrade_record(UpgradeCtx &ctx, uint8_t kind, int fd, const Buffer &payload) {
+    return upgrade_time_left(ctx) ? send_record(ctx.sock, kind, fd, payload) : -1;
+}
+
+static bool cb_upgrade_key(HNode* node, void* arg) {
+    UpgradeCtx &ctx = *(UpgradeCtx*)arg;
+    if (!entry_encode(ctx.keys, container_of(node, Entry, node))) {
+        ctx.err = -1;
+    } else if (ctx.keys.size() >= k_upgrade_batch) {
+        ctx.err = upgrade_record(ctx, UP_KEYS, -1, ctx.keys);
+        ctx.keys.clear();
+    }
+    return ctx.err == 0;
+}
+
+static void buf_append_str(Buffer &buf, const std::string &str) {
+    buf_append_u32(buf, (uint32_t)str.size());
+    buf_append(buf, (const uint8_t*)str.data(), str.size());
+}
+
+static Buffer upgrade_index(FTIndex* idx) {
+    Buffer data;
+    buf_append_str(data, idx->name);
+    buf_append_str(data, idx->prefix);
+    buf_append_u32(data, (uint32_t)idx->fields.size());
+    for (FTField* field : idx->fields) {
+        buf_append_str(data, field->name);
+        buf_append_u32(data, field->type);
+    }
+    return data;
+}
+
+static Buffer upgrade_ns(Namespace* ns) {
+    Buffer data;
+    buf_append_str(data, ns->prefix);
+    buf_append_i64(data, (int64_t)ns->max_keys);
+    buf_append_i64(data, (int64_t)ns->max_bytes);
+    buf_append_u8(data, ns->evict ? 1 : 0);
+    buf_append_i64(data, (int64_t)ns->ops);
+    buf_append_i64(data, (int64_t)ns->evicted);
+    buf_append_i64(data, (int64_t)ns->rejected);
+    return data;
+}
+
+// send the sockets and the dataset to the new process, then exit
+static void upgrade_send() {
+    // the blocked clients must be replied first
+    async_drain();
+    for (Conn* conn : g_data.fd2conn) {
+        if (conn && conn->block_key) {
+            bzpop_timeout(conn);
+        }
+    }
+    process_woken();
+
+    UpgradeCtx ctx;
+    ctx.sock = g_data.upgrade_fd;
+    ctx.deadline_ms = get_monotonic_msec() + k_upgrade_timeout_ms;
+    g_data.upgrade_fd = -1;
+
+    ctx.err = upgrade_record(ctx, UP_LISTEN, g_data.listen_fd, Buffer());
+    for (Conn* conn : g_data.fd2conn) {
+        if (!conn || ctx.err) {
+            continue;
+        }
+        Buffer state;
+        buf_append_u32(state, (uint32_t)conn->incoming.size());
+        buf_append(state, conn->incoming.data(), conn->incoming.size());
+        buf_append_u32(state, (uint32_t)conn->outgoing.size());
+        buf_append(state, conn->outgoing.data(), conn->outgoing.size());
+        buf_append_u32(state, conn->db);
+        ctx.err = upgrade_record(ctx, UP_CONN, conn->fd, state);
+    }
+    for (DB &db : g_data.dbs) {
+        if (ctx.err || (hm_size(&db.keys) == 0 && db.indexes.empty() && db.ns_list.empty())) {
+            continue;
+        }
+        Buffer id;
+        buf_append_u32(id, db.id);
+        ctx.err = upgrade_record(ctx, UP_DB, -1, id);
+        g_data.db = &db;
+        if (!ctx.err) {
+            hm_foreach(&db.keys, &cb_upgrade_key, (void*)&ctx);
+        }
+        if (!ctx.err && !ctx.keys.empty()) {
+            ctx.err = upgrade_record(ctx, UP_KEYS, -1, ctx.keys);
+            ctx.keys.clear();
+        }
+        for (size_t i = 0; !ctx.err && i < db.indexes.size(); i++) {
+            ctx.err = upgrade_record(ctx, UP_INDEX, -1, upgrade_index(db.indexes[i]));
+        }
+        for (size_t i = 0; !ctx.err && i < db.ns_list.size(); i++) {
+            ctx.err = upgrade_record(ctx, UP_NS, -1, upgrade_ns(db.ns_list[i]));
+        }
+    }
+    if (!ctx.err) {
+        ctx.err = upgrade_record(ctx, UP_END, -1, Buffer());
+    }
+
+    // wait for the new process to load everything, then let it take over;
+    // it doesn't touch the sockets until then, so it can still be killed
+    uint8_t ack = 0;
+    if (!ctx.err && upgrade_time_left(ctx) && read_full(ctx.sock, &ack, 1) == 0
+        && send(ctx.sock, &ack, 1, MSG_NOSIGNAL) == 1)
+    {
+        fprintf(stderr, "upgraded to pid %d\n", (int)g_data.upgrade_pid);
+        // the values in the files were copied, the file I/O in the thread
+        // pool may still be running, so the files are only unlinked
+        if (g_data.spill_old) {
+            unlink(g_data.spill_old->path.c_str());
+        }
+        if (g_data.spill) {
+            unlink(g_data.spill->path.c_str());
+        }
+        exit(0);
+    }
+
+    // keep serving, the new process must not touch the shared sockets
+    msg("hot upgrade failed");
+    close(ctx.sock);
+    kill(g_data.upgrade_pid, SIGKILL);
+    waitpid(g_data.upgrade_pid, NULL, 0);
+    g_data.upgrade_pid = -1;
+}
+
+static bool read_lstr(const uint8_t* &cur, const uint8_t* end, std::string &out) {
+    uint32_t len = 0;
+    return read_u32(cur, end, len) && read_str(cur, end, len, out);
+}
+
+static void upgrade_recv_index(const uint8_t* cur, const uint8_t* end) {
+    std::string name, prefix;
+    uint32_t n = 0;
+    if (!read_lstr(cur, end, name) || !read_lstr(cur, end, prefix)
+        || !read_u32(cur, end, n) || index_get(name))
+    {
+        die("hot upgrade: bad index");
+    }
+    FTIndex* idx = ft_new(name, prefix);
+    for (uint32_t i = 0; i < n; i++) {
+        std::string field;
+        uint32_t type = 0;
+        if (!read_lstr(cur, end, field) || !read_u32(cur, end, type)
+            || (type != FT_NUMERIC && type != FT_TAG))
+        {
+            die("hot upgrade: bad index");
+        }
+        ft_add_field(idx, field, type);
+    }
+    if (cur != end) {
+        die("hot upgrade: bad index");
+    }
+    index_build(idx);
+}
+
+static void upgrade_recv_ns(const uint8_t* cur, const uint8_t* end) {
+    std::string prefix;
+    int64_t max_keys = 0, max_bytes = 0, ops = 0, evicted = 0, rejected = 0;
+    uint8_t evict = 0;
+    if (!read_lstr(cur, end, prefix) || !read_i64(cur, end, max_keys)
+        || !read_i64(cur, end, max_bytes) || !read_u8(cur, end, evict)
+        || !read_i64(cur, end, ops) || !read_i64(cur, end, evicted)
+        || !read_i64(cur, end, rejected) || cur != end
+        || !ns_prefix_ok(prefix) || ns_find(prefix))
+    {
+        die("hot upgrade: bad namespace");
+    }
+    Namespace* ns = ns_create(prefix);
+    ns->max_keys = (uint64_t)max_keys;
+    ns->max_bytes = (uint64_t)max_bytes;
+    ns->evict = evict != 0;
+    ns->ops = ns->ops_last = (uint64_t)ops;
+    ns->evicted = (uint64_t)evicted;
+    ns->rejected = (uint64_t)rejected;
+    ns_sync();
+}
+
+// receive the state from the old process
+static void upgrade_recv(int sock) {
+    Buffer payload;
+    while (true) {
+        uint8_t kind = 0;
+        int fd = -1;
+        if (recv_record(sock, kind, fd, payload)) {
+            die("hot upgrade: recv_record()");
+        }
+        const uint8_t* cur = payload.data();
+        const uint8_t* end = cur + payload.size();
+        if (kind == UP_LISTEN && fd >= 0) {
+            g_data.listen_fd = fd;
+        } else if (kind == UP_CONN && fd >= 0) {
+            Conn* conn = conn_new(fd);
+            uint32_t len = 0;
+            if (!read_u32(cur, end, len) || cur + len > end) {
+                die("hot upgrade: bad conn");
+            }
+            buf_append(conn->incoming, cur, len);
+            cur += len;
+            if (!read_u32(cur, end, len) || cur + len > end) {
+                die("hot upgrade: bad conn");
+            }
+            buf_append(conn->outgoing, cur, len);
+            cur += len;
+            // no database from older versions
+            if (cur != end && (!read_u32(cur, end, conn->db) || cur != end
+                || conn->db >= k_num_dbs))
+            {
+                die("hot upgrade: bad conn");
+            }
+            if (conn->outgoing.size() > 0) {
+                conn->want_read = false;
+                conn->want_write = true;
+            }
+        } else if (kind == UP_DB) {
+            uint32_t db = 0;
+            if (!read_u32(cur, end, db) || cur != end || db >= k_num_dbs) {
+                die("hot upgrade: bad db");
+            }
+            g_data.db = &g_data.dbs[db];
+        } else if (kind == UP_KEYS) {
+            while (cur < end) {
+                int64_t ttl_ms = -1;
+                Entry* ent = entry_decode(cur, end, ttl_ms);
+                if (!ent) {
+                    die("hot upgrade: bad key");
+                }
+                hm_insert(&g_data.db->keys, &ent->node);
+                entry_set_ttl(ent, ttl_ms);
+            }
+        } else if (kind == UP_INDEX) {
+            upgrade_recv_index(cur, end);
+        } else if (kind == UP_NS) {
+            upgrade_recv_ns(cur, end);
+        } else if (kind == UP_END) {
+            break;
+        } else {
+            die("hot upgrade: bad record");
+        }
+    }
+    if (g_data.listen_fd < 0) {
+        die("hot upgrade: no listening socket");
+    }
+
+    // the old process exits after its reply, or kills this one
+    uint8_t ack = 1;
+    if (write_all(sock, &ack, 1) || read_full(sock, &ack, 1)) {
+        die("hot upgrade: abandoned");
+    }
+    close(sock);
+    size_t nkeys = 0;
+    for (DB &db : g_data.dbs) {
+        nkeys += hm_size(&db.keys);
+    }
+    g_data.db = &g_data.dbs[0];
+    fprintf(stderr, "took over %zu keys\n", nkeys);
+}
 
+static int listen_on(uint16_t port) {
     // Create a listening socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -819,7 +5281,7 @@ int main() {
     // bind the socket to an address
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0);
     int rv = bind(fd, (const sockaddr*)&addr, sizeof(addr));
     if (rv < 0) {
@@ -834,6 +5296,200 @@ int main() {
     if (rv) {
         die("listen()");
     }
+    return fd;
+}
+
+// a reader thread runs its own event loop for the read-only connections,
+// the keyspace is shared with the main thread without locking
+struct Reader {
+    pthread_t thread;
+    EBRReader ebr;
+};
+
+static void do_read_request(Reader* reader, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() != 2 || cmd[0] != "get") {
+        return out_err(out, ERR_UNKNOWN, "read-only connection");
+    }
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+
+    ebr_enter(&g_data.ebr, &reader->ebr);
+    HNode* node = hm_lookup_rcu(&g_data.dbs[0].keys, &key.node, &entry_eq);
+    Entry* ent = node ? container_of(node, Entry, node) : NULL;
+    if (!ent) {
+        out_nil(out);
+    } else if (ent->type != T_STR) {
+        out_err(out, ERR_BAD_TYP, "not a string value");
+    } else {
+        out_str(out, ent->str.data(), ent->str.size());
+    }
+    ebr_leave(&reader->ebr);
+}
+
+static void* reader_main(void* arg) {
+    Reader* reader = (Reader*)arg;
+    std::vector<Conn*> conns;
+    std::vector<struct pollfd> poll_args;
+    while (true) {
+        // the listening socket is shared by all readers
+        poll_args.clear();
+        struct pollfd pfd = {g_data.read_fd, POLLIN, 0};
+        poll_args.push_back(pfd);
+        for (Conn* conn : conns) {
+            pfd = {conn->fd, POLLERR, 0};
+            if (conn->want_read) {
+                pfd.events |= POLLIN;
+            }
+            if (conn->want_write) {
+                pfd.events |= POLLOUT;
+            }
+            poll_args.push_back(pfd);
+        }
+
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            die("poll()");
+        }
+
+        if (poll_args[0].revents) {
+            int fd = accept(g_data.read_fd, NULL, NULL);
+            if (fd >= 0) {  // EAGAIN if taken by another reader
+                fd_set_nb(fd);
+                Conn* conn = new Conn();
+                conn->fd = fd;
+                conn->want_read = true;
+                conn->reader = reader;
+                conns.push_back(conn);
+            }
+        }
+
+        for (size_t i = 1; i < poll_args.size(); ++i) {
+            uint32_t ready = poll_args[i].revents;
+            Conn* conn = conns[i - 1];
+            if (ready & POLLIN) {
+                handle_read(conn);
+            }
+            if (ready & POLLOUT) {
+                handle_write(conn);
+            }
+            if (ready & POLLERR) {
+                conn->want_close = true;
+            }
+        }
+
+        // remove the closed connections
+        size_t keep = 0;
+        for (Conn* conn : conns) {
+            if (conn->want_close) {
+                close(conn->fd);
+                delete conn;
+            } else {
+                conns[keep++] = conn;
+            }
+        }
+        conns.resize(keep);
+    }
+    return NULL;
+}
+
+static void readers_start(uint16_t port, size_t n) {
+    g_data.read_fd = listen_on(port);
+    g_data.dbs[0].keys.ebr = &g_data.ebr;   // the readers serve database 0
+    for (size_t i = 0; i < n; i++) {
+        Reader* reader = new Reader();
+        ebr_register(&g_data.ebr, &reader->ebr);
+        g_data.readers.push_back(reader);
+    }
+    for (Reader* reader : g_data.readers) {
+        int rv = pthread_create(&reader->thread, NULL, &reader_main, reader);
+        if (rv != 0) {
+            die("pthread_create()");
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    // initialisation
+    dlist_init(&g_data.idle_list);
+    for (uint32_t i = 0; i < k_num_dbs; i++) {
+        g_data.dbs[i].id = i;
+    }
+    g_data.db = &g_data.dbs[0];
+
+    // command line options
+    uint16_t port = 1234;
+    uint16_t read_port = 0;
+    size_t read_threads = 4;
+    int upgrade_fd = -1;
+    g_data.argv.push_back(argv[0]);
+    g_data.upgrade_binary = argv[0];
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--port" && i + 1 < argc) {
+            port = (uint16_t)atoi(argv[++i]);
+        } else if (opt == "--spill-file" && i + 1 < argc) {
+            g_data.spill_path = argv[++i];
+        } else if (opt == "--spill-after-ms" && i + 1 < argc) {
+            g_data.spill_after_ms = (uint64_t)atoll(argv[++i]);
+        } else if (opt == "--read-port" && i + 1 < argc) {
+            read_port = (uint16_t)atoi(argv[++i]);
+        } else if (opt == "--read-threads" && i + 1 < argc) {
+            read_threads = (size_t)atoi(argv[++i]);
+        } else if (opt == "--snapshot-file" && i + 1 < argc) {
+            g_data.snap_path = argv[++i];
+        } else if (opt == "--upgrade-binary" && i + 1 < argc) {
+            g_data.upgrade_binary = argv[++i];
+        } else if (opt == "--hugepages") {
+            mem_use_hugepages(true);
+            g_data.argv.push_back(opt);
+            continue;
+        } else if (opt == "--active-defrag") {
+            g_data.defrag_enabled = true;
+            g_data.argv.push_back(opt);
+            continue;
+        } else if (opt == "--upgrade-fd" && i + 1 < argc) {
+            upgrade_fd = atoi(argv[++i]);
+            continue;   // not passed on to the next upgrade
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        }
+        g_data.argv.push_back(opt);
+        g_data.argv.push_back(argv[i]);
+    }
+
+    // the readers don't deal with values in the file or being moved
+    if (read_port && (!g_data.spill_path.empty() || g_data.defrag_enabled)) {
+        fprintf(stderr, "--read-port can't be used with --spill-file or --active-defrag\n");
+        return 1;
+    }
+
+    // async work
+    thread_pool_init(&g_data.thread_pool, 4);
+    if (pipe2(g_data.wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        die("pipe2()");
+    }
+    if (!g_data.spill_path.empty()) {
+        g_data.spill = spill_new_file();
+    }
+
+    if (upgrade_fd >= 0) {
+        // take over from the old process
+        upgrade_recv(upgrade_fd);
+    } else {
+        if (!g_data.snap_path.empty()) {
+            snap_load();
+        }
+        g_data.listen_fd = listen_on(port);
+    }
+    if (read_port && read_threads > 0) {
+        readers_start(read_port, read_threads);
+    }
+    int fd = g_data.listen_fd;
 
     // the event loop
     std::vector<struct pollfd> poll_args;
@@ -844,6 +5500,9 @@ int main() {
         // put the listening socket in the first position
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        // then the pipe for waking up from other threads
+        pfd = {g_data.wake_fds[0], POLLIN, 0};
+        poll_args.push_back(pfd);
 
         // the rest are connection sockets
         // Initially this might be empty
@@ -879,7 +5538,7 @@ int main() {
         }
 
         // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i) { // note: skip the first
+        for (size_t i = 2; i < poll_args.size(); ++i) { // note: skip the first 2
             uint32_t ready = poll_args[i].revents;
             if (ready == 0) {
                 continue;
@@ -889,8 +5548,10 @@ int main() {
 
             // Update the idle timer by moving conn to the end of the list
             conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            if (!conn->blocked) {
+                dlist_detach(&conn->idle_node);
+                dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            }
 
             // handle IO
             if (ready & POLLIN) {
@@ -909,8 +5570,22 @@ int main() {
             }
         } // for each connection sockets
 
+        // the clients unblocked by the requests above
+        process_woken();
+
+        // handle the results from other threads
+        if (poll_args[1].revents) {
+            process_async();
+        }
+
         // handle timers
         process_timers();
+        process_woken();
+
+        // hand everything over to the new process
+        if (g_data.upgrade_fd >= 0) {
+            upgrade_send();
+        }
     } // the event loop
     
     return 0;
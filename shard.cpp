@@ -0,0 +1,261 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "shard.h"
+#include "common.h"
+
+const size_t k_max_msg = 32 << 20;  // the same as the server
+
+enum {
+    TAG_NIL = 0,
+    TAG_ERR = 1,
+    TAG_INT = 3,
+    TAG_ARR = 5,
+};
+
+// Lamping & Veach: the bucket only jumps forward as buckets are added,
+// no ring to keep and the keys are spread evenly
+static uint32_t jump_hash(uint64_t key, uint32_t nbuckets) {
+    int64_t b = -1, j = 0;
+    while (j < (int64_t)nbuckets) {
+        b = j;
+        key = key * 2862933555777941757ull + 1;
+        j = (int64_t)((b + 1) * ((double)(1ll << 31) / (double)((key >> 33) + 1)));
+    }
+    return (uint32_t)b;
+}
+
+uint32_t shard_of(const ShardClient* client, const std::string &key) {
+    // jump hash needs all the bits
+    uint64_t hash = str_hash64((const uint8_t*)key.data(), key.size());
+    return jump_hash(hash, (uint32_t)client->conns.size());
+}
+
+static int conn_open(const std::string &server) {
+    size_t colon = server.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(server.c_str() + colon + 1));
+    if (inet_pton(AF_INET, server.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+bool shard_connect(ShardClient* client, const std::vector<std::string> &servers) {
+    client->conns.resize(servers.size());
+    for (size_t i = 0; i < servers.size(); i++) {
+        client->conns[i].fd = conn_open(servers[i]);
+        if (client->conns[i].fd < 0) {
+            shard_close(client);
+            return false;
+        }
+    }
+    return !servers.empty();
+}
+
+void shard_close(ShardClient* client) {
+    for (ShardConn &conn : client->conns) {
+        if (conn.fd >= 0) {
+            close(conn.fd);
+        }
+    }
+    client->conns.clear();
+    client->nsent = 0;
+}
+
+static void buf_append_u32(std::vector<uint8_t> &buf, uint32_t data) {
+    const uint8_t* p = (const uint8_t*)&data;
+    buf.insert(buf.end(), p, p + 4);
+}
+
+void shard_send(ShardClient* client, uint32_t shard, const std::vector<std::string> &cmd) {
+    ShardConn &conn = client->conns[shard];
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    buf_append_u32(conn.outgoing, len);
+    buf_append_u32(conn.outgoing, (uint32_t)cmd.size());
+    for (const std::string &s : cmd) {
+        buf_append_u32(conn.outgoing, (uint32_t)s.size());
+        conn.outgoing.insert(conn.outgoing.end(), s.begin(), s.end());
+    }
+    conn.pending.push_back(client->nsent++);
+}
+
+// move the complete replies out of the buffer
+static bool conn_parse(ShardConn &conn, std::vector<std::string> &replies) {
+    size_t cur = 0;
+    while (conn.incoming.size() - cur >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn.incoming[cur], 4);
+        if (len > k_max_msg || conn.pending_done == conn.pending.size()) {
+            return false;   // a bad reply
+        }
+        if (conn.incoming.size() - cur - 4 < len) {
+            break;
+        }
+        const char* body = (const char*)&conn.incoming[cur + 4];
+        replies[conn.pending[conn.pending_done++]].assign(body, len);
+        cur += 4 + len;
+    }
+    conn.incoming.erase(conn.incoming.begin(), conn.incoming.begin() + cur);
+    return true;
+}
+
+// write then read a connection until it would block
+static bool conn_io(ShardConn &conn, std::vector<std::string> &replies) {
+    while (!conn.outgoing.empty()) {
+        ssize_t rv = write(conn.fd, conn.outgoing.data(), conn.outgoing.size());
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        conn.outgoing.erase(conn.outgoing.begin(), conn.outgoing.begin() + rv);
+    }
+    uint8_t buf[64 * 1024];
+    while (conn.pending_done < conn.pending.size()) {
+        ssize_t rv = read(conn.fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return false;   // error or EOF
+        }
+        conn.incoming.insert(conn.incoming.end(), buf, buf + rv);
+        if (!conn_parse(conn, replies)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool shard_wait(ShardClient* client, std::vector<std::string> &replies) {
+    replies.assign(client->nsent, std::string());
+    client->nsent = 0;
+    bool ok = true;
+    std::vector<struct pollfd> pfds;
+    std::vector<ShardConn*> busy;
+    while (ok) {
+        pfds.clear();
+        busy.clear();
+        for (ShardConn &conn : client->conns) {
+            if (conn.pending_done < conn.pending.size()) {
+                short events = POLLIN | (conn.outgoing.empty() ? 0 : POLLOUT);
+                pfds.push_back({conn.fd, events, 0});
+                busy.push_back(&conn);
+            }
+        }
+        if (pfds.empty()) {
+            break;
+        }
+        if (poll(pfds.data(), (nfds_t)pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < pfds.size() && ok; i++) {
+            if (pfds[i].revents) {
+                ok = conn_io(*busy[i], replies);
+            }
+        }
+    }
+    for (ShardConn &conn : client->conns) {
+        conn.pending.clear();
+        conn.pending_done = 0;
+    }
+    return ok;
+}
+
+bool shard_mget(ShardClient* client, const std::vector<std::string> &keys, std::string &reply) {
+    for (const std::string &key : keys) {
+        shard_send(client, shard_of(client, key), {"get", key});
+    }
+    std::vector<std::string> replies;
+    if (!shard_wait(client, replies)) {
+        return false;
+    }
+    uint32_t n = (uint32_t)replies.size();
+    reply.assign(1, (char)TAG_ARR);
+    reply.append((const char*)&n, 4);
+    for (const std::string &r : replies) {
+        reply += r;
+    }
+    return true;
+}
+
+static const std::string* first_error(const std::vector<std::string> &replies) {
+    for (const std::string &r : replies) {
+        if (!r.empty() && (uint8_t)r[0] == TAG_ERR) {
+            return &r;
+        }
+    }
+    return NULL;
+}
+
+bool shard_mset(ShardClient* client, const std::vector<std::string> &kvs, std::string &reply) {
+    assert(kvs.size() % 2 == 0);
+    for (size_t i = 0; i < kvs.size(); i += 2) {
+        shard_send(client, shard_of(client, kvs[i]), {"set", kvs[i], kvs[i + 1]});
+    }
+    std::vector<std::string> replies;
+    if (!shard_wait(client, replies)) {
+        return false;
+    }
+    const std::string* err = first_error(replies);
+    reply = err ? *err : std::string(1, (char)TAG_NIL);
+    return true;
+}
+
+bool shard_del(ShardClient* client, const std::vector<std::string> &keys, std::string &reply) {
+    for (const std::string &key : keys) {
+        shard_send(client, shard_of(client, key), {"del", key});
+    }
+    std::vector<std::string> replies;
+    if (!shard_wait(client, replies)) {
+        return false;
+    }
+    if (const std::string* err = first_error(replies)) {
+        reply = *err;
+        return true;
+    }
+    int64_t ndel = 0;
+    for (const std::string &r : replies) {
+        int64_t val = 0;
+        if (r.size() == 1 + 8 && (uint8_t)r[0] == TAG_INT) {
+            memcpy(&val, &r[1], 8);
+        }
+        ndel += val;
+    }
+    reply.assign(1, (char)TAG_INT);
+    reply.append((const char*)&ndel, 8);
+    return true;
+}
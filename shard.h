@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// client-side sharding: each key lives on one server chosen by jump
+// consistent hash, commands are queued per server and the pipelines are
+// run in parallel, the replies are returned in the order of the commands
+struct ShardConn {
+    int fd = -1;
+    std::vector<uint8_t> outgoing;      // requests not written yet
+    std::vector<uint8_t> incoming;      // partial replies
+    std::vector<size_t> pending;        // the command index of each reply due
+    size_t pending_done = 0;
+};
+
+struct ShardClient {
+    std::vector<ShardConn> conns;
+    size_t nsent = 0;                   // commands queued since the last wait
+};
+
+// the servers are `ip:port`, their order must be the same for all clients,
+// and a server is only added at the end, which moves 1/n of the keys to it
+bool shard_connect(ShardClient* client, const std::vector<std::string> &servers);
+void shard_close(ShardClient* client);
+uint32_t shard_of(const ShardClient* client, const std::string &key);
+
+// queue a command to a server
+void shard_send(ShardClient* client, uint32_t shard, const std::vector<std::string> &cmd);
+// run all the queued commands, `replies[i]` is the response body of the i-th,
+// false on I/O errors, the connections are then unusable
+bool shard_wait(ShardClient* client, std::vector<std::string> &replies);
+
+// multi-key commands split per server, the reply is merged into the same
+// response body a single server would return:
+// mget key... : an array of the values
+// mset key value... : nil, or the first error
+// del key... : the number of keys deleted, or the first error
+bool shard_mget(ShardClient* client, const std::vector<std::string> &keys, std::string &reply);
+bool shard_mset(ShardClient* client, const std::vector<std::string> &kvs, std::string &reply);
+bool shard_del(ShardClient* client, const std::vector<std::string> &keys, std::string &reply);
@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+
+#include "sketch.h"
+#include "common.h"
+
+// the rows need more bits than `str_hash()`
+static uint64_t sketch_hash(const std::string &item) {
+    return str_hash64((const uint8_t*)item.data(), item.size());
+}
+
+// the column of each row from one hash: (h1 + row * h2) scaled to the width
+static void row_cols_scalar(uint64_t hash, uint32_t width, uint32_t depth, uint32_t* cols) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t row = 0; row < depth; row++) {
+        cols[row] = (uint32_t)(((uint64_t)(h1 + row * h2) * width) >> 32);
+    }
+}
+
+// 8 rows at a time
+__attribute__((target("avx2")))
+static void row_cols_avx2(uint64_t hash, uint32_t width, uint32_t depth, uint32_t* cols) {
+    __m256i h1 = _mm256_set1_epi32((int)(uint32_t)hash);
+    __m256i h2 = _mm256_set1_epi32((int)((uint32_t)(hash >> 32) | 1));
+    __m256i w = _mm256_set1_epi32((int)width);
+    __m256i rows = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    uint32_t row = 0;
+    for (; row + 8 <= depth; row += 8) {
+        __m256i h = _mm256_add_epi32(h1, _mm256_mullo_epi32(rows, h2));
+        // the high halves of the 32x32 products, even and odd lanes
+        __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(h, w), 32);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(h, 32), w);
+        _mm256_storeu_si256((__m256i*)(cols + row), _mm256_blend_epi32(even, odd, 0xAA));
+        rows = _mm256_add_epi32(rows, _mm256_set1_epi32(8));
+    }
+    uint32_t h1s = (uint32_t)hash;
+    uint32_t h2s = (uint32_t)(hash >> 32) | 1;
+    for (; row < depth; row++) {
+        cols[row] = (uint32_t)(((uint64_t)(h1s + row * h2s) * width) >> 32);
+    }
+}
+
+static void row_cols(uint64_t hash, uint32_t width, uint32_t depth, uint32_t* cols) {
+    static bool avx2 = __builtin_cpu_supports("avx2");
+    avx2 && depth >= 8
+        ? row_cols_avx2(hash, width, depth, cols)
+        : row_cols_scalar(hash, width, depth, cols);
+}
+
+// count-min sketch
+
+CMS* cms_new(uint32_t width, uint32_t depth) {
+    CMS* cms = new CMS();
+    cms->width = width;
+    cms->depth = depth;
+    cms->counters.resize((size_t)width * depth);
+    return cms;
+}
+
+void cms_del(CMS* cms) {
+    delete cms;
+}
+
+// the counters of the items ahead are prefetched while updating
+const size_t k_sketch_window = 8;
+
+// hash the batch, then the columns of all rows
+static void cms_cols(CMS* cms, size_t n, const std::string* items, std::vector<uint32_t> &cols) {
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = sketch_hash(items[i]);
+    }
+    cols.resize(n * cms->depth);
+    for (size_t i = 0; i < n; i++) {
+        row_cols(hashes[i], cms->width, cms->depth, &cols[i * cms->depth]);
+    }
+}
+
+static void cms_prefetch(CMS* cms, const uint32_t* cols) {
+    for (uint32_t row = 0; row < cms->depth; row++) {
+        __builtin_prefetch(&cms->counters[(size_t)row * cms->width + cols[row]], 1);
+    }
+}
+
+void cms_incrby(CMS* cms, size_t n, const std::string* items, const uint32_t* incrs, uint32_t* out) {
+    std::vector<uint32_t> cols;
+    cms_cols(cms, n, items, cols);
+    uint32_t depth = cms->depth;
+    for (size_t i = 0; i < n && i < k_sketch_window; i++) {
+        cms_prefetch(cms, &cols[i * depth]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i + k_sketch_window < n) {
+            cms_prefetch(cms, &cols[(i + k_sketch_window) * depth]);
+        }
+        uint32_t est = UINT32_MAX;
+        for (uint32_t row = 0; row < depth; row++) {
+            uint32_t &c = cms->counters[(size_t)row * cms->width + cols[i * depth + row]];
+            c = c > UINT32_MAX - incrs[i] ? UINT32_MAX : c + incrs[i];   // saturated
+            est = std::min(est, c);
+        }
+        out[i] = est;
+    }
+}
+
+void cms_query(CMS* cms, size_t n, const std::string* items, uint32_t* out) {
+    std::vector<uint32_t> cols;
+    cms_cols(cms, n, items, cols);
+    uint32_t depth = cms->depth;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t est = UINT32_MAX;
+        for (uint32_t row = 0; row < depth; row++) {
+            est = std::min(est, cms->counters[(size_t)row * cms->width + cols[i * depth + row]]);
+        }
+        out[i] = est;
+    }
+}
+
+// top-k
+
+// decay^count is treated as 0 beyond this
+const uint32_t k_topk_decay_max = 1024;
+
+TopK* topk_new(uint32_t k, uint32_t width, uint32_t depth, double decay) {
+    TopK* topk = new TopK();
+    topk->k = k;
+    topk->width = width;
+    topk->depth = depth;
+    topk->decay = decay;
+    topk->buckets.resize((size_t)width * depth);
+    topk->decay_pow.resize(k_topk_decay_max);
+    for (uint32_t i = 0; i < k_topk_decay_max; i++) {
+        topk->decay_pow[i] = pow(decay, (double)i);
+    }
+    topk->rng = 0x9E3779B97F4A7C15ull;
+    return topk;
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+    ((std::vector<HNode*>*)arg)->push_back(node);
+    return true;
+}
+
+void topk_del(TopK* topk) {
+    // `hm_foreach()` can't free the nodes it visits
+    std::vector<HNode*> nodes;
+    hm_foreach(&topk->items, &cb_collect, &nodes);
+    hm_clear(&topk->items);
+    for (HNode* node : nodes) {
+        delete container_of(node, TopKItem, node);
+    }
+    delete topk;
+}
+
+static double topk_rand(TopK* topk) {
+    uint64_t x = topk->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    topk->rng = x;
+    return (double)(x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct TopKKey {
+    HNode node;
+    const std::string* item = NULL;
+};
+
+static bool topk_item_eq(HNode* node, HNode* key) {
+    return container_of(node, TopKItem, node)->item == *container_of(key, TopKKey, node)->item;
+}
+
+static TopKItem* topk_lookup(TopK* topk, const std::string &item, uint64_t hcode) {
+    TopKKey key;
+    key.node.hcode = hcode;
+    key.item = &item;
+    HNode* node = hm_lookup(&topk->items, &key.node, &topk_item_eq);
+    return node ? container_of(node, TopKItem, node) : NULL;
+}
+
+static TopKItem* topk_item_of(const HeapItem &h) {
+    return container_of(h.ref, TopKItem, heap_idx);
+}
+
+// the estimated count after adding the item to the buckets
+static uint32_t topk_count(TopK* topk, uint64_t hash, const uint32_t* cols) {
+    uint32_t fp = (uint32_t)(hash * 0xD6E8FEB86659FD93ull >> 32);
+    uint32_t est = 0;
+    for (uint32_t row = 0; row < topk->depth; row++) {
+        TopKBucket &b = topk->buckets[(size_t)row * topk->width + cols[row]];
+        if (b.count == 0) {
+            b.fp = fp;
+            b.count = 1;
+        } else if (b.fp == fp) {
+            b.count += b.count < UINT32_MAX;
+        } else {
+            double p = b.count < k_topk_decay_max ? topk->decay_pow[b.count] : 0;
+            if (topk_rand(topk) < p && --b.count == 0) {
+                b.fp = fp;
+                b.count = 1;
+            }
+        }
+        if (b.fp == fp) {
+            est = std::max(est, b.count);
+        }
+    }
+    return est;
+}
+
+void topk_add(TopK* topk, size_t n, const std::string* items,
+    std::vector<std::string> &expelled, std::vector<bool> &has_expelled)
+{
+    expelled.assign(n, std::string());
+    has_expelled.assign(n, false);
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = sketch_hash(items[i]);
+    }
+    std::vector<uint32_t> cols(topk->depth);
+    for (size_t i = 0; i < n; i++) {
+        row_cols(hashes[i], topk->width, topk->depth, cols.data());
+        uint32_t est = topk_count(topk, hashes[i], cols.data());
+        TopKItem* node = topk_lookup(topk, items[i], hashes[i]);
+        if (node) {
+            if (est > node->count) {
+                node->count = est;
+                heap_upsert(topk->heap, node->heap_idx, HeapItem{est, &node->heap_idx});
+            }
+            continue;
+        }
+        bool full = topk->heap.size() >= topk->k;
+        if (est == 0 || (full && est <= topk->heap[0].val)) {
+            continue;
+        }
+        size_t pos = -1;
+        if (full) {
+            // replace the minimum
+            TopKItem* min = topk_item_of(topk->heap[0]);
+            TopKKey key;
+            key.node.hcode = min->node.hcode;
+            key.item = &min->item;
+            hm_delete(&topk->items, &key.node, &topk_item_eq);
+            expelled[i].swap(min->item);
+            has_expelled[i] = true;
+            delete min;
+            pos = 0;
+        }
+        node = new TopKItem();
+        node->item = items[i];
+        node->node.hcode = hashes[i];
+        node->count = est;
+        hm_insert(&topk->items, &node->node);
+        heap_upsert(topk->heap, pos, HeapItem{est, &node->heap_idx});
+    }
+}
+
+void topk_list(TopK* topk, std::vector<TopKItem*> &out) {
+    out.clear();
+    for (const HeapItem &h : topk->heap) {
+        out.push_back(topk_item_of(h));
+    }
+    std::sort(out.begin(), out.end(), [](TopKItem* a, TopKItem* b) {
+        return a->count != b->count ? a->count > b->count : a->item < b->item;
+    });
+}
+
+void topk_restore_item(TopK* topk, const std::string &item, uint32_t count) {
+    uint64_t hcode = sketch_hash(item);
+    TopKItem* node = topk_lookup(topk, item, hcode);
+    if (!node) {
+        node = new TopKItem();
+        node->item = item;
+        node->node.hcode = hcode;
+        hm_insert(&topk->items, &node->node);
+    }
+    node->count = count;
+    heap_upsert(topk->heap, node->heap_idx, HeapItem{count, &node->heap_idx});
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+#include "heap.h"
+
+// count-min sketch: `depth` rows of `width` counters, an item is counted
+// once per row, the estimate is the minimum, which never undercounts
+struct CMS {
+    uint32_t width = 0;
+    uint32_t depth = 0;
+    std::vector<uint32_t> counters;     // [depth][width]
+};
+
+CMS* cms_new(uint32_t width, uint32_t depth);
+void cms_del(CMS* cms);
+// add `incrs[i]` to each item, and the new estimates to `out`;
+// the items are hashed first, then the counters are prefetched and updated
+void cms_incrby(CMS* cms, size_t n, const std::string* items, const uint32_t* incrs, uint32_t* out);
+void cms_query(CMS* cms, size_t n, const std::string* items, uint32_t* out);
+
+// top-k by HeavyKeeper: each bucket keeps a fingerprint and a count,
+// a colliding item decays the count with the probability decay^count,
+// so the small flows are evicted and the heavy ones stay;
+// the k heaviest are kept in a min-heap by the estimated count
+struct TopKBucket {
+    uint32_t fp = 0;
+    uint32_t count = 0;
+};
+
+struct TopKItem {
+    HNode node;
+    size_t heap_idx = -1;
+    uint32_t count = 0;
+    std::string item;
+};
+
+struct TopK {
+    uint32_t k = 0;
+    uint32_t width = 0;
+    uint32_t depth = 0;
+    double decay = 0.9;
+    std::vector<TopKBucket> buckets;    // [depth][width]
+    std::vector<double> decay_pow;      // decay^count for small counts
+    uint64_t rng = 1;
+    std::vector<HeapItem> heap;         // by count, of `TopKItem`
+    HMap items;                         // `TopKItem` by the item
+};
+
+TopK* topk_new(uint32_t k, uint32_t width, uint32_t depth, double decay);
+void topk_del(TopK* topk);
+// add the items, an item pushed out of the top-k is added to `expelled`
+// at its index, `has_expelled` tells if there is one, as the item can be empty
+void topk_add(TopK* topk, size_t n, const std::string* items,
+    std::vector<std::string> &expelled, std::vector<bool> &has_expelled);
+// the top-k items by count, descending
+void topk_list(TopK* topk, std::vector<TopKItem*> &out);
+// for restoring: set a heap item, keeping the buckets as they are
+void topk_restore_item(TopK* topk, const std::string &item, uint32_t count);
@@ -0,0 +1,69 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+// create an empty file, the content is meaningless after a restart
+SpillFile* spill_open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    SpillFile* file = new SpillFile();
+    file->fd = fd;
+    file->path = path;
+    return file;
+}
+
+// take space at the end of the file for a value written by `spill_write()`
+uint64_t spill_reserve(SpillFile* file, size_t len) {
+    uint64_t off = file->size;
+    file->size += len;
+    return off;
+}
+
+// blocking write, can be called from any thread
+bool spill_write(SpillFile* file, uint64_t off, const char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t rv = pwrite(file->fd, data + done, len - done, off + done);
+        if (rv <= 0) {
+            return false;   // the partial data is unreferenced garbage
+        }
+        done += (size_t)rv;
+    }
+    return true;
+}
+
+// blocking read, can be called from any thread
+bool spill_read(SpillFile* file, uint64_t off, size_t len, std::string &out) {
+    out.resize(len);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t rv = pread(file->fd, &out[done], len - done, off + done);
+        if (rv <= 0) {
+            return false;
+        }
+        done += (size_t)rv;
+    }
+    return true;
+}
+
+// a written value is now referenced by a key
+void spill_keep(SpillFile* file, size_t len) {
+    file->live += len;
+}
+
+// a value is no longer referenced, its space is reclaimed by compaction
+void spill_forget(SpillFile* file, size_t len) {
+    assert(file->live >= len);
+    file->live -= len;
+}
+
+void spill_close(SpillFile* file) {
+    assert(file->refs == 0);
+    close(file->fd);
+    unlink(file->path.c_str());
+    delete file;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// an append-only file holding values evicted from memory
+struct SpillFile {
+    int fd = -1;
+    std::string path;
+    uint64_t size = 0;      // append position
+    uint64_t live = 0;      // bytes still referenced by keys
+    uint32_t refs = 0;      // in-flight reads
+    bool retired = false;   // replaced by compaction, close when `refs` is 0
+};
+
+SpillFile* spill_open(const std::string &path);
+uint64_t spill_reserve(SpillFile* file, size_t len);
+bool spill_write(SpillFile* file, uint64_t off, const char* data, size_t len);
+bool spill_read(SpillFile* file, uint64_t off, size_t len, std::string &out);
+void spill_keep(SpillFile* file, size_t len);
+void spill_forget(SpillFile* file, size_t len);
+void spill_close(SpillFile* file);
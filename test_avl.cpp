@@ -11,8 +11,18 @@
 struct Data {
     AVLNode node;
     uint32_t val = 0;
+    uint64_t sum = 0;   // augmentation: the sum of the subtree
 };
 
+static uint64_t data_sum(AVLNode* node) {
+    return node ? container_of(node, Data, node)->sum : 0;
+}
+
+static void data_augment(AVLNode* node) {
+    Data* data = container_of(node, Data, node);
+    data->sum = data->val + data_sum(node->left) + data_sum(node->right);
+}
+
 struct Container {
     AVLNode* root = NULL;
 };
@@ -31,7 +41,7 @@ static void add(Container &c, uint32_t val) {
     }
     *from = &data->node;    // attach the new node
     data->node.parent = cur;    // update the parent pointer
-    c.root = avl_fix(&data->node);  // rebalance the tree
+    c.root = avl_fix(&data->node, &data_augment);  // rebalance the tree
 }
 
 static bool del(Container &c, uint32_t val) {
@@ -47,7 +57,7 @@ static bool del(Container &c, uint32_t val) {
         return false;
     }
 
-    c.root = avl_del(cur);  // detach the node
+    c.root = avl_del(cur, &data_augment);  // detach the node
     delete container_of(cur, Data, node);    // deallocate the data
     return true;
 }
@@ -67,6 +77,8 @@ static void avl_verify(AVLNode* parent, AVLNode* node) {
     uint32_t r = avl_height(node->right);
     assert(l == r || l == r + 1 || l + 1 == r);
     assert(node->height == 1 + std::max(l, r));
+    assert(data_sum(node) == container_of(node, Data, node)->val
+        + data_sum(node->left) + data_sum(node->right));
 
     uint32_t val = container_of(node, Data, node)->val;
     if (node->left) {
@@ -99,7 +111,7 @@ static void container_verify(Container &c, const std::multiset<uint32_t> &ref) {
 static void dispose(Container &c) {
     while (c.root) {
         AVLNode* node = c.root;
-        c.root = avl_del(c.root);
+        c.root = avl_del(c.root, &data_augment);
         delete container_of(node, Data, node);
     }
 }
@@ -158,6 +170,49 @@ static void test_remove(uint32_t sz) {
     }
 }
 
+static void test_split_join(uint32_t sz) {
+    for (uint32_t rank = 0; rank <= sz; ++rank) {
+        Container c;
+        for (uint32_t i = 0; i < sz; ++i) {
+            add(c, i);
+        }
+        AVLNode* left = NULL;
+        AVLNode* right = NULL;
+        avl_split(c.root, rank, &left, &right, &data_augment);
+
+        std::multiset<uint32_t> lref, rref;
+        for (uint32_t i = 0; i < sz; ++i) {
+            (i < rank ? lref : rref).insert(i);
+        }
+        Container l, r;
+        l.root = left;
+        r.root = right;
+        container_verify(l, lref);
+        container_verify(r, rref);
+        for (AVLNode* node = left; node; node = node->right) {
+            assert(avl_rank(node) == (int64_t)container_of(node, Data, node)->val);
+        }
+
+        // join them back, with or without a middle node
+        std::multiset<uint32_t> ref = lref;
+        ref.insert(rref.begin(), rref.end());
+        if (rank % 2 == 0 && lref.size() > 0) {
+            // the last node of the left tree as the middle node
+            AVLNode* last = l.root;
+            while (last->right) {
+                last = last->right;
+            }
+            l.root = avl_del(last, &data_augment);
+            avl_init(last);
+            c.root = avl_join(l.root, last, r.root, &data_augment);
+        } else {
+            c.root = avl_join2(l.root, r.root, &data_augment);
+        }
+        container_verify(c, ref);
+        dispose(c);
+    }
+}
+
 int main () {
     Container c;
 
@@ -205,6 +260,11 @@ int main () {
         test_remove(i);
     }
 
+    // split and join
+    for (uint32_t i = 0; i < 100; i++) {
+        test_split_join(i);
+    }
+
     dispose(c);
     return 0;
 }
\ No newline at end of file
@@ -38,25 +38,800 @@ $ ./client zquery zset 1 "" 0 10
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client zadd zr 1 a
+(int) 1
+$ ./client zadd zr 2 b
+(int) 1
+$ ./client zadd zr 3 c
+(int) 1
+$ ./client zadd zr 4 d
+(int) 1
+$ ./client zadd zr 5 e
+(int) 1
+$ ./client zremrangebyscore zr 2 3
+(int) 2
+$ ./client zremrangebyscore zr 2 3
+(int) 0
+$ ./client zremrangebyrank zr -1 -1
+(int) 1
+$ ./client zquery zr 0 "" 0 10
+(arr) len=4
+(str) a
+(dbl) 1
+(str) d
+(dbl) 4
+(arr) end
+$ ./client zremrangebyrank zr 0 100
+(int) 2
+$ ./client zremrangebyrank asdf 0 100
+(int) 0
+$ ./client zadd zs 1 a
+(int) 1
+$ ./client zadd zs 2 b
+(int) 1
+$ ./client zadd zs 4 c
+(int) 1
+$ ./client zcount zs 1.5 4
+(int) 2
+$ ./client zsumrange zs 1.5 4
+(dbl) 6
+$ ./client zavgrange zs 0 10
+(dbl) 2.33333
+$ ./client zavgrange zs 5 10
+(nil)
+$ ./client zquantile zs 0.5
+(arr) len=2
+(str) b
+(dbl) 2
+(arr) end
+$ ./client zquantile zs 1
+(arr) len=2
+(str) c
+(dbl) 4
+(arr) end
+$ ./client zquantile asdf 0.5
+(nil)
+$ ./client zrandmember zs 5
+(arr) len=3
+(str) a
+(str) b
+(str) c
+(arr) end
+$ ./client zrandmember asdf
+(nil)
+$ ./client zpopmin zs
+(arr) len=2
+(str) a
+(dbl) 1
+(arr) end
+$ ./client zpopmax zs 5
+(arr) len=4
+(str) c
+(dbl) 4
+(str) b
+(dbl) 2
+(arr) end
+$ ./client zpopmin zs
+(arr) len=0
+(arr) end
+$ ./client zadd zs 3 d
+(int) 1
+$ ./client bzpopmin zs 1
+(arr) len=3
+(str) zs
+(str) d
+(dbl) 3
+(arr) end
+$ ./client bzpopmax zs 0.1
+(nil)
+$ ./client zadd zl 0 apple
+(int) 1
+$ ./client zadd zl 0 apricot
+(int) 1
+$ ./client zadd zl 0 banana
+(int) 1
+$ ./client zadd zl 0 cherry
+(int) 1
+$ ./client zrangebylex zl [ap (b
+(arr) len=2
+(str) apple
+(str) apricot
+(arr) end
+$ ./client zrangebylex zl (apple + limit 1 5
+(arr) len=2
+(str) banana
+(str) cherry
+(arr) end
+$ ./client zlexcount zl - [banana
+(int) 3
+$ ./client zlexcount zl banana +
+(err) 4 expect `-`, `+`, `[name` or `(name`
+$ ./client zremrangebylex zl [apricot [banana
+(int) 2
+$ ./client zrangebylex zl - +
+(arr) len=2
+(str) apple
+(str) cherry
+(arr) end
+$ ./client zadd zt 1 a px 0
+(int) 1
+$ ./client zadd zt 2 b ex 100
+(int) 1
+$ ./client zscore zt a
+(nil)
+$ ./client zadd zt 1 a px -1
+(err) 4 expect `px ms`, `ex sec` or `int`
+$ ./client zquery zt 0 "" 0 10
+(arr) len=2
+(str) b
+(dbl) 2
+(arr) end
+$ ./client zmscore zl cherry nope apple
+(arr) len=3
+(dbl) 0
+(nil)
+(dbl) 0
+(arr) end
+$ ./client zmrank zl cherry nope apple
+(arr) len=3
+(int) 1
+(nil)
+(int) 0
+(arr) end
+$ ./client zmrank nope a
+(arr) len=1
+(nil)
+(arr) end
+$ ./client zadd zi 9007199254740993 a int
+(int) 1
+$ ./client zincrby zi 2 a
+(int) 9007199254740995
+$ ./client zincrby zi 9223372036854775807 a
+(err) 4 int score overflow
+$ ./client zadd zi 1.5 b
+(err) 4 expect int
+$ ./client zincrby zi -1 b
+(int) -1
+$ ./client zquery zi 9007199254740995 "" 0 10
+(arr) len=2
+(str) a
+(int) 9007199254740995
+(arr) end
+$ ./client zcount zi -1 9007199254740994
+(int) 1
+$ ./client zsumrange zi -1 1e19
+(int) 9007199254740994
+$ ./client zrem zi a
+(int) 1
+$ ./client zrem zi b
+(int) 1
+$ ./client zadd zi 1.5 b
+(int) 1
+$ ./client zsumrange zi 0 2
+(dbl) 1.5
+$ ./client zadd zl 1 x int
+(err) 3 expect a zset of int scores
+$ ./client zincrby zf 1.5 a
+(dbl) 1.5
+$ ./client vadd vs a l2 0 0
+(int) 1
+$ ./client vadd vs b 3 4
+(int) 1
+$ ./client vadd vs c 1 1
+(int) 1
+$ ./client vadd vs c 1 0
+(int) 0
+$ ./client vsim vs 2 0 0
+(arr) len=4
+(str) a
+(dbl) 0
+(str) c
+(dbl) 1
+(arr) end
+$ ./client vadd vs d 1 2 3
+(err) 4 dimension mismatch
+$ ./client vrem vs a
+(int) 1
+$ ./client vcard vs
+(int) 2
+$ ./client vsim vs 5 3 4 ef 10
+(arr) len=4
+(str) b
+(dbl) 0
+(str) c
+(dbl) 20
+(arr) end
+$ ./client vadd zf x 1
+(err) 3 expect vset
+$ ./client hset user:1 age 25 country DE
+(int) 2
+$ ./client hset user:2 age 31 country DE,FR
+(int) 2
+$ ./client hset user:3 age 28 country US
+(int) 2
+$ ./client hget user:1 age
+(str) 25
+$ ./client hlen user:2
+(int) 2
+$ ./client ft.create users user: age numeric country tag
+(nil)
+$ ./client ft.search users "@age:[20 30] @country:{DE}"
+(arr) len=2
+(int) 1
+(str) user:1
+(arr) end
+$ ./client hset user:3 country FR
+(int) 0
+$ ./client ft.search users "@age:[(25 +inf] @country:{FR}"
+(arr) len=3
+(int) 2
+(str) user:2
+(str) user:3
+(arr) end
+$ ./client hdel user:2 age
+(int) 1
+$ ./client ft.search users "@age:[(25 +inf] @country:{FR}"
+(arr) len=2
+(int) 1
+(str) user:3
+(arr) end
+$ ./client ft.search users "@name:{x}"
+(err) 4 unknown field: name
+$ ./client ft.dropindex users
+(int) 1
+$ ./client json.set doc $ '{"name":"a","stats":{"visits":41},"tags":["x"]}'
+(int) 1
+$ ./client json.get doc $.stats.visits
+(str) 41
+$ ./client json.numincrby doc $.stats.visits 1
+(str) 42
+$ ./client json.arrappend doc $.tags '"y"' 3
+(int) 3
+$ ./client json.set doc $.name '"b"'
+(int) 1
+$ ./client json.set doc $.nope.x 1
+(int) 0
+$ ./client json.get doc
+(str) {"name":"b","stats":{"visits":42},"tags":["x","y",3]}
+$ ./client json.numincrby doc $.name 1
+(err) 3 not a number
+$ ./client json.set doc $ '{"a":'
+(err) 4 bad json
+$ ./client throttle rl 4 1 1
+(arr) len=5
+(int) 1
+(int) 5
+(int) 4
+(int) -1
+(int) 1000
+(arr) end
+$ ./client throttle rl2 1 1 1 5
+(arr) len=5
+(int) 0
+(int) 2
+(int) 2
+(int) -1
+(int) 0
+(arr) end
+$ ./client throttle doc 1 1 1
+(err) 3 expect throttle
+$ ./client cms.initbydim hits 1000 4
+(nil)
+$ ./client cms.initbydim big 2 4611686018427387904
+(err) 4 bad dimensions
+$ ./client topk.reserve big 1 2 4611686018427387904 0.9
+(err) 4 bad dimensions
+$ ./client cms.incrby hits /a 3 /b 1 /a 2
+(arr) len=3
+(int) 3
+(int) 1
+(int) 5
+(arr) end
+$ ./client cms.query hits /a /c
+(arr) len=2
+(int) 5
+(int) 0
+(arr) end
+$ ./client topk.reserve top 2
+(nil)
+$ ./client topk.add top a a b c c c
+(arr) len=6
+(nil)
+(nil)
+(nil)
+(nil)
+(str) b
+(nil)
+(arr) end
+$ ./client topk.list top withcount
+(arr) len=4
+(str) c
+(int) 3
+(str) a
+(int) 2
+(arr) end
+$ ./client topk.add hits x
+(err) 3 expect topk
+$ ./client set rk1 v1
+(nil)
+$ ./client rename rk1 rk2
+(nil)
+$ ./client get rk1
+(nil)
+$ ./client get rk2
+(str) v1
+$ ./client rename rk1 rk3
+(err) 4 no such key
+$ ./client zadd rz 1 n1
+(int) 1
+$ ./client renamenx rz rk2
+(int) 0
+$ ./client renamenx rz rz2
+(int) 1
+$ ./client copy rz2 rz3
+(int) 1
+$ ./client copy rz2 rk2
+(int) 0
+$ ./client copy rz2 rk2 replace
+(int) 1
+$ ./client zscore rk2 n1
+(dbl) 1
+$ ./client copy rz2 rz2
+(err) 4 same key
+$ ./client restore rz4 0 junk
+(err) 4 bad payload
+$ ./client hotupgrade /bin/sh
+(err) 4 the binary is set by --upgrade-binary
+$ ./client select 16
+(err) 4 bad database index
+$ ./client move rk2 1
+(int) 1
+$ ./client move rk2 1
+(int) 0
+$ ./client get rk2
+(nil)
+$ ./client move rz2 0
+(err) 4 same database
+$ ./client flushall async
+(nil)
+$ ./client dbsize
+(int) 0
+$ ./client ns.set t1: 1 0
+(nil)
+$ ./client set t1:a 1
+(nil)
+$ ./client set t1:b 2
+(err) 5 namespace over quota
+$ ./client set t1:a 3
+(nil)
+$ ./client ns.set t1: 1 0 evict
+(nil)
+$ ./client set t1:b 2
+(nil)
+$ ./client get t1:a
+(nil)
+$ ./client dbsize
+(int) 1
+$ ./client ns.set a:b: 1 0
+(err) 4 expect a prefix ending with its only `:`
+$ ./client ns.del t1:
+(int) 1
+$ ./client ns.del t1:
+(int) 0
+$ ./client --shards 127.0.0.1:1234,127.0.0.1:1234 mset s:a 1 s:b 2
+(nil)
+$ ./client --shards 127.0.0.1:1234,127.0.0.1:1234 mget s:a s:x s:b
+(arr) len=3
+(str) 1
+(nil)
+(str) 2
+(arr) end
+$ ./client --shards 127.0.0.1:1234,127.0.0.1:1234 del s:a s:b s:x
+(int) 2
+$ ./client --shards 127.0.0.1:1234 get s:a
+(nil)
 '''
 
+import glob
+import os
+import re
 import shlex
+import socket
+import struct
 import subprocess
+import threading
+import time
+
+def run_cases(cases):
+    cmds = []
+    outputs = []
+    lines = cases.splitlines()
+    for x in lines:
+        x = x.strip()
+        if not x:
+            continue
+        if x.startswith('$ '):
+            cmds.append(x[2:]);
+            outputs.append('');
+        else:
+            outputs[-1] = outputs[-1] + x + '\n'
+
+    assert len(cmds) == len(outputs)
+    for cmd, expect in zip(cmds, outputs):
+        out = subprocess.check_output(shlex.split(cmd)).decode('utf-8')
+        assert out == expect, f'cmd:{cmd} out:{out} expect:{expect}'
+
+run_cases(CASES)
+
+# the server options are tested with more servers on other ports,
+# the sharding client with one server reaches them and has no size limit
+def client(port, *args):
+    cmd = ['./client', '--shards', f'127.0.0.1:{port}'] + [str(x) for x in args]
+    return subprocess.check_output(cmd, stderr=subprocess.DEVNULL).decode('utf-8')
+
+def wait_until(cond, timeout=10):
+    deadline = time.time() + timeout
+    while not cond():
+        assert time.time() < deadline, 'timed out'
+        time.sleep(0.05)
+
+def server_start(port, *opts):
+    log = open(f'server.{port}.log', 'w')
+    proc = subprocess.Popen(['./server', '--port', str(port)] + list(opts),
+        stdout=log, stderr=log)
+    def ready():
+        try:
+            client(port, 'dbsize')
+            return True
+        except subprocess.CalledProcessError:
+            return False
+    wait_until(ready)
+    return proc
+
+def server_stop(proc):
+    proc.terminate()
+    proc.wait()
+
+def server_log(port):
+    with open(f'server.{port}.log') as fp:
+        return fp.read()
+
+# a connection that pipelines many commands,
+# the replies are decoded to None, str, int, float, list or ('err', code, msg),
+# binary strings are kept by the surrogateescape error handler
+class Conn:
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.buf = b''
+
+    def send(self, *args):
+        args = [x if isinstance(x, bytes) else str(x).encode('utf-8', 'surrogateescape')
+                for x in args]
+        body = struct.pack('<I', len(args))
+        for x in args:
+            body += struct.pack('<I', len(x)) + x
+        self.sock.sendall(struct.pack('<I', len(body)) + body)
+
+    def recv(self, n):
+        while len(self.buf) < n:
+            data = self.sock.recv(1 << 16)
+            assert data, 'EOF'
+            self.buf += data
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def read(self):
+        n, = struct.unpack('<I', self.recv(4))
+        val, _ = decode(self.recv(n), 0)
+        return val
+
+    def __call__(self, *args):
+        self.send(*args)
+        return self.read()
+
+    # run the commands in batches, the socket buffers are not unlimited
+    def run(self, cmds, batch=1000):
+        out = []
+        for i in range(0, len(cmds), batch):
+            for cmd in cmds[i:i + batch]:
+                self.send(*cmd)
+            out += [self.read() for _ in cmds[i:i + batch]]
+        return out
+
+def decode(data, i):
+    tag = data[i]
+    i += 1
+    if tag == 0:
+        return None, i
+    if tag == 1:
+        code, n = struct.unpack_from('<II', data, i)
+        return ('err', code, data[i + 8:i + 8 + n].decode()), i + 8 + n
+    if tag == 2:
+        n, = struct.unpack_from('<I', data, i)
+        return data[i + 4:i + 4 + n].decode('utf-8', 'surrogateescape'), i + 4 + n
+    if tag == 3:
+        return struct.unpack_from('<q', data, i)[0], i + 8
+    if tag == 4:
+        return struct.unpack_from('<d', data, i)[0], i + 8
+    assert tag == 5
+    n, = struct.unpack_from('<I', data, i)
+    i += 4
+    arr = []
+    for _ in range(n):
+        val, i = decode(data, i)
+        arr.append(val)
+    return arr, i
+
+# tiered storage: cold values are moved to the file and read back,
+# the file is compacted when most of it is garbage
+srv = server_start(1235, '--spill-file', 'spill', '--spill-after-ms', '10')
+files = lambda: sorted(glob.glob(f'spill.{srv.pid}.*'))
+val = 'v' * (100 << 10)
+for i in range(0, 20, 5):
+    client(1235, 'mset', *[x for j in range(i, i + 5) for x in (f'k{j}', f'{val}{j}')])
+size = 20 * (len(val) + 2) - 10
+wait_until(lambda: os.path.getsize(files()[0]) == size)
+assert client(1235, 'get', 'k5') == f'(str) {val}5\n'
+for i in range(15):
+    client(1235, 'del', f'k{i}')
+wait_until(lambda: files() == [f'spill.{srv.pid}.1'])
+for i in range(15, 20):
+    assert client(1235, 'get', f'k{i}') == f'(str) {val}{i}\n'
+server_stop(srv)
+for f in files():
+    os.remove(f)
+
+# active defrag: deleting most of the keys leaves sparse pages behind,
+# the live data is moved out of them and the RSS goes down
+srv = server_start(1236, '--active-defrag')
+conn = Conn(1236)
+val = 'd' * 1000
+conn.run([('set', f'k{i}', f'{val}{i}') for i in range(100000)])
+conn.run([('del', f'k{i}') for i in range(100000) if i % 4])
+wait_until(lambda: 'defrag done' in server_log(1236), timeout=60)
+rss = [int(x) for x in re.findall(r'rss: (\d+)', server_log(1236))]
+assert rss[1] < rss[0], rss
+keys = [f'k{i}' for i in range(0, 100000, 4)]
+assert conn.run([('get', k) for k in keys]) == [f'{val}{k[1:]}' for k in keys]
+assert conn('dbsize') == len(keys)
+server_stop(srv)
+
+# huge pages: the TTL heap outgrows 2MB and is madvise()d for huge pages,
+# the timers keep working
+srv = server_start(1237, '--hugepages')
+conn = Conn(1237)
+conn.run([('set', f'k{i}', i) for i in range(71000)])
+conn.run([('pexpire', f'k{i}', 100 if i < 1000 else 1000000) for i in range(71000)])
+with open(f'/proc/{srv.pid}/smaps') as fp:
+    flags = re.findall(r'^VmFlags:(.*)$', fp.read(), re.M)
+assert any(' hg' in x for x in flags)
+wait_until(lambda: conn('dbsize') == 70000)
+assert all(0 < x <= 1000000 for x in conn.run([('pttl', f'k{i}') for i in range(1000, 71000)]))
+assert conn.run([('get', f'k{i}') for i in range(71000)]) == [None] * 1000 + [str(i) for i in range(1000, 71000)]
+server_stop(srv)
+
+# the TTLs in the side arrays of metadata stay with their keys as the
+# slots are freed, reused, renamed and moved across many MetaChunks
+srv = server_start(1238)
+conn = Conn(1238)
+ttl = {f'm{i}': 1000000 + i * 100 for i in range(10000)}
+conn.run([('set', k, 1) for k in ttl])
+conn.run([('pexpire', k, t) for k, t in ttl.items()])
+conn.run([('del', f'm{i}') for i in range(0, 10000, 3)])
+ttl = {k: t for k, t in ttl.items() if int(k[1:]) % 3}
+reused = {f'n{i}': 3000000 + i * 100 for i in range(3000)}
+conn.run([('set', k, 1) for k in reused])
+conn.run([('pexpire', k, t) for k, t in reused.items()])
+ttl.update(reused)
+renamed = [k for k in ttl if k[0] == 'm' and int(k[1:]) % 7 == 1]
+assert conn.run([('rename', k, 'r' + k) for k in renamed]) == [None] * len(renamed)
+ttl.update({'r' + k: ttl.pop(k) for k in renamed})
+moved = {k: ttl.pop(k) for k in list(ttl) if k[0] == 'm' and int(k[1:]) % 11 == 2}
+assert conn.run([('move', k, 1) for k in moved]) == [1] * len(moved)
+expired = list(ttl)[::5]
+conn.run([('pexpire', k, 50) for k in expired])
+for k in expired:
+    del ttl[k]
+conn.run([('zadd', f'z{i}', 1, 'a', 'px', 50 + i % 100) for i in range(5000)])
+conn.run([('zadd', f'z{i}', 2, 'b', 'px', 1000000) for i in range(5000)])
+wait_until(lambda: conn('dbsize') == len(ttl) + 5000)
+pttl = conn.run([('pttl', k) for k in ttl])
+assert all(t - 60000 < x <= t for x, t in zip(pttl, ttl.values()))
+wait_until(lambda: conn.run([('zscore', f'z{i}', 'a') for i in range(5000)]) == [None] * 5000)
+assert conn.run([('zscore', f'z{i}', 'b') for i in range(5000)]) == [2.0] * 5000
+assert conn('select', 1) is None
+pttl = conn.run([('pttl', k) for k in moved])
+assert all(t - 60000 < x <= t for x, t in zip(pttl, moved.values()))
+server_stop(srv)
+
+# BGSAVE: the snapshot is the data at the time of the command even though
+# the writes go on while it's written, and it's loaded on the next start
+for f in glob.glob('snap.test*'):
+    os.remove(f)
+srv = server_start(1239, '--snapshot-file', 'snap.test')
+conn = Conn(1239)
+conn.run([('set', f'k{i}', f'old{i}') for i in range(20000)])
+conn.run([('hset', 'h', f'f{i}', i) for i in range(100)])
+conn.run([('zadd', 'z', i, f'm{i}') for i in range(100)])
+assert conn('pexpire', 'k0', 1000000) == 1
+conn.run([('select', 3), ('set', 'k3', 'db3'), ('select', 0)])
+cmds = [('bgsave',)]
+cmds += [('set', f'k{i}', f'new{i}') for i in range(0, 20000, 2)]
+cmds += [('del', f'k{i}') for i in range(1, 20000, 2)]
+cmds += [('set', f'x{i}', 1) for i in range(1000)]
+cmds += [('hdel', 'h', 'f0'), ('zrem', 'z', 'm0')]
+assert conn.run(cmds)[0] is None
+wait_until(lambda: 'snapshot done' in server_log(1239))
+assert conn('lastsave') > 0
+server_stop(srv)
+srv = server_start(1239, '--snapshot-file', 'snap.test')
+assert 'loaded 20003 keys' in server_log(1239)
+conn = Conn(1239)
+assert conn.run([('get', f'k{i}') for i in range(20000)]) == [f'old{i}' for i in range(20000)]
+assert conn('get', 'x0') is None
+assert conn('hlen', 'h') == 100
+assert conn('zscore', 'z', 'm0') == 0.0
+assert 990000 < conn('pttl', 'k0') <= 1000000
+assert conn.run([('select', 3), ('get', 'k3')]) == [None, 'db3']
+server_stop(srv)
+os.remove('snap.test')
+
+# reader threads: GETs on the read port see either the old or the new value
+# while the keys are written, deleted and the table is resized
+srv = server_start(1240, '--read-port', '1241', '--read-threads', '2')
+conn = Conn(1240)
+conn.run([('set', f'k{i}', f'{i}:0') for i in range(1000)])
+errors = []
+done = threading.Event()
+def reader(seed):
+    rconn = Conn(1241)
+    last = [0] * 1000
+    keys = [(seed * 7919 + j * 31) % 1000 for j in range(1000)]
+    while not done.is_set():
+        for i, val in zip(keys, rconn.run([('get', f'k{i}') for i in keys])):
+            if val is None and i % 10 == 0:
+                continue    # deleted
+            key, gen = val.split(':')
+            if int(key) != i or int(gen) < last[i]:
+                errors.append((i, val))
+            last[i] = int(gen)
+readers = [threading.Thread(target=reader, args=(x,)) for x in range(2)]
+for t in readers:
+    t.start()
+for gen in range(1, 20):
+    cmds = [('set', f'k{i}', f'{i}:{gen}') for i in range(1000)]
+    cmds += [('del', f'k{i}') for i in range(0, 1000, 10)]
+    cmds += [('set', f'g{gen}:{i}', i) for i in range(2000)]
+    conn.run(cmds)
+done.set()
+for t in readers:
+    t.join()
+assert not errors, errors[:10]
+assert Conn(1241)('get', 'k1') == '1:19'
+assert Conn(1241)('set', 'k1', 'x') == ('err', 1, 'read-only connection')
+
+# a sync FLUSHDB frees the entries only after the readers are done with them
+assert conn('flushdb') is None
+done.clear()
+def flush_reader():
+    rconn = Conn(1241)
+    while not done.is_set():
+        for val in rconn.run([('get', f'k{i}') for i in range(200)]):
+            if val is not None and val != val[0] * 10000:
+                errors.append(val[:10])
+readers = [threading.Thread(target=flush_reader) for x in range(4)]
+for t in readers:
+    t.start()
+for gen in range(20):
+    val = chr(ord('a') + gen) * 10000
+    conn.run([('set', f'k{i}', val) for i in range(200)] + [('flushdb',)])
+done.set()
+for t in readers:
+    t.join()
+assert not errors, errors[:10]
+assert conn('dbsize') == 0
+server_stop(srv)
+
+# zset member TTLs: a read deletes a bounded number of expired members,
+# the timer deletes the rest, and the key when none is left
+conn = Conn(1234)
+conn.run([('zadd', 'zttl', i, f'm{i}', 'px', 20) for i in range(5000)])
+conn.run([('zadd', 'zttl2', 1, 'a', 'px', 20), ('zadd', 'zttl2', 2, 'b')])
+time.sleep(0.1)
+assert conn('zscore', 'zttl', 'm0') is None
+assert conn('zincrby', 'zttl2', 5, 'a') == 5.0
+wait_until(lambda: conn('pttl', 'zttl') == -2)
+assert conn('zadd', 'zttl', 1, 'a') == 1
+assert conn.run([('del', 'zttl'), ('del', 'zttl2')]) == [1, 1]
+
+# RESTORE rejects a hash payload with a duplicate field
+def str_hash(data):
+    h = 0x811C9DC5
+    for ch in data:
+        h = ((h + ch) * 0x01000193) & 0xFFFFFFFF
+    return h
+assert conn('hset', 'hdup', 'f1', 'a', 'f2', 'b') == 2
+data = conn('dump', 'hdup').encode('utf-8', 'surrogateescape')[:-4].replace(b'f2', b'f1')
+data += struct.pack('<I', str_hash(data))
+assert conn('restore', 'hdup2', 0, data) == ('err', 4, 'bad payload')
+assert conn('pttl', 'hdup2') == -2
+assert conn('del', 'hdup') == 1
+
+# namespaces: only the commands on keys are counted, and a write is checked
+# by the size of the namespace after it
+assert conn('ns.set', 'q:', 0, 1000) is None
+ns_info = lambda: re.search(r'prefix=q:,keys=(\d+),bytes=(\d+),ops=(\d+)', conn('info')).groups()
+assert conn('set', 'q:a', 'x' * 100) is None
+keys, size, ops = ns_info()
+assert conn.run([('ns.set', 'q:', 0, 1000), ('ft.search', 'q:', '*')])[0] is None
+assert ns_info() == (keys, size, ops)
+assert conn('set', 'q:b', 'x' * 900) == ('err', 5, 'namespace over quota')
+assert conn('set', 'q:a', 'x' * 800) is None
+assert conn('ns.set', 'q:', 0, 1000, 'evict') is None
+assert conn('set', 'q:b', 'x' * 800) is None
+assert conn.run([('get', 'q:a'), ('pttl', 'q:b')]) == [None, -1]
+assert conn('set', 'q:c', 'x' * 2000) == ('err', 5, 'namespace over quota')
+assert conn('get', 'q:b') == 'x' * 800
+assert conn.run([('ns.del', 'q:'), ('del', 'q:b')]) == [1, 1]
+
+# TOPK.ADD tells an expelled empty item from none
+assert conn('topk.reserve', 'tke', 1) is None
+assert conn('topk.add', 'tke', '') == [None]
+assert conn('topk.add', 'tke', 'x', 'x', 'x') == [None, '', None]
+assert conn('del', 'tke') == 1
+
+# a JSON document stays within the depth it can be parsed again at
+assert conn('json.set', 'jd', '$', '[' * 128 + ']' * 128) == 1
+assert conn('json.set', 'jd', '$' + '[0]' * 127, '[1]') == ('err', 4, 'json too deep')
+assert conn('json.arrappend', 'jd', '$' + '[0]' * 126, '[]', '[[]]') == ('err', 4, 'json too deep')
+assert conn('json.arrappend', 'jd', '$' + '[0]' * 126, 1) == 2
+assert conn('copy', 'jd', 'jd2') == 1
+assert conn('restore', 'jd3', 0, conn('dump', 'jd')) is None
+assert conn('json.get', 'jd3') == '[' * 127 + '[],1' + ']' * 127
+assert conn.run([('del', 'jd'), ('del', 'jd2'), ('del', 'jd3')]) == [1, 1, 1]
+
+# a rename within a namespace keeps the number of keys, and the keys of
+# a command are never evicted for it
+assert conn.run([('ns.set', 't:', 1, 1000000), ('set', 't:a', 1), ('rename', 't:a', 't:b')]) == [None] * 3
+assert conn('get', 't:b') == '1'
+assert conn.run([('ns.set', 'u:', 2, 0, 'evict'), ('set', 'u:a', 1), ('set', 'u:b', 2)]) == [None] * 3
+assert conn.run([('copy', 'u:a', 'u:c'), ('get', 'u:a'), ('get', 'u:b')]) == [1, '1', None]
+assert conn.run([('rename', 'u:a', 'u:b'), ('get', 'u:b'), ('get', 'u:c')]) == [None, '1', '1']
+# a move is a new key in the namespace of the other database
+assert conn.run([('select', 1), ('ns.set', 'm:', 1, 0), ('set', 'm:x', 1), ('select', 0)]) == [None] * 4
+assert conn.run([('set', 'm:y', 2), ('move', 'm:y', 1)]) == [None, ('err', 5, 'namespace over quota')]
+assert conn.run([('select', 1), ('ns.del', 'm:'), ('del', 'm:x'), ('select', 0), ('del', 'm:y')]) == [None, 1, 1, None, 1]
+assert conn.run([('ns.del', 't:'), ('ns.del', 'u:'), ('del', 't:b'), ('del', 'u:b'), ('del', 'u:c')]) == [1] * 5
+
+# VSIM: the deleted vectors of the graph don't take the place of the live
+# ones, and the set is compacted while it's changed
+conn.run([('vadd', 'vt', i, 'l2', i, 0) for i in range(3000)])
+time.sleep(0.5)
+assert conn.run([('vrem', 'vt', i) for i in range(3000) if i % 100]) == [1] * 2970
+assert conn.run([('vadd', 'vt', 'n1', 50, 0), ('vrem', 'vt', 200)]) == [1, 1]
+near = ['0', 'n1', '100'] + [str(i) for i in range(300, 1000, 100)]
+assert conn('vsim', 'vt', 10, 0, 0, 'ef', 10)[::2] == near
+time.sleep(0.5)
+assert conn('vsim', 'vt', 10, 0, 0, 'ef', 10)[::2] == near
+assert conn.run([('vcard', 'vt'), ('del', 'vt')]) == [30, 1]
 
-cmds = []
-outputs = []
-lines = CASES.splitlines()
-for x in lines:
-    x = x.strip()
-    if not x:
-        continue
-    if x.startswith('$ ')
-        cmds.append(x[2:]);
-        outputs.append('');
-    else:
-        outputs[-1] = outputs[-1] + x + '\n'
-
-assert len(cmds) == len(outputs)
-for cmd, expect in zip(cmds, outputs):
-    out = subprocess.check_output(shlex.split(cmd)).decode('utf-8')
-    assert out == expect, f'cmd:{cmd} out:{out} expect:{expect}'
\ No newline at end of file
+# HOTUPGRADE: the connections, the keys, the indexes and the namespaces are
+# handed over to the new process
+srv = server_start(1242)
+conn = Conn(1242)
+conn.run([('hset', f'user:{i}', 'age', 20 + i, 'country', 'DE') for i in range(10)])
+assert conn.run([
+    ('ft.create', 'users', 'user:', 'age', 'numeric', 'country', 'tag'),
+    ('ns.set', 'user:', 10, 0), ('select', 2), ('ns.set', 'q:', 0, 1000, 'evict'),
+    ('set', 'q:a', 'x'), ('select', 0),
+]) == [None] * 6
+namespaces = lambda: re.sub(r'ops_per_sec=\d+', '', conn('info'))
+before = namespaces()
+pid = conn('hotupgrade')
+srv.wait()
+wait_until(lambda: 'took over' in server_log(1242))
+assert namespaces() == before
+assert conn('ft.search', 'users', '@age:[20 21] @country:{DE}') == [2, 'user:0', 'user:1']
+assert conn('set', 'user:x', 1) == ('err', 5, 'namespace over quota')
+assert conn.run([('select', 2), ('get', 'q:a'), ('select', 0)]) == [None, 'x', None]
+os.kill(pid, 15)
@@ -0,0 +1,847 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+
+#include "vset.h"
+#include "common.h"
+
+// the distance kernels, compiled for each ISA and picked at runtime
+
+static float dot_f32(const float* a, const float* b, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static float l2_f32(const float* a, const float* b, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static int32_t dot_i8(const int8_t* a, const int8_t* b, size_t n) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_f32_avx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_f32_avx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_i8_avx2(const int8_t* a, const int8_t* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // widen to int16, then multiply and add pairs into int32
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i lo = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    lo = _mm_hadd_epi32(lo, lo);
+    lo = _mm_hadd_epi32(lo, lo);
+    int32_t sum = _mm_cvtsi128_si32(lo);
+    for (; i < n; i++) {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+// not `_mm512_reduce_add_ps()`, which trips -Wuninitialized in GCC 12 headers
+__attribute__((target("avx512f")))
+static float hsum_avx512(__m512 v) {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float sum = 0;
+    for (float x : lanes) {
+        sum += x;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_f32_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc);
+    }
+    return hsum_avx512(acc);
+}
+
+__attribute__((target("avx512f")))
+static float l2_f32_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return hsum_avx512(acc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int32_t dot_i8_avx512(const int8_t* a, const int8_t* b, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a + i)));
+        __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    }
+    alignas(64) int32_t lanes[16];
+    _mm512_store_si512(lanes, acc);
+    int32_t sum = 0;
+    for (int32_t x : lanes) {
+        sum += x;
+    }
+    for (; i < n; i++) {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+static struct {
+    int isa = -1;
+    float (*dot)(const float*, const float*, size_t) = NULL;
+    float (*l2)(const float*, const float*, size_t) = NULL;
+    int32_t (*dot_i8)(const int8_t*, const int8_t*, size_t) = NULL;
+} g_kern;
+
+void vset_use_isa(int isa) {
+    g_kern.isa = isa;
+    if (isa >= 2) {
+        g_kern.dot = &dot_f32_avx512;
+        g_kern.l2 = &l2_f32_avx512;
+        g_kern.dot_i8 = &dot_i8_avx512;
+    } else if (isa == 1) {
+        g_kern.dot = &dot_f32_avx2;
+        g_kern.l2 = &l2_f32_avx2;
+        g_kern.dot_i8 = &dot_i8_avx2;
+    } else {
+        g_kern.dot = &dot_f32;
+        g_kern.l2 = &l2_f32;
+        g_kern.dot_i8 = &dot_i8;
+    }
+}
+
+int vset_isa() {
+    if (g_kern.isa < 0) {
+        int isa = 0;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            isa = 2;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            isa = 1;
+        }
+        vset_use_isa(isa);
+    }
+    return g_kern.isa;
+}
+
+// the vector storage
+
+const uint32_t k_vchunk = 1024;
+
+static uint8_t* chunk_new(const VStore &st) {
+    size_t size = st.q8
+        ? (size_t)k_vchunk * st.dim + 2 * k_vchunk * sizeof(float)
+        : (size_t)k_vchunk * st.dim * sizeof(float);
+    uint8_t* chunk = (uint8_t*)malloc(size);
+    assert(chunk);
+    return chunk;
+}
+
+// a vector to be compared, either in the store or a prepared query
+struct VVec {
+    const float* f = NULL;
+    const int8_t* q = NULL;
+    float scale = 0;
+    float norm = 0;
+};
+
+static VVec store_vec(const VStore &st, uint32_t slot) {
+    uint8_t* chunk = st.chunks[slot / k_vchunk];
+    uint32_t idx = slot % k_vchunk;
+    VVec v;
+    if (st.q8) {
+        v.q = (const int8_t*)chunk + (size_t)idx * st.dim;
+        const float* meta = (const float*)(chunk + (size_t)k_vchunk * st.dim);
+        v.scale = meta[idx];
+        v.norm = meta[k_vchunk + idx];
+    } else {
+        v.f = (const float*)chunk + (size_t)idx * st.dim;
+    }
+    return v;
+}
+
+static float vdist(const VStore &st, const VVec &a, const VVec &b) {
+    if (!st.q8) {
+        if (st.metric == VM_L2) {
+            return g_kern.l2(a.f, b.f, st.dim);
+        }
+        float dot = g_kern.dot(a.f, b.f, st.dim);
+        return st.metric == VM_COS ? 1 - dot : -dot;
+    }
+    float dot = (float)g_kern.dot_i8(a.q, b.q, st.dim) * a.scale * b.scale;
+    if (st.metric == VM_L2) {
+        return a.norm + b.norm - 2 * dot;
+    }
+    return st.metric == VM_COS ? 1 - dot : -dot;
+}
+
+static float vdist(const VStore &st, const VVec &a, uint32_t slot) {
+    return vdist(st, a, store_vec(st, slot));
+}
+
+// a vector in the stored form: normalized for cosine, maybe quantized
+struct VPrepared {
+    std::vector<float> f;
+    std::vector<int8_t> q;
+    VVec vec;
+};
+
+static void vec_prepare(const VStore &st, const float* in, VPrepared &out) {
+    out.f.assign(in, in + st.dim);
+    if (st.metric == VM_COS) {
+        float norm = sqrtf(dot_f32(in, in, st.dim));
+        for (uint32_t i = 0; norm > 0 && i < st.dim; i++) {
+            out.f[i] /= norm;
+        }
+    }
+    out.vec = VVec{};
+    if (!st.q8) {
+        out.vec.f = out.f.data();
+        return;
+    }
+    // symmetric per-vector scale: the max magnitude maps to 127
+    float amax = 0;
+    for (float x : out.f) {
+        amax = std::max(amax, fabsf(x));
+    }
+    float scale = amax / 127;
+    out.q.resize(st.dim);
+    float norm = 0;
+    for (uint32_t i = 0; i < st.dim; i++) {
+        long x = scale > 0 ? lrintf(out.f[i] / scale) : 0;
+        out.q[i] = (int8_t)std::min(127L, std::max(-127L, x));
+        norm += (out.q[i] * scale) * (out.q[i] * scale);
+    }
+    out.vec.q = out.q.data();
+    out.vec.scale = scale;
+    out.vec.norm = norm;
+}
+
+static void store_put(VStore &st, uint32_t slot, const VPrepared &v) {
+    if (slot / k_vchunk >= st.chunks.size()) {
+        st.chunks.push_back(chunk_new(st));
+    }
+    uint8_t* chunk = st.chunks[slot / k_vchunk];
+    uint32_t idx = slot % k_vchunk;
+    if (st.q8) {
+        memcpy(chunk + (size_t)idx * st.dim, v.q.data(), st.dim);
+        float* meta = (float*)(chunk + (size_t)k_vchunk * st.dim);
+        meta[idx] = v.vec.scale;
+        meta[k_vchunk + idx] = v.vec.norm;
+    } else {
+        memcpy(chunk + (size_t)idx * st.dim * sizeof(float), v.f.data(), st.dim * sizeof(float));
+    }
+}
+
+// the stored form of a slot to a slot of another store
+static void store_copy(VStore &dst, uint32_t dslot, const VStore &src, uint32_t sslot) {
+    if (dslot / k_vchunk >= dst.chunks.size()) {
+        dst.chunks.push_back(chunk_new(dst));
+    }
+    const uint8_t* from = src.chunks[sslot / k_vchunk];
+    uint8_t* to = dst.chunks[dslot / k_vchunk];
+    uint32_t sidx = sslot % k_vchunk;
+    uint32_t didx = dslot % k_vchunk;
+    if (src.q8) {
+        memcpy(to + (size_t)didx * dst.dim, from + (size_t)sidx * src.dim, src.dim);
+        const float* smeta = (const float*)(from + (size_t)k_vchunk * src.dim);
+        float* dmeta = (float*)(to + (size_t)k_vchunk * dst.dim);
+        dmeta[didx] = smeta[sidx];
+        dmeta[k_vchunk + didx] = smeta[k_vchunk + sidx];
+    } else {
+        memcpy(to + (size_t)didx * dst.dim * sizeof(float),
+            from + (size_t)sidx * src.dim * sizeof(float), src.dim * sizeof(float));
+    }
+}
+
+// HNSW: a hierarchy of proximity graphs, the upper levels are sparser,
+// a search descends greedily and then explores the bottom level;
+// a graph is immutable once installed in the set, it's extended on a copy
+
+const uint32_t k_hnsw_m = 16;           // links per node on the upper levels
+const uint32_t k_hnsw_m0 = 32;          // links per node on level 0
+const uint32_t k_hnsw_ef_build = 100;   // candidates while inserting
+const int k_hnsw_max_level = 15;
+
+struct HNSW {
+    uint32_t n = 0;             // the nodes are slots [0, n)
+    uint32_t entry = 0;
+    int max_level = -1;
+    std::vector<uint8_t> levels;
+    // | count | links... | per node, `k_hnsw_m0` links on level 0
+    std::vector<uint32_t> links0;
+    // the same for levels [1, level] of a node, `k_hnsw_m` links each
+    std::vector<std::vector<uint32_t>> upper;
+};
+
+static uint32_t* hnsw_links(HNSW* g, uint32_t node, int level) {
+    if (level == 0) {
+        return &g->links0[(size_t)node * (1 + k_hnsw_m0)];
+    }
+    return &g->upper[node][(size_t)(level - 1) * (1 + k_hnsw_m)];
+}
+
+static uint32_t hnsw_cap(int level) {
+    return level == 0 ? k_hnsw_m0 : k_hnsw_m;
+}
+
+// a random level with P(level >= l) = M^-l, from a hash of the slot
+static int hnsw_level(uint32_t slot) {
+    uint64_t x = slot + 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);   // (0, 1]
+    int level = (int)(-log(u) / log((double)k_hnsw_m));
+    return std::min(level, k_hnsw_max_level);
+}
+
+// per-thread state of searches
+struct VScratch {
+    std::vector<uint32_t> visited;  // the node is visited if == epoch
+    uint32_t epoch = 0;
+    std::vector<VResult> cands;     // min-heap
+    std::vector<VResult> found;     // max-heap
+};
+
+static bool res_less(const VResult &a, const VResult &b) {
+    return a.dist < b.dist;
+}
+
+static bool res_greater(const VResult &a, const VResult &b) {
+    return a.dist > b.dist;
+}
+
+static void scratch_reset(VScratch &s, uint32_t n) {
+    if (s.visited.size() < n) {
+        s.visited.resize(n, 0);
+    }
+    if (++s.epoch == 0) {
+        std::fill(s.visited.begin(), s.visited.end(), 0);
+        s.epoch = 1;
+    }
+}
+
+// greedy descent on an upper level
+static VResult hnsw_greedy(HNSW* g, const VStore &st, const VVec &q, VResult cur, int level) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        uint32_t* links = hnsw_links(g, cur.slot, level);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            float d = vdist(st, q, links[i]);
+            if (d < cur.dist) {
+                cur = VResult{d, links[i]};
+                changed = true;
+            }
+        }
+    }
+    return cur;
+}
+
+// the `ef` nearest nodes reachable from `ep` on a level, sorted by distance
+static void hnsw_search_level(HNSW* g, const VStore &st, const VVec &q, VResult ep,
+    int level, size_t ef, VScratch &s, std::vector<VResult> &out)
+{
+    scratch_reset(s, (uint32_t)g->levels.size());   // with the nodes being added
+    s.cands.clear();
+    s.found.clear();
+    s.visited[ep.slot] = s.epoch;
+    s.cands.push_back(ep);
+    s.found.push_back(ep);
+    while (!s.cands.empty()) {
+        std::pop_heap(s.cands.begin(), s.cands.end(), res_greater);
+        VResult c = s.cands.back();
+        s.cands.pop_back();
+        if (c.dist > s.found.front().dist && s.found.size() >= ef) {
+            break;  // all the remaining candidates are farther
+        }
+        uint32_t* links = hnsw_links(g, c.slot, level);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            __builtin_prefetch(&s.visited[links[i]]);
+        }
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            uint32_t nb = links[i];
+            if (s.visited[nb] == s.epoch) {
+                continue;
+            }
+            s.visited[nb] = s.epoch;
+            float d = vdist(st, q, nb);
+            if (s.found.size() < ef || d < s.found.front().dist) {
+                s.cands.push_back(VResult{d, nb});
+                std::push_heap(s.cands.begin(), s.cands.end(), res_greater);
+                s.found.push_back(VResult{d, nb});
+                std::push_heap(s.found.begin(), s.found.end(), res_less);
+                if (s.found.size() > ef) {
+                    std::pop_heap(s.found.begin(), s.found.end(), res_less);
+                    s.found.pop_back();
+                }
+            }
+        }
+    }
+    out.assign(s.found.begin(), s.found.end());
+    std::sort(out.begin(), out.end(), res_less);
+}
+
+// keep the candidates that are closer to the base than to any kept one,
+// which spreads the links in different directions
+static void hnsw_select(const VStore &st, std::vector<VResult> &cands, uint32_t m) {
+    std::sort(cands.begin(), cands.end(), res_less);
+    std::vector<VResult> kept;
+    for (const VResult &c : cands) {
+        if (kept.size() >= m) {
+            break;
+        }
+        VVec cv = store_vec(st, c.slot);
+        bool good = true;
+        for (const VResult &r : kept) {
+            if (vdist(st, cv, r.slot) < c.dist) {
+                good = false;
+                break;
+            }
+        }
+        if (good) {
+            kept.push_back(c);
+        }
+    }
+    cands.swap(kept);
+}
+
+// add a backward link, the links are reselected if full
+static void hnsw_link(HNSW* g, const VStore &st, uint32_t node, uint32_t to, int level) {
+    uint32_t* links = hnsw_links(g, node, level);
+    uint32_t cap = hnsw_cap(level);
+    if (links[0] < cap) {
+        links[++links[0]] = to;
+        return;
+    }
+    VVec nv = store_vec(st, node);
+    std::vector<VResult> cands;
+    for (uint32_t i = 1; i <= links[0]; i++) {
+        cands.push_back(VResult{vdist(st, nv, links[i]), links[i]});
+    }
+    cands.push_back(VResult{vdist(st, nv, to), to});
+    hnsw_select(st, cands, cap);
+    links[0] = (uint32_t)cands.size();
+    for (uint32_t i = 0; i < links[0]; i++) {
+        links[i + 1] = cands[i].slot;
+    }
+}
+
+static void hnsw_insert(HNSW* g, const VStore &st, uint32_t node, VScratch &s) {
+    int level = g->levels[node];
+    if (level > 0) {
+        g->upper[node].assign((size_t)level * (1 + k_hnsw_m), 0);
+    }
+    if (g->max_level < 0) {
+        g->entry = node;
+        g->max_level = level;
+        return;
+    }
+
+    VVec q = store_vec(st, node);
+    VResult ep = {vdist(st, q, g->entry), g->entry};
+    for (int l = g->max_level; l > level; l--) {
+        ep = hnsw_greedy(g, st, q, ep, l);
+    }
+    std::vector<VResult> cands;
+    for (int l = std::min(level, g->max_level); l >= 0; l--) {
+        hnsw_search_level(g, st, q, ep, l, k_hnsw_ef_build, s, cands);
+        ep = cands[0];
+        hnsw_select(st, cands, k_hnsw_m);
+        uint32_t* links = hnsw_links(g, node, l);
+        links[0] = (uint32_t)cands.size();
+        for (uint32_t i = 0; i < links[0]; i++) {
+            links[i + 1] = cands[i].slot;
+        }
+        for (const VResult &c : cands) {
+            hnsw_link(g, st, c.slot, node, l);
+        }
+    }
+    if (level > g->max_level) {
+        g->entry = node;
+        g->max_level = level;
+    }
+}
+
+// nodes of slots [g->n, n)
+static void hnsw_extend(HNSW* g, const VStore &st, uint32_t n) {
+    g->levels.resize(n);
+    g->links0.resize((size_t)n * (1 + k_hnsw_m0), 0);
+    g->upper.resize(n);
+    VScratch s;
+    for (uint32_t node = g->n; node < n; node++) {
+        g->levels[node] = (uint8_t)hnsw_level(node);
+        hnsw_insert(g, st, node, s);
+    }
+    g->n = n;
+}
+
+// the build job
+
+// slots are indexed in batches of at least this many, or 1/16 of the graph,
+// since each build copies the graph
+const uint32_t k_vset_graph_batch = 1024;
+
+// the set is compacted when 1/4 of the slots are deleted, deleted nodes
+// still route searches, but too many of them leave too few results
+const uint32_t k_vset_tomb_min = 1024;
+
+struct VBuild {
+    VSet* vset = NULL;      // NULL if the set was deleted meanwhile
+    VStore store;           // a copy of the chunk list
+    HNSW* base = NULL;      // the graph to extend, owned by the set
+    HNSW* graph = NULL;     // the result
+    uint32_t n = 0;         // slots [0, n) are indexed
+    // compaction: the live slots of [0, n) go to slots [0, live.size())
+    // of `fresh`, which the graph is built for
+    bool compact = false;
+    std::vector<uint32_t> live;
+    VStore fresh;
+};
+
+static bool vset_need_compact(VSet* vset) {
+    return vset->ntombs >= k_vset_tomb_min && vset->ntombs > vset->nslots / 4;
+}
+
+VBuild* vset_build_begin(VSet* vset) {
+    uint32_t indexed = vset->hnsw ? vset->hnsw->n : 0;
+    uint32_t batch = std::max(k_vset_graph_batch, indexed / 16);
+    bool compact = vset_need_compact(vset);
+    if (vset->build || (!compact && vset->nslots - indexed < batch)) {
+        return NULL;
+    }
+    VBuild* build = new VBuild();
+    build->vset = vset;
+    build->store = vset->store;
+    build->base = vset->hnsw;
+    build->n = vset->nslots;
+    build->compact = compact;
+    if (compact) {
+        build->live.reserve(vset->nslots - vset->ntombs);
+        for (uint32_t slot = 0; slot < vset->nslots; slot++) {
+            if (vset->slots[slot]) {
+                build->live.push_back(slot);
+            }
+        }
+        build->fresh.dim = vset->store.dim;
+        build->fresh.metric = vset->store.metric;
+        build->fresh.q8 = vset->store.q8;
+    }
+    vset->build = build;
+    return build;
+}
+
+void vset_build_run(VBuild* build) {
+    if (build->compact) {
+        uint32_t n = (uint32_t)build->live.size();
+        for (uint32_t i = 0; i < n; i++) {
+            store_copy(build->fresh, i, build->store, build->live[i]);
+        }
+        build->graph = new HNSW();
+        hnsw_extend(build->graph, build->fresh, n);
+        return;
+    }
+    build->graph = build->base ? new HNSW(*build->base) : new HNSW();
+    hnsw_extend(build->graph, build->store, build->n);
+}
+
+static void store_free(VStore &st, size_t from) {
+    for (size_t i = from; i < st.chunks.size(); i++) {
+        free(st.chunks[i]);
+    }
+    st.chunks.resize(std::min(from, st.chunks.size()));
+}
+
+// switch the set to the compacted store, the slots changed meanwhile are
+// carried over: the removed ones are deleted again, the added ones appended
+static void vset_compact_finish(VSet* vset, VBuild* build) {
+    std::vector<VNode*> slots;
+    slots.reserve(build->live.size() + (vset->nslots - build->n));
+    uint32_t ntombs = 0;
+    for (uint32_t old : build->live) {
+        VNode* node = vset->slots[old];
+        if (node) {
+            node->slot = (uint32_t)slots.size();
+        } else {
+            ntombs++;
+        }
+        slots.push_back(node);
+    }
+    for (uint32_t old = build->n; old < vset->nslots; old++) {
+        if (VNode* node = vset->slots[old]) {
+            node->slot = (uint32_t)slots.size();
+            store_copy(build->fresh, node->slot, vset->store, old);
+            slots.push_back(node);
+        }
+    }
+    store_free(vset->store, 0);
+    vset->store = build->fresh;
+    vset->slots.swap(slots);
+    vset->nslots = (uint32_t)vset->slots.size();
+    vset->ntombs = ntombs;
+}
+
+VSet* vset_build_finish(VBuild* build) {
+    VSet* vset = build->vset;
+    if (vset) {
+        assert(vset->build == build && vset->hnsw == build->base);
+        if (build->compact) {
+            vset_compact_finish(vset, build);
+        }
+        delete vset->hnsw;
+        vset->hnsw = build->graph;
+        vset->build = NULL;
+    } else {
+        // the set is gone, the data it shared with the job is freed here
+        delete build->graph;
+        delete build->base;
+        store_free(build->store, 0);
+        store_free(build->fresh, 0);
+    }
+    delete build;
+    return vset;
+}
+
+// the set
+
+VSet* vset_new(uint32_t dim, uint32_t metric, bool q8) {
+    vset_isa();     // pick the kernels
+    VSet* vset = new VSet();
+    vset->store.dim = dim;
+    vset->store.metric = metric;
+    vset->store.q8 = q8;
+    return vset;
+}
+
+void vset_del(VSet* vset) {
+    for (VNode* node : vset->slots) {
+        delete node;
+    }
+    hm_clear(&vset->by_id);
+    if (vset->build) {
+        // the job owns the graph and the chunks it has seen
+        vset->build->vset = NULL;
+        store_free(vset->store, vset->build->store.chunks.size());
+    } else {
+        delete vset->hnsw;
+        store_free(vset->store, 0);
+    }
+    delete vset;
+}
+
+struct VKey {
+    HNode node;
+    const char* id = NULL;
+    size_t len = 0;
+};
+
+static bool vnode_eq(HNode* node, HNode* key) {
+    VNode* vnode = container_of(node, VNode, hmap);
+    VKey* vkey = container_of(key, VKey, node);
+    return vnode->id.size() == vkey->len && 0 == memcmp(vnode->id.data(), vkey->id, vkey->len);
+}
+
+static VNode* vset_lookup(VSet* vset, const char* id, size_t len) {
+    VKey key;
+    key.node.hcode = str_hash((const uint8_t*)id, len);
+    key.id = id;
+    key.len = len;
+    HNode* found = hm_lookup(&vset->by_id, &key.node, &vnode_eq);
+    return found ? container_of(found, VNode, hmap) : NULL;
+}
+
+// the vector goes to a new slot, the old slot of the id becomes a tombstone
+bool vset_add(VSet* vset, const char* id, size_t len, const float* vec) {
+    VPrepared v;
+    vec_prepare(vset->store, vec, v);
+    uint32_t slot = vset->nslots++;
+    store_put(vset->store, slot, v);
+
+    VNode* node = vset_lookup(vset, id, len);
+    bool added = !node;
+    if (node) {
+        vset->slots[node->slot] = NULL;
+        vset->ntombs++;
+    } else {
+        node = new VNode();
+        node->id.assign(id, len);
+        node->hmap.hcode = str_hash((const uint8_t*)id, len);
+        hm_insert(&vset->by_id, &node->hmap);
+    }
+    node->slot = slot;
+    vset->slots.push_back(node);
+    return added;
+}
+
+bool vset_remove(VSet* vset, const char* id, size_t len) {
+    VKey key;
+    key.node.hcode = str_hash((const uint8_t*)id, len);
+    key.id = id;
+    key.len = len;
+    HNode* found = hm_delete(&vset->by_id, &key.node, &vnode_eq);
+    if (!found) {
+        return false;
+    }
+    VNode* node = container_of(found, VNode, hmap);
+    vset->slots[node->slot] = NULL;
+    vset->ntombs++;
+    delete node;
+    return true;
+}
+
+size_t vset_size(VSet* vset) {
+    return hm_size(&vset->by_id);
+}
+
+void vset_get(VSet* vset, uint32_t slot, float* out) {
+    VVec v = store_vec(vset->store, slot);
+    for (uint32_t i = 0; i < vset->store.dim; i++) {
+        out[i] = v.f ? v.f[i] : v.q[i] * v.scale;
+    }
+}
+
+// keep the `k` nearest in a max-heap
+static void topk_push(std::vector<VResult> &heap, size_t k, VResult r) {
+    if (heap.size() < k) {
+        heap.push_back(r);
+        std::push_heap(heap.begin(), heap.end(), res_less);
+    } else if (r.dist < heap.front().dist) {
+        std::pop_heap(heap.begin(), heap.end(), res_less);
+        heap.back() = r;
+        std::push_heap(heap.begin(), heap.end(), res_less);
+    }
+}
+
+static void vset_scan(VSet* vset, const VVec &q, uint32_t begin, size_t k, std::vector<VResult> &heap) {
+    for (uint32_t slot = begin; slot < vset->nslots; slot++) {
+        if (vset->slots[slot]) {
+            topk_push(heap, k, VResult{vdist(vset->store, q, slot), slot});
+        }
+    }
+}
+
+void vset_search_flat(VSet* vset, const float* query, size_t k, std::vector<VResult> &out) {
+    VPrepared q;
+    vec_prepare(vset->store, query, q);
+    out.clear();
+    vset_scan(vset, q.vec, 0, k, out);
+    std::sort(out.begin(), out.end(), res_less);
+}
+
+void vset_search(VSet* vset, const float* query, size_t k, size_t ef, std::vector<VResult> &out) {
+    HNSW* g = vset->hnsw;
+    if (!g || g->max_level < 0) {
+        return vset_search_flat(vset, query, k, out);
+    }
+    VPrepared q;
+    vec_prepare(vset->store, query, q);
+    const VStore &st = vset->store;
+
+    // the graph, deleted nodes are still used for routing
+    static VScratch s;  // the event loop only
+    VResult ep = {vdist(st, q.vec, g->entry), g->entry};
+    for (int l = g->max_level; l > 0; l--) {
+        ep = hnsw_greedy(g, st, q.vec, ep, l);
+    }
+    // more candidates in proportion to the deleted slots
+    ef = std::min(std::max(ef, k), (size_t)vset->nslots);
+    ef += ef * vset->ntombs / std::max(vset->nslots - vset->ntombs, 1u);
+    std::vector<VResult> cands;
+    hnsw_search_level(g, st, q.vec, ep, 0, ef, s, cands);
+    out.clear();
+    for (const VResult &r : cands) {
+        if (vset->slots[r.slot]) {
+            topk_push(out, k, r);
+        }
+    }
+    // the slots not in the graph yet
+    vset_scan(vset, q.vec, g->n, k, out);
+    if (out.size() < k && out.size() < vset_size(vset)) {
+        // still too few, the graph is mostly deleted until it's compacted
+        out.clear();
+        vset_scan(vset, q.vec, 0, k, out);
+    }
+    std::sort(out.begin(), out.end(), res_less);
+}
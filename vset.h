@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+
+// a set of vectors keyed by id, searched by similarity,
+// small sets are scanned, big sets also have an HNSW graph
+enum {
+    VM_L2 = 0,      // squared euclidean distance
+    VM_COS = 1,     // 1 - cosine similarity, vectors are normalized
+    VM_DOT = 2,     // -dot product
+};
+
+struct HNSW;
+struct VBuild;
+
+// vectors by slot, in chunks that never move, so that the graph can be
+// built from a copy of this by another thread, slots are not reused
+// until the set is compacted into a new store
+struct VStore {
+    uint32_t dim = 0;
+    uint32_t metric = VM_COS;
+    bool q8 = false;                // int8 quantized, 1/4 of the memory
+    // float[k_vchunk][dim], or int8_t[k_vchunk][dim] then the scales and
+    // the squared norms as float[k_vchunk] each if `q8`
+    std::vector<uint8_t*> chunks;
+};
+
+struct VSet {
+    VStore store;
+    std::vector<struct VNode*> slots;   // NULL if deleted
+    uint32_t nslots = 0;
+    uint32_t ntombs = 0;            // the deleted slots
+    HMap by_id;
+    // the graph of slots [0, hnsw->n), the rest are scanned
+    HNSW* hnsw = NULL;
+    VBuild* build = NULL;           // the graph being built
+};
+
+struct VNode {
+    HNode hmap;
+    uint32_t slot = 0;
+    std::string id;
+};
+
+struct VResult {
+    float dist = 0;
+    uint32_t slot = 0;
+};
+
+VSet* vset_new(uint32_t dim, uint32_t metric, bool q8);
+// a build in progress is left to finish and free itself
+void vset_del(VSet* vset);
+// add or replace the vector of an id, returns true if added
+bool vset_add(VSet* vset, const char* id, size_t len, const float* vec);
+bool vset_remove(VSet* vset, const char* id, size_t len);
+size_t vset_size(VSet* vset);
+// the vector of a slot, dequantized if `q8`
+void vset_get(VSet* vset, uint32_t slot, float* out);
+// the `k` nearest vectors, `ef` is the HNSW candidate list size
+void vset_search(VSet* vset, const float* query, size_t k, size_t ef, std::vector<VResult> &out);
+// the exact `k` nearest vectors by a scan, for testing recall
+void vset_search_flat(VSet* vset, const float* query, size_t k, std::vector<VResult> &out);
+
+// the graph is built or extended off the event loop: `vset_build_begin()`
+// returns a job when the unindexed slots are too many, `vset_build_run()` runs
+// in the thread pool, then `vset_build_finish()` runs in the event loop and
+// returns the set, or NULL if it was deleted meanwhile;
+// when the deleted slots are too many, the job moves the live vectors to a
+// new store and builds the graph again instead
+VBuild* vset_build_begin(VSet* vset);
+void vset_build_run(VBuild* build);
+VSet* vset_build_finish(VBuild* build);
+
+// the distance kernels: 0 for scalar, 1 for AVX2, 2 for AVX-512,
+// the best one supported by the CPU is used by default
+int vset_isa();
+void vset_use_isa(int isa);
@@ -1,17 +1,53 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include "zset.h"
 #include "common.h"
+#include "defrag.h"
 
-static ZNode* znode_new(const char* name, size_t len, double score) {
+// map the double to an unsigned integer of the same order
+static uint64_t score_key(double score) {
+    if (score == 0) {
+        score = 0;  // -0.0 == +0.0
+    }
+    uint64_t bits = 0;
+    memcpy(&bits, &score, sizeof(bits));
+    // negative: reverse all; positive: above all negatives
+    return (bits >> 63) ? ~bits : bits | (1ull << 63);
+}
+
+// the same for int scores, by flipping the sign bit, see `znode_iscore()`
+static uint64_t int_key(int64_t score) {
+    return (uint64_t)score ^ (1ull << 63);
+}
+
+// the first 8 bytes of the name as a big-endian integer, zero padded
+static uint64_t prefix_key(const char* name, size_t len) {
+    uint64_t key = 0;
+    memcpy(&key, name, len < 8 ? len : 8);
+    return __builtin_bswap64(key);  // little-endian
+}
+
+static ZNode* znode_new(const char* name, size_t len, uint64_t skey, double score,
+    bool is_int)
+{
     ZNode* node = (ZNode* )malloc(sizeof(ZNode) + len);
     assert(node);   // not a good idea in real projects
     avl_init(&node->tree);
     node->hmap.next = NULL;
+    node->skey = skey;
+    node->pkey = prefix_key(name, len);
     node->score = score;
-    node->len = len;
+    node->len = (uint32_t)len;
+    node->has_ttl = false;
+    node->is_int = is_int;
+    if (is_int) {
+        node->isum = skey ^ (1ull << 63);
+    } else {
+        node->sum = score;
+    }
     node->hmap.hcode = str_hash((uint8_t*)name, len);
     memcpy(&node->name[0], name, len);
     return node;
@@ -25,23 +61,67 @@ static size_t min(size_t lhs, size_t rhs) {
     return lhs < rhs ? lhs : rhs;
 }
 
+// a (score, name) tuple with its sort key
+struct ZKey {
+    uint64_t skey = 0;
+    uint64_t pkey = 0;
+    const char* name = NULL;
+    size_t len = 0;
+};
+
+static ZKey zkey_make(uint64_t skey, const char* name, size_t len) {
+    ZKey key;
+    key.skey = skey;
+    key.pkey = prefix_key(name, len);
+    key.name = name;
+    key.len = len;
+    return key;
+}
+
 // compare by the (score, name) tuple
-static bool zless(AVLNode* lhs, double score, const char* name, size_t len) {
+static bool zless(AVLNode* lhs, const ZKey &key) {
     // get the address of ZNode from AVLNode which is inside it
     ZNode* zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) {
-        return zl->score < score;
+    if (zl->skey != key.skey) {
+        return zl->skey < key.skey;
+    }
+    if (zl->pkey != key.pkey) {
+        return zl->pkey < key.pkey;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    // the same prefix, names shorter than 8 bytes are zero padded
+    int rv = memcmp(zl->name, key.name, min(zl->len, key.len));
     if (rv != 0) {
         return rv < 0;
     }
-    return zl->len < len;
+    return zl->len < key.len;
 }
 
 static bool zless(AVLNode* lhs, AVLNode* rhs) {
     ZNode* zr = container_of(rhs, ZNode, tree);
-    return zless(lhs, zr->score, zr->name, zr->len);
+    ZKey key;
+    key.skey = zr->skey;
+    key.pkey = zr->pkey;
+    key.name = zr->name;
+    key.len = zr->len;
+    return zless(lhs, key);
+}
+
+static double tree_sum(AVLNode* node) {
+    return node ? container_of(node, ZNode, tree)->sum : 0;
+}
+
+static uint64_t tree_isum(AVLNode* node) {
+    return node ? container_of(node, ZNode, tree)->isum : 0;
+}
+
+// the augmentation of the AVL tree
+static void znode_augment(AVLNode* node) {
+    ZNode* znode = container_of(node, ZNode, tree);
+    if (znode->is_int) {
+        znode->isum = (uint64_t)znode_iscore(znode) + tree_isum(node->left) + tree_isum(node->right);
+    } else {
+        znode->sum = znode->score + tree_sum(node->left) + tree_sum(node->right);
+    }
 }
 
 // insert into the AVL tree
@@ -54,36 +134,68 @@ static void tree_insert(ZSet* zset, ZNode* node) {
     }
     *from = &node->tree;            // attach the new node
     node->tree.parent = parent;
-    zset->root = avl_fix(&node->tree);
+    zset->root = avl_fix(&node->tree, &znode_augment);
+    // the cached ends
+    if (!zset->min || zless(&node->tree, &zset->min->tree)) {
+        zset->min = node;
+    }
+    if (!zset->max || zless(&zset->max->tree, &node->tree)) {
+        zset->max = node;
+    }
+}
+
+// detach from the AVL tree
+static void tree_remove(ZSet* zset, ZNode* node) {
+    if (zset->min == node) {
+        zset->min = znode_offset(node, +1);
+    }
+    if (zset->max == node) {
+        zset->max = znode_offset(node, -1);
+    }
+    zset->root = avl_del(&node->tree, &znode_augment);
 }
 
 // update the score of an existing node
-static void zset_update(ZSet* zset, ZNode* node, double score) {
-    if (node->score == score) {
+static void zset_update(ZSet* zset, ZNode* node, uint64_t skey, double score) {
+    if (node->skey == skey) {
         return;
     }
     // detach the tree node
-    zset->root = avl_del(&node->tree);
+    tree_remove(zset, node);
     avl_init(&node->tree);
     // reinsert the tree node
+    node->skey = skey;
     node->score = score;
     tree_insert(zset, node);
 }
 
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_insert(ZSet* zset, const char* name, size_t len, double score) {
+static bool zset_insert_key(ZSet* zset, const char* name, size_t len,
+    uint64_t skey, double score)
+{
     ZNode* node = zset_lookup(zset, name, len);
     if (node) {
-        zset_update(zset, node, score);
+        zset_update(zset, node, skey, score);
         return false;
     } else {
-        node = znode_new(name, len, score);
+        node = znode_new(name, len, skey, score, zset->int_scores);
         hm_insert(&zset->hmap, &node->hmap);
         tree_insert(zset, node);
         return true;
     }
 }
 
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_insert(ZSet* zset, const char* name, size_t len, double score) {
+    assert(!zset->int_scores);
+    return zset_insert_key(zset, name, len, score_key(score), score);
+}
+
+// the same for a zset of int scores
+bool zset_insert_int(ZSet* zset, const char* name, size_t len, int64_t score) {
+    assert(zset->int_scores);
+    return zset_insert_key(zset, name, len, int_key(score), (double)score);
+}
+
 // a helper structure for the hashtable lookup
 struct HKey {
     HNode node;
@@ -100,18 +212,51 @@ static bool hcmp(HNode* node, HNode* key) {
     return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
+static ZNode* zset_lookup_hcode(ZSet* zset, const char* name, size_t len, uint64_t hcode) {
+    HKey key;
+    key.node.hcode = hcode;
+    key.name = name;
+    key.len = len;
+    HNode* found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    return found ? container_of(found, ZNode, hmap) : NULL;
+}
+
 // lookup by name
 ZNode* zset_lookup(ZSet* zset, const char* name, size_t len) {
     if (!zset->root) {
         return NULL;
     }
+    return zset_lookup_hcode(zset, name, len, str_hash((uint8_t*)name, len));
+}
 
-    HKey key;
-    key.node.hcode = str_hash((uint8_t*)name, len);
-    key.name = name;
-    key.len = len;
-    HNode* found = hm_lookup(&zset->hmap, &key.node, &hcmp);
-    return found ? container_of(found, ZNode, hmap) : NULL;
+// lookup many names, the memory accesses of a window of names are issued
+// before any of them is resolved, so the DRAM latencies overlap
+void zset_lookup_many(ZSet* zset, size_t n, const char* const* names, const size_t* lens, ZNode** out) {
+    const size_t k_window = 16;
+    uint64_t hcodes[k_window];
+    for (size_t base = 0; base < n; base += k_window) {
+        size_t m = min(n - base, k_window);
+        if (!zset->root) {
+            memset(&out[base], 0, m * sizeof(ZNode*));
+            continue;
+        }
+        // the hashtable slots
+        for (size_t i = 0; i < m; i++) {
+            hcodes[i] = str_hash((uint8_t*)names[base + i], lens[base + i]);
+            hm_prefetch(&zset->hmap, hcodes[i]);
+        }
+        // the nodes, both the hashtable link and the name
+        for (size_t i = 0; i < m; i++) {
+            HNode* head = hm_chain_head(&zset->hmap, hcodes[i]);
+            if (head) {
+                __builtin_prefetch(head);
+                __builtin_prefetch(container_of(head, ZNode, hmap)->name);
+            }
+        }
+        for (size_t i = 0; i < m; i++) {
+            out[base + i] = zset_lookup_hcode(zset, names[base + i], lens[base + i], hcodes[i]);
+        }
+    }
 }
 
 // delete a node
@@ -124,16 +269,16 @@ void zset_delete(ZSet* zset, ZNode* node) {
     HNode* found = hm_delete(&zset->hmap, &key.node, &hcmp);
     assert(found);
     // remove from the tree
-    zset->root = avl_del(&node->tree);
+    tree_remove(zset, node);
+    zset_set_expire(zset, node, -1);
     // deallocate the node
     znode_del(node);
 }
 
-// find the first (score, name) tuple that is >= key
-ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len) {
+static ZNode* zset_seekge_key(ZSet* zset, const ZKey &key) {
     AVLNode* found = NULL;
     for (AVLNode* node = zset->root; node; ) {
-        if (zless(node, score, name, len)) {
+        if (zless(node, key)) {
             node = node->right;
         } else {
             found = node;
@@ -143,24 +288,313 @@ ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len) {
     return found ? container_of(found, ZNode, tree) : NULL;
 }
 
+// find the first (score, name) tuple that is >= key
+ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len) {
+    if (!zset->int_scores) {
+        return zset_seekge_key(zset, zkey_make(score_key(score), name, len));
+    }
+    // the least int score that is >= score
+    if (score >= 0x1p63) {
+        return NULL;
+    }
+    int64_t iscore = score <= -0x1p63 ? INT64_MIN : (int64_t)ceil(score);
+    return zset_seekge_key(zset, zkey_make(int_key(iscore), name, len));
+}
+
+// the same for an int score
+ZNode* zset_seekge_int(ZSet* zset, int64_t score, const char* name, size_t len) {
+    if (!zset->int_scores) {
+        return zset_seekge(zset, (double)score, name, len);
+    }
+    return zset_seekge_key(zset, zkey_make(int_key(score), name, len));
+}
+
+// by the score of the `like` node, or the first greater score if `name` is NULL
+ZNode* zset_seekge_like(ZSet* zset, ZNode* like, const char* name, size_t len) {
+    if (name) {
+        return zset_seekge_key(zset, zkey_make(like->skey, name, len));
+    }
+    if (like->skey == (uint64_t)-1) {
+        return NULL;
+    }
+    return zset_seekge_key(zset, zkey_make(like->skey + 1, "", 0));
+}
+
 // offset into the succeeding or preceding node
 ZNode* znode_offset(ZNode* node, int64_t offset) {
     AVLNode* tnode = node ? avl_offset(&node->tree, offset) : NULL;
     return tnode ? container_of(tnode, ZNode, tree) : NULL;
 }
 
-static void tree_dispose(AVLNode* node) {
+// free the nodes of a tree detached from the zset
+void zset_dispose_tree(AVLNode* node) {
     if (!node) {
         return;
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
+    zset_dispose_tree(node->left);
+    zset_dispose_tree(node->right);
     znode_del(container_of(node, ZNode, tree));
 }
 
+static void ttl_clear(ZSet* zset);
+
 // destroy the zset
 void zset_clear(ZSet* zset) {
+    ttl_clear(zset);
     hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
+    zset_dispose_tree(zset->root);
     zset->root = NULL;
+    zset->min = zset->max = NULL;
+}
+
+// the node of the 0-based rank in O(log N)
+ZNode* zset_at(ZSet* zset, uint32_t rank) {
+    AVLNode* root = zset->root;
+    if (rank >= avl_cnt(root)) {
+        return NULL;
+    }
+    return znode_offset(container_of(root, ZNode, tree),
+        (int64_t)rank - (int64_t)avl_cnt(root->left));
+}
+
+static void tree_unindex(ZSet* zset, AVLNode* node) {
+    if (!node) {
+        return;
+    }
+    tree_unindex(zset, node->left);
+    tree_unindex(zset, node->right);
+    ZNode* znode = container_of(node, ZNode, tree);
+    HKey key;
+    key.node.hcode = znode->hmap.hcode;
+    key.name = znode->name;
+    key.len = znode->len;
+    HNode* found = hm_delete(&zset->hmap, &key.node, &hcmp);
+    assert(found);
+    (void)found;
+    zset_set_expire(zset, znode, -1);
+}
+
+// detach the nodes of rank [begin, end) as a separate tree, the split and join
+// of the tree are O(log N), the nodes are also removed from the hashtable
+AVLNode* zset_detach_range(ZSet* zset, uint32_t begin, uint32_t end) {
+    AVLNode* left = NULL;
+    AVLNode* mid = NULL;
+    AVLNode* right = NULL;
+    avl_split(zset->root, begin, &left, &right, &znode_augment);
+    avl_split(right, end - begin, &mid, &right, &znode_augment);
+    zset->root = avl_join2(left, right, &znode_augment);
+    tree_unindex(zset, mid);
+    // the ends may be removed
+    zset->min = zset_at(zset, 0);
+    zset->max = zset_at(zset, avl_cnt(zset->root) - 1);
+    return mid;
+}
+
+// the sum of [begin, end) relative to the subtree, only the boundary paths
+// are descended, the subtrees inside the range use the augmentation
+static double tree_sum_range(AVLNode* node, uint32_t begin, uint32_t end) {
+    if (!node || begin >= end) {
+        return 0;
+    }
+    if (begin == 0 && end == node->cnt) {
+        return tree_sum(node);
+    }
+    uint32_t nleft = avl_cnt(node->left);
+    double sum = 0;
+    if (begin < nleft) {
+        sum += tree_sum_range(node->left, begin, end < nleft ? end : nleft);
+    }
+    if (begin <= nleft && nleft < end) {
+        sum += container_of(node, ZNode, tree)->score;
+    }
+    if (end > nleft + 1) {
+        uint32_t rbegin = begin > nleft + 1 ? begin - nleft - 1 : 0;
+        sum += tree_sum_range(node->right, rbegin, end - nleft - 1);
+    }
+    return sum;
+}
+
+// the sum of scores of rank [begin, end) in O(log N)
+double zset_sum_range(ZSet* zset, uint32_t begin, uint32_t end) {
+    assert(!zset->int_scores);
+    return tree_sum_range(zset->root, begin, end);
+}
+
+// the same for int scores, unsigned so that an overflow wraps around
+static uint64_t tree_isum_range(AVLNode* node, uint32_t begin, uint32_t end) {
+    if (!node || begin >= end) {
+        return 0;
+    }
+    if (begin == 0 && end == node->cnt) {
+        return tree_isum(node);
+    }
+    uint32_t nleft = avl_cnt(node->left);
+    uint64_t sum = 0;
+    if (begin < nleft) {
+        sum += tree_isum_range(node->left, begin, end < nleft ? end : nleft);
+    }
+    if (begin <= nleft && nleft < end) {
+        sum += (uint64_t)znode_iscore(container_of(node, ZNode, tree));
+    }
+    if (end > nleft + 1) {
+        uint32_t rbegin = begin > nleft + 1 ? begin - nleft - 1 : 0;
+        sum += tree_isum_range(node->right, rbegin, end - nleft - 1);
+    }
+    return sum;
+}
+
+int64_t zset_isum_range(ZSet* zset, uint32_t begin, uint32_t end) {
+    assert(zset->int_scores);
+    return (int64_t)tree_isum_range(zset->root, begin, end);
+}
+
+// the TTL of a member, outside of the `ZNode` that is mostly without one
+struct ZTTL {
+    HNode hmap;             // by the member's hash code
+    ZNode* node = NULL;
+    size_t heap_idx = -1;   // in `ZSetTTL::heap`
+};
+
+static bool ttl_eq(HNode* node, HNode* key) {
+    return container_of(node, ZTTL, hmap)->node == container_of(key, ZTTL, hmap)->node;
+}
+
+static ZTTL* ttl_lookup(ZSet* zset, ZNode* node) {
+    if (!node->has_ttl) {
+        return NULL;
+    }
+    ZTTL key;
+    key.hmap.hcode = node->hmap.hcode;
+    key.node = node;
+    HNode* found = hm_lookup(&zset->ttl->nodes, &key.hmap, &ttl_eq);
+    assert(found);
+    return container_of(found, ZTTL, hmap);
+}
+
+static void ttl_clear(ZSet* zset) {
+    if (!zset->ttl) {
+        return;
+    }
+    for (const HeapItem &item : zset->ttl->heap) {
+        ZTTL* ttl = container_of(item.ref, ZTTL, heap_idx);
+        ttl->node->has_ttl = false;
+        delete ttl;
+    }
+    hm_clear(&zset->ttl->nodes);
+    delete zset->ttl;
+    zset->ttl = NULL;
+}
+
+// set or remove (if < 0) the expiration time of a member
+void zset_set_expire(ZSet* zset, ZNode* node, int64_t expire_at) {
+    ZTTL* ttl = ttl_lookup(zset, node);
+    if (expire_at < 0 && ttl) {
+        hm_delete(&zset->ttl->nodes, &ttl->hmap, &ttl_eq);
+        heap_delete(zset->ttl->heap, ttl->heap_idx);
+        node->has_ttl = false;
+        delete ttl;
+        if (zset->ttl->heap.empty()) {
+            ttl_clear(zset);
+        }
+    } else if (expire_at >= 0) {
+        if (!ttl) {
+            if (!zset->ttl) {
+                zset->ttl = new ZSetTTL();
+            }
+            ttl = new ZTTL();
+            ttl->hmap.hcode = node->hmap.hcode;
+            ttl->node = node;
+            hm_insert(&zset->ttl->nodes, &ttl->hmap);
+            node->has_ttl = true;
+        }
+        HeapItem item = {(uint64_t)expire_at, &ttl->heap_idx};
+        heap_upsert(zset->ttl->heap, ttl->heap_idx, item);
+    }
+}
+
+// the expiration time of a member, -1 if none
+int64_t zset_get_expire(ZSet* zset, ZNode* node) {
+    ZTTL* ttl = ttl_lookup(zset, node);
+    return ttl ? (int64_t)zset->ttl->heap[ttl->heap_idx].val : -1;
+}
+
+// the earliest expiration time of the members, -1 if none
+uint64_t zset_next_expire(ZSet* zset) {
+    return zset->ttl ? zset->ttl->heap[0].val : (uint64_t)-1;
+}
+
+// delete at most `max` members expired at `now`, returns the number deleted
+size_t zset_expire(ZSet* zset, uint64_t now, size_t max) {
+    size_t n = 0;
+    while (n < max && zset->ttl && zset->ttl->heap[0].val <= now) {
+        zset_delete(zset, container_of(zset->ttl->heap[0].ref, ZTTL, heap_idx)->node);
+        n++;
+    }
+    return n;
+}
+
+struct DefragCtx {
+    ZSet* zset = NULL;
+    std::vector<void*>* spares = NULL;
+};
+
+static void znode_census(HNode* hnode, void*) {
+    defrag_census_add(container_of(hnode, ZNode, hmap));
+}
+
+// move a node on a sparse page to a denser one, and fix the links to it
+static HNode* znode_relocate(HNode* hnode, void* arg) {
+    DefragCtx* ctx = (DefragCtx*)arg;
+    ZNode* node = container_of(hnode, ZNode, hmap);
+    if (!defrag_sparse(node)) {
+        return hnode;
+    }
+    ZNode* fresh = (ZNode*)malloc(sizeof(ZNode) + node->len);
+    assert(fresh);
+    if (!defrag_better(node, fresh)) {
+        // keep it allocated so that the next malloc() returns another chunk
+        ctx->spares->push_back(fresh);
+        return hnode;
+    }
+    memcpy(fresh, node, sizeof(ZNode) + node->len);
+    // the tree links
+    AVLNode* parent = fresh->tree.parent;
+    if (!parent) {
+        ctx->zset->root = &fresh->tree;
+    } else if (parent->left == &node->tree) {
+        parent->left = &fresh->tree;
+    } else {
+        parent->right = &fresh->tree;
+    }
+    if (fresh->tree.left) {
+        fresh->tree.left->parent = &fresh->tree;
+    }
+    if (fresh->tree.right) {
+        fresh->tree.right->parent = &fresh->tree;
+    }
+    if (ZTTL* ttl = ttl_lookup(ctx->zset, node)) {
+        ttl->node = fresh;
+    }
+    if (ctx->zset->min == node) {
+        ctx->zset->min = fresh;
+    }
+    if (ctx->zset->max == node) {
+        ctx->zset->max = fresh;
+    }
+    znode_del(node);
+    return &fresh->hmap;    // the hashtable link is updated by the caller
+}
+
+// add the nodes to the page map, returns the next cursor or 0 when done
+size_t zset_defrag_census(ZSet* zset, size_t cursor, size_t nslots) {
+    return hm_scan(&zset->hmap, cursor, nslots, &znode_census, NULL);
+}
+
+// reallocate the nodes incrementally to reduce memory fragmentation,
+// returns the next cursor or 0 when done, the `spares` are to be free()ed
+size_t zset_defrag(ZSet* zset, size_t cursor, size_t nslots, std::vector<void*> &spares) {
+    DefragCtx ctx;
+    ctx.zset = zset;
+    ctx.spares = &spares;
+    return hm_relocate(&zset->hmap, cursor, nslots, &znode_relocate, &ctx);
 }
\ No newline at end of file
@@ -1,24 +1,72 @@
 #pragma once
 
+#include <vector>
 #include "avl.h"
 #include "hashtable.h"
+#include "heap.h"
+
+struct ZNode;
+
+// the members with a TTL, allocated with the first one, most zsets have none
+struct ZSetTTL {
+    HMap nodes;                     // `ZTTL` by the member's hash code
+    std::vector<HeapItem> heap;     // keyed by the expiration time
+};
 
 struct ZSet {
     AVLNode* root = NULL;   // index by (score, name)
     HMap hmap;              // index by name
+    // the leftmost and the rightmost nodes, for popping without a descent
+    ZNode* min = NULL;
+    ZNode* max = NULL;
+    ZSetTTL* ttl = NULL;
+    // scores are exact int64_t values, see `znode_iscore()`, set when empty
+    bool int_scores = false;
 };
 
 struct ZNode {
     AVLNode tree;
+    // the sort key: the order-preserving score bits then the name prefix,
+    // most comparisons are decided here without touching the name
+    uint64_t skey = 0;
+    uint64_t pkey = 0;
     HNode hmap;
-    double score = 0;
-    size_t len = 0;
+    double score = 0;       // also set for int scores, maybe rounded
+    // the sum of scores in the subtree, exact for int scores, where it
+    // wraps around like uint64_t if it doesn't fit in int64_t
+    union {
+        double sum = 0;
+        uint64_t isum;
+    };
+    uint32_t len = 0;
+    bool has_ttl = false;   // in `ZSet::ttl`
+    bool is_int = false;    // the zset has int scores, which sum is kept
     char name[0];           // flexible array
 };
 
+// the exact score of a zset of int scores, kept in the sort key
+inline int64_t znode_iscore(const ZNode* node) {
+    return (int64_t)(node->skey ^ (1ull << 63));
+}
+
 bool zset_insert(ZSet* zset, const char* name, size_t len, double score);
+bool zset_insert_int(ZSet* zset, const char* name, size_t len, int64_t score);
 ZNode* zset_lookup(ZSet* zset, const char* name, size_t len);
+void zset_lookup_many(ZSet* zset, size_t n, const char* const* names, const size_t* lens, ZNode** out);
 void zset_delete(ZSet* zset, ZNode* node);
 ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len);
+ZNode* zset_seekge_int(ZSet* zset, int64_t score, const char* name, size_t len);
+ZNode* zset_seekge_like(ZSet* zset, ZNode* like, const char* name, size_t len);
 void zset_clear(ZSet* zset);
-ZNode* znode_offset(ZNode* node, int64_t offset);
\ No newline at end of file
+ZNode* znode_offset(ZNode* node, int64_t offset);
+ZNode* zset_at(ZSet* zset, uint32_t rank);
+AVLNode* zset_detach_range(ZSet* zset, uint32_t begin, uint32_t end);
+void zset_dispose_tree(AVLNode* root);
+double zset_sum_range(ZSet* zset, uint32_t begin, uint32_t end);
+int64_t zset_isum_range(ZSet* zset, uint32_t begin, uint32_t end);
+void zset_set_expire(ZSet* zset, ZNode* node, int64_t expire_at);
+int64_t zset_get_expire(ZSet* zset, ZNode* node);
+uint64_t zset_next_expire(ZSet* zset);
+size_t zset_expire(ZSet* zset, uint64_t now, size_t max);
+size_t zset_defrag_census(ZSet* zset, size_t cursor, size_t nslots);
+size_t zset_defrag(ZSet* zset, size_t cursor, size_t nslots, std::vector<void*> &spares);
\ No newline at end of file